@@ -0,0 +1,85 @@
+#ifndef ASYNC_TRANSPORT_MPSC_HPP
+#define ASYNC_TRANSPORT_MPSC_HPP
+
+#include <atomic>
+
+namespace msctl { namespace async_transport {
+
+    struct mpsc_node {
+        std::atomic<mpsc_node *> next_;
+
+        mpsc_node( )
+            :next_(nullptr)
+        { }
+    };
+
+    /// intrusive multi-producer/single-consumer queue (Vyukov).
+    /// push( ) is wait-free; pop( ) may return nullptr while a producer
+    /// is between its two steps, even if the queue is not empty.
+    template <typename T>
+    class mpsc_queue {
+
+        std::atomic<mpsc_node *>  head_;
+        mpsc_node                *tail_;
+        mpsc_node                 stub_;
+
+        void push_node( mpsc_node *node )
+        {
+            node->next_.store( nullptr, std::memory_order_relaxed );
+            mpsc_node *prev = head_.exchange( node,
+                                              std::memory_order_acq_rel );
+            prev->next_.store( node, std::memory_order_release );
+        }
+
+    public:
+
+        mpsc_queue( )
+            :head_(&stub_)
+            ,tail_(&stub_)
+        { }
+
+        mpsc_queue( const mpsc_queue & ) = delete;
+        mpsc_queue &operator = ( const mpsc_queue & ) = delete;
+
+        void push( T *node )
+        {
+            push_node( node );
+        }
+
+        T *pop( )
+        {
+            mpsc_node *tail = tail_;
+            mpsc_node *next = tail->next_.load( std::memory_order_acquire );
+
+            if( tail == &stub_ ) {
+                if( !next ) {
+                    return nullptr;
+                }
+                tail_ = next;
+                tail  = next;
+                next  = next->next_.load( std::memory_order_acquire );
+            }
+
+            if( next ) {
+                tail_ = next;
+                return static_cast<T *>(tail);
+            }
+
+            if( tail != head_.load( std::memory_order_acquire ) ) {
+                return nullptr;
+            }
+
+            push_node( &stub_ );
+
+            next = tail->next_.load( std::memory_order_acquire );
+            if( next ) {
+                tail_ = next;
+                return static_cast<T *>(tail);
+            }
+            return nullptr;
+        }
+    };
+
+}}
+
+#endif // ASYNC_TRANSPORT_MPSC_HPP
@@ -3,24 +3,35 @@
 
 #include "boost/asio.hpp"
 
+#include "udp-buffer-pool.hpp"
+#include "udp-handler-memory.hpp"
+#include "udp-threading.hpp"
+#include "async-transport-mpsc.hpp"
+
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <thread>
 
 #include <string>
-#include <queue>
+#include <vector>
 
 namespace msctl { namespace async_transport {
 
-    template <typename ST>
-    class point_iface: public std::enable_shared_from_this<point_iface<ST> > {
+    /// TP: strand_threading, or single_threading when one thread runs
+    /// the io_service (see udp-threading.hpp)
+    template <typename ST, typename TP = strand_threading>
+    class point_iface:
+            public std::enable_shared_from_this<point_iface<ST, TP> > {
 
-        typedef point_iface<ST> this_type;
+        typedef point_iface<ST, TP> this_type;
 
     public:
 
         typedef std::shared_ptr<this_type> shared_type;
         typedef std::weak_ptr<this_type>   weak_type;
         typedef ST stream_type;
+        typedef typename TP::dispatcher dispatcher_type;
 
         enum point_options {
             OPT_NONE              = 0x00,
@@ -36,42 +47,136 @@ namespace msctl { namespace async_transport {
 
         typedef std::string message_type;
 
-        struct queue_value {
-
-            typedef std::shared_ptr<queue_value> shared_type;
+        struct queue_value: public mpsc_node {
 
             message_type    message_;
+            buffer_handle   buffer_;
             write_closure   success_;
 
-            queue_value( const char *data, size_t length )
-                :message_(data, length)
-            { }
+            /// a recycled node keeps nothing of its last message
+            void clear( )
+            {
+                buffer_.reset( );
+                success_ = nullptr;
+                if( !message_.empty( ) ) {
+                    message_type( ).swap( message_ );
+                }
+            }
+
+            queue_value *next_free( ) const
+            {
+                return static_cast<queue_value *>(
+                            next_.load( std::memory_order_relaxed ) );
+            }
+
+            const char *data( ) const
+            {
+                return buffer_
+                     ? reinterpret_cast<const char *>(buffer_.data( ))
+                     : message_.c_str( );
+            }
 
-            static
-            shared_type create( const char *data, size_t length )
+            size_t size( ) const
             {
-                return std::make_shared<queue_value>( data, length );
+                return buffer_ ? buffer_.size( ) : message_.size( );
+            }
+
+            /// on_transform_message works on strings only
+            std::string &message( )
+            {
+                if( buffer_ ) {
+                    message_.assign( data( ), size( ) );
+                    buffer_.reset( );
+                }
+                return message_;
             }
         };
 
-        typedef typename queue_value::shared_type  queue_value_sptr;
+        typedef mpsc_queue<queue_value> message_queue_type;
 
-        typedef std::queue<queue_value_sptr> message_queue_type;
+        /// gather_bufs_ as a buffer sequence; asio keeps a copy of the
+        /// sequence in its op, and this one copies without a malloc
+        struct gather_view {
+            typedef boost::asio::const_buffer   value_type;
+            typedef const value_type           *const_iterator;
+            const_iterator  begin_;
+            const_iterator  end_;
+            const_iterator begin( ) const
+            {
+                return begin_;
+            }
+            const_iterator end( ) const
+            {
+                return end_;
+            }
+        };
 
         typedef void (this_type::*call_impl)( );
+        typedef void (this_type::*prepare_impl)( queue_value & );
 
         boost::asio::io_service          &ios_;
-        boost::asio::io_service::strand   write_dispatcher_;
+        dispatcher_type                   write_dispatcher_;
         stream_type                       stream_;
 
+        /// producers push from any thread; write_pending_ counts every
+        /// message not completed yet, including the gathered ones
         message_queue_type                write_queue_;
+        std::atomic<size_t>               write_pending_;
+        std::atomic<size_t>               write_peak_;
+
+        /// completed nodes for reuse, as many as the queue has been
+        /// deep. The dispatcher pushes; producers take one at a time
+        /// under free_taking_, which keeps the pop free of ABA
+        std::atomic<queue_value *>        free_values_;
+        std::atomic<bool>                 free_taking_;
+
+        /// dispatcher only: messages in the current vectored write
+        std::vector<queue_value *>        gather_;
+        std::vector<boost::asio::const_buffer> gather_bufs_;
+        size_t                            gather_offset_;
+        size_t                            gather_max_count_;
+        size_t                            gather_max_bytes_;
 
         std::vector<char>                 read_buffer_;
         call_impl                         read_impl_;
-        call_impl                         async_write_impl_;
+        prepare_impl                      prepare_impl_;
 
         bool                              active_;
 
+        handler_memory                    read_mem_;
+        handler_memory                    write_mem_;
+        handler_memory                    flush_mem_;
+
+        /// completion functors used instead of std::bind
+        struct write_call {
+            this_type   *self_;
+            shared_type  inst_;
+            void operator ( )( const boost::system::error_code &error,
+                               size_t const bytes )
+            {
+                self_->write_handler( error, bytes, inst_ );
+            }
+        };
+
+        struct flush_call {
+            this_type   *self_;
+            shared_type  inst_;
+            void operator ( )( )
+            {
+                self_->flush_impl( inst_ );
+            }
+        };
+
+        struct read_call {
+            this_type   *self_;
+            shared_type  inst_;
+            void operator ( )( const boost::system::error_code &error,
+                               size_t const bytes )
+            {
+                self_->read_handler( error, bytes, inst_ );
+            }
+        };
+
         static
         call_impl get_read_dispatch( std::uint32_t opts )
         {
@@ -81,11 +186,11 @@ namespace msctl { namespace async_transport {
         }
 
         static
-        call_impl get_message_transform( std::uint32_t opts )
+        prepare_impl get_message_transform( std::uint32_t opts )
         {
             return ( opts & OPT_TRANSFORM_MESSAGE )
-                   ? &this_type::async_write_transform
-                   : &this_type::async_write_no_transform;
+                   ? &this_type::prepare_transform
+                   : &this_type::prepare_no_transform;
         }
 
     protected:
@@ -96,11 +201,21 @@ namespace msctl { namespace async_transport {
             :ios_(ios)
             ,write_dispatcher_(ios_)
             ,stream_(ios_)
+            ,write_pending_(0)
+            ,write_peak_(0)
+            ,free_values_(nullptr)
+            ,free_taking_(false)
+            ,gather_offset_(0)
+            ,gather_max_count_(64)
+            ,gather_max_bytes_(64 * 1024)
             ,read_buffer_(read_block_size)
             ,read_impl_(get_read_dispatch(opts))
-            ,async_write_impl_(get_message_transform(opts))
+            ,prepare_impl_(get_message_transform(opts))
             ,active_(true)
-        { }
+        {
+            gather_.reserve( gather_max_count_ );
+            gather_bufs_.reserve( gather_max_count_ );
+        }
 
     private:
 
@@ -121,44 +236,139 @@ namespace msctl { namespace async_transport {
 
         /// =========== queue wrap calls =========== ///
 
-        void queue_push( const queue_value_sptr &new_mess )
+        /// any thread; a new node only while the free list is empty
+        queue_value *take_value( )
+        {
+            while( free_taking_.exchange( true, std::memory_order_acquire ) ) {
+                std::this_thread::yield( );
+            }
+            queue_value *top = free_values_.load( std::memory_order_acquire );
+            while( top && !free_values_.compare_exchange_weak( top,
+                                            top->next_free( ),
+                                            std::memory_order_acquire ) )
+            { }
+            free_taking_.store( false, std::memory_order_release );
+            return top ? top : new queue_value;
+        }
+
+        /// dispatcher only; the first count gathered nodes in one push
+        void give_values( size_t count )
+        {
+            queue_value *first = gather_[0];
+            queue_value *last  = gather_[count - 1];
+            for( size_t i = 0; i + 1 < count; ++i ) {
+                gather_[i]->next_.store( gather_[i + 1],
+                                         std::memory_order_relaxed );
+            }
+            queue_value *top = free_values_.load( std::memory_order_relaxed );
+            do {
+                last->next_.store( top, std::memory_order_relaxed );
+            } while( !free_values_.compare_exchange_weak( top, first,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed ) );
+        }
+
+        /// true if this was the first message of an idle queue
+        bool queue_push( queue_value *new_mess )
         {
             write_queue_.push( new_mess );
+            const size_t was = write_pending_.fetch_add( 1,
+                                            std::memory_order_acq_rel );
+            size_t peak = write_peak_.load( std::memory_order_relaxed );
+            while( ( peak <= was ) &&
+                   !write_peak_.compare_exchange_weak( peak, was + 1,
+                                            std::memory_order_relaxed ) )
+            { }
+            return was == 0;
         }
 
-        const queue_value_sptr &queue_top( ) const
+        /// write_pending_ says a message is there; a producer may still
+        /// be linking it in
+        queue_value *queue_next( )
         {
-            return write_queue_.front( );
+            queue_value *next = write_queue_.pop( );
+            while( !next ) {
+                std::this_thread::yield( );
+                next = write_queue_.pop( );
+            }
+            return next;
         }
 
-        void queue_pop( )
+        /// completes the first count gathered messages;
+        /// false if the queue became idle
+        bool queue_pop( size_t count, const boost::system::error_code &err )
         {
-            write_queue_.pop( );
+            for( size_t i = 0; i < count; ++i ) {
+                queue_value *top = gather_[i];
+                if( top->success_ ) {
+                    top->success_( err );
+                }
+                top->clear( );
+            }
+            if( count ) {
+                give_values( count );
+            }
+            gather_.erase( gather_.begin( ), gather_.begin( ) + count );
+            return write_pending_.fetch_sub( count,
+                                     std::memory_order_acq_rel ) != count;
         }
 
-        bool queue_empty( ) const
+        /// takes messages off the queue until one of the limits is hit;
+        /// the first one is always taken, whatever the limits say
+        void queue_gather( )
         {
-            return write_queue_.empty( );
+            size_t bytes = 0;
+            for( auto *v: gather_ ) {
+                bytes += v->size( );
+            }
+            bytes -= gather_offset_;
+
+            size_t ready = write_pending_.load( std::memory_order_acquire )
+                         - gather_.size( );
+
+            while( ready-- && ( gather_.empty( )
+                             || ( ( gather_.size( ) < gather_max_count_ )
+                               && ( bytes < gather_max_bytes_ ) ) ) )
+            {
+                queue_value *next = queue_next( );
+                (this->*prepare_impl_)( *next );
+                bytes += next->size( );
+                gather_.push_back( next );
+            }
         }
 
         /// ================ write ================ ///
 
-        void async_write( )
+        void prepare_transform( queue_value &val )
         {
-            (this->*async_write_impl_)( );
+            std::string &mess( val.message( ) );
+            mess.assign( on_transform_message( mess ) );
         }
 
-        void async_write( const char *data, size_t length, size_t total )
+        void prepare_no_transform( queue_value & )
+        { }
+
+        void async_write( )
         {
-            namespace ph = std::placeholders;
+            queue_gather( );
+
+            gather_bufs_.clear( );
+            size_t offset = gather_offset_;
+            for( auto *v: gather_ ) {
+                gather_bufs_.push_back(
+                    boost::asio::buffer( v->data( ) + offset,
+                                         v->size( ) - offset ) );
+                offset = 0;
+            }
+
             try {
-                stream_.async_write_some(
-                        boost::asio::buffer( data, length ),
+                write_call call = { this, this->shared_from_this( ) };
+                gather_view view = { gather_bufs_.data( ),
+                                     gather_bufs_.data( )
+                                   + gather_bufs_.size( ) };
+                stream_.async_write_some( view,
                         write_dispatcher_.wrap(
-                            std::bind( &this_type::write_handler, this,
-                                        ph::_1, ph::_2,
-                                        length, total,
-                                        this->shared_from_this( ))
+                            make_alloc_handler( write_mem_, call )
                         )
                 );
             } catch( const std::exception & ) {
@@ -167,91 +377,72 @@ namespace msctl { namespace async_transport {
             }
         }
 
-        void async_write_transform(  )
-        {
-            std::string &top( queue_top( )->message_ );
-
-            top.assign( on_transform_message( top ) );
-
-            async_write( top.c_str( ), top.size( ), 0 );
-        }
-
-        void async_write_no_transform(  )
-        {
-            const std::string &top( queue_top( )->message_ );
-            async_write( top.c_str( ), top.size( ), 0);
-        }
-
         void write_handler( const boost::system::error_code &error,
-                            size_t const bytes,
-                            size_t const length,
-                            size_t       total,
+                            size_t       bytes,
                             shared_type  /*this_inst*/ )
         {
-            queue_value &top( *queue_top( ) );
+            size_t done = 0;
 
             if( !error ) {
 
-                if( bytes < length ) {
-
-                    total += bytes;
-
-                    const std::string &top_mess( top.message_ );
-                    async_write( top_mess.c_str( ) + total,
-                                 top_mess.size( )  - total, total );
-
-                } else {
-
-                    if( top.success_ ) {
-                        top.success_( error );
-                    }
-
-                    queue_pop( );
-
-                    if( !queue_empty( ) ) {
-                        async_write(  );
-                    }
-
-                }
-            } else {
-                /// generate error
-                if( top.success_ ) {
-                    top.success_( error );
+                bytes += gather_offset_;
+                while( ( done < gather_.size( ) )
+                    && ( bytes >= gather_[done]->size( ) ) )
+                {
+                    bytes -= gather_[done++]->size( );
                 }
+                /// the rest is the sent part of a message
+                gather_offset_ = bytes;
 
+            } else {
+                /// generate error; the whole gather failed
+                done = gather_.size( );
+                gather_offset_ = 0;
                 on_write_error( error );
-
-                /// pop queue
-                queue_pop( );
-
-                if( !queue_empty( ) ) {
-                    async_write(  );
-                }
             }
 
+            if( queue_pop( done, error ) ) {
+                async_write(  );
+            }
         }
 
-        void write_impl( const queue_value_sptr data, shared_type /*inst*/ )
+        void flush_impl( shared_type /*inst*/ )
         {
-            const bool empty = queue_empty( );
-
-            queue_push( data );
-
-            if( empty ) {
-                async_write(  );
-            }
+            async_write(  );
         }
 
+        /// the copy goes to a slab of the producer's own pool; only a
+        /// message bigger than a slab is kept in a string
         void post_write( const char *data, size_t len,
                          const write_closure &close )
         {
-            queue_value_sptr inst(queue_value::create( data, len ));
+            queue_value *inst = take_value( );
+            buffer_pool &pool( buffer_pool::local( ) );
+            if( len && ( len <= pool.slab_size( ) ) ) {
+                inst->buffer_ = pool.copy( data, len );
+            } else {
+                inst->message_.assign( data, len );
+            }
+            inst->success_ = close;
+            post_write( inst );
+        }
+
+        void post_write( const buffer_handle &buf, const write_closure &close )
+        {
+            queue_value *inst = take_value( );
+            inst->buffer_  = buf;
             inst->success_ = close;
+            post_write( inst );
+        }
 
-            write_dispatcher_.post(
-                std::bind( &this_type::write_impl, this,
-                             inst, this->shared_from_this( ) )
-                );
+        /// only the message that wakes an idle queue posts to the dispatcher
+        void post_write( queue_value *inst )
+        {
+            if( queue_push( inst ) ) {
+                flush_call call = { this, this->shared_from_this( ) };
+                write_dispatcher_.post( make_alloc_handler( flush_mem_,
+                                                            call ) );
+            }
         }
 
         /// ================ read ================ ///
@@ -275,27 +466,22 @@ namespace msctl { namespace async_transport {
 
         void start_read_impl_wrap(  )
         {
-            namespace ph = std::placeholders;
-            /// use strand::wrap for callback
+            /// the dispatcher wraps the callback
+            read_call call = { this, this->shared_from_this( ) };
             stream_.async_read_some(
                 boost::asio::buffer(&read_buffer_[0], read_buffer_.size( )),
                 write_dispatcher_.wrap(
-                    std::bind( &this_type::read_handler, this,
-                        ph::_1, ph::_2,
-                        this->shared_from_this( ))
+                    make_alloc_handler( read_mem_, call )
                 )
              );
         }
 
         void start_read_impl(  )
         {
-            namespace ph = std::placeholders;
+            read_call call = { this, this->shared_from_this( ) };
             stream_.async_read_some(
                 boost::asio::buffer(&read_buffer_[0], read_buffer_.size( )),
-                std::bind( &this_type::read_handler, this,
-                    ph::_1, ph::_2,
-                    this->shared_from_this( )
-                )
+                make_alloc_handler( read_mem_, call )
             );
         }
 
@@ -321,7 +507,21 @@ namespace msctl { namespace async_transport {
 
     public:
 
-        virtual ~point_iface( ) { }
+        virtual ~point_iface( )
+        {
+            for( auto *v: gather_ ) {
+                delete v;
+            }
+            while( queue_value *next = write_queue_.pop( ) ) {
+                delete next;
+            }
+            queue_value *top = free_values_.load( );
+            while( top ) {
+                queue_value *next = top->next_free( );
+                delete top;
+                top = next;
+            }
+        }
 
         boost::asio::io_service &get_io_service( )
         {
@@ -333,12 +533,12 @@ namespace msctl { namespace async_transport {
             return ios_;
         }
 
-        const boost::asio::io_service::strand &get_dispatcher( ) const
+        const dispatcher_type &get_dispatcher( ) const
         {
             return write_dispatcher_;
         }
 
-        boost::asio::io_service::strand &get_dispatcher( )
+        dispatcher_type &get_dispatcher( )
         {
             return write_dispatcher_;
         }
@@ -375,6 +575,41 @@ namespace msctl { namespace async_transport {
             post_write( data, length, closuse );
         }
 
+        /// sends the pooled buffer without copying it
+        void write( const buffer_handle &buf )
+        {
+            post_write( buf, write_closure( ) );
+        }
+
+        void write_post_notify( const buffer_handle &buf,
+                                const write_closure &closuse )
+        {
+            post_write( buf, closuse );
+        }
+
+        /// messages queued and not completed yet; from any thread
+        size_t write_queue_depth( ) const
+        {
+            return write_pending_.load( std::memory_order_relaxed );
+        }
+
+        /// the deepest the queue has been
+        size_t write_queue_peak( ) const
+        {
+            return write_peak_.load( std::memory_order_relaxed );
+        }
+
+        /// limits of one vectored write; call before the first write.
+        /// A write takes at least one message (count or bytes of 0 mean
+        /// one message per write)
+        void set_write_batch( size_t count, size_t bytes )
+        {
+            gather_max_count_ = count ? count : 1;
+            gather_max_bytes_ = bytes;
+            gather_.reserve( gather_max_count_ );
+            gather_bufs_.reserve( gather_max_count_ );
+        }
+
         void start_read( )
         {
             async_read( );
@@ -6,6 +6,7 @@
 #include "boost/asio.hpp"
 
 #include "udp-wrapper.hpp"
+#include "udp-cookie.hpp"
 
 #include "vtrc-delayed-call.h"
 
@@ -13,11 +14,12 @@ using timer = vtrc::common::delayed_call;
 
 class udp_connector0: public udp_connector {
 
-    using reader = std::function<void (const ba::ip::udp::endpoint &from,
-                                       std::uint8_t *data, std::size_t len)>;
-    reader reader_;
+    using reader = void (udp_connector0::*)( const ba::ip::udp::endpoint &,
+                                             std::uint8_t *, std::size_t );
+    reader reader_ = &udp_connector0::first_read;
 
     int test = 100;
+    bool connected_ = false;
 
     timer timer_;
 
@@ -27,17 +29,27 @@ public:
                     const ba::ip::udp::endpoint &to )
         :udp_connector(ios, to)
         ,timer_(ios)
+    { }
+
+    /// at least cookie_jar::message_size bytes; the server does not
+    /// answer shorter datagrams with a cookie
+    static const char *hello( )
     {
-        reader_ = [this](const ba::ip::udp::endpoint &from,
-                         std::uint8_t *data, std::size_t len )
-        {
-            first_read( from, data, len );
-        };
+        return "hellO!......";
     }
 
     void first_read( const ba::ip::udp::endpoint &from,
                      std::uint8_t *data, std::size_t len )
     {
+        if( cookie_jar::is_cookie( data, len ) ) {
+            /// the server wants its cookie back in front of the hello
+            std::string echo( reinterpret_cast<const char *>(data),
+                              cookie_jar::message_size );
+            echo.append( hello( ) );
+            queue_write_to( echo.c_str( ), echo.size( ), from );
+            return;
+        }
+
         std::cout << "first_read "
                   << " from " << from.address( ).to_string( )
                   << ":" << from.port( )
@@ -45,12 +57,9 @@ public:
                   << len << std::endl;
 
         get_socket( ).connect( from );
+        connected_ = true;
 
-        reader_ = [this](const ba::ip::udp::endpoint &from,
-                         std::uint8_t *data, std::size_t len )
-        {
-            next_read( from, data, len );
-        };
+        reader_ = &udp_connector0::next_read;
 
         write( "!", 1 );
     }
@@ -79,8 +88,9 @@ public:
                   std::uint8_t *data, std::size_t len )
     {
         if( !err ) {
-            reader_( from, data, len );
-            read( );
+            (this->*reader_)( from, data, len );
+            /// until connected the source is needed (cookie, first reply)
+            connected_ ? read( ) : read_from( endpoint( ) );
         } else {
             std::cout << "Error! " << err.message( ) << "\n";
         }
@@ -98,7 +108,7 @@ int main( )
 
         udp_connector0 bc( ios, ep );
         bc.start( );
-        bc.write_to( "hellO!", 6, ep );
+        bc.write_to( udp_connector0::hello( ), 12, ep );
         bc.read_from( ep );
 
         ios.run( );
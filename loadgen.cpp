@@ -0,0 +1,533 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "boost/asio.hpp"
+#include "boost/asio/steady_timer.hpp"
+#include "boost/program_options.hpp"
+
+#include "udp-wrapper.hpp"
+#include "udp-cookie.hpp"
+#include "udp-runtime.hpp"
+#include "udp-histogram.hpp"
+
+/// open-loop load against udp-server: every session is a socket of its
+/// own (a source port), does the cookie handshake and then sends at the
+/// session's share of the rate. A send is stamped with the time it was
+/// scheduled, not the time it went out, so a stalled generator shows up
+/// in the latency instead of hiding it (coordinated omission).
+/// The server's reply carries no sequence, so replies are matched to
+/// requests in order per session
+
+namespace po = boost::program_options;
+
+using loadgen_clock = std::chrono::steady_clock;
+
+static std::int64_t now_ns( )
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                loadgen_clock::now( ).time_since_epoch( ) ).count( );
+}
+
+struct loadgen_config {
+    ba::ip::udp::endpoint   server;
+    std::size_t             sessions    = 1000;
+    std::size_t             threads     = 1;
+    std::size_t             size        = 32;
+    double                  rate        = 10000;   /// datagrams/s
+    bool                    poisson     = false;
+    double                  churn       = 0;       /// sessions/s
+    double                  duration    = 10;      /// seconds
+    double                  warmup      = 1;       /// seconds
+    std::int64_t            timeout     = 1000000000; /// ns
+    bool                    distribution = false;
+};
+
+class loadgen_worker;
+
+class loadgen_session:
+        public basic_udp_endpoint<loadgen_session, single_threading> {
+
+    loadgen_worker             &worker_;
+    ba::ip::udp::endpoint       peer_;
+    std::deque<std::int64_t>    sent_;     /// scheduled times, in order
+    std::int64_t                opened_ = 0;
+    std::int64_t                hello_at_ = 0;
+    bool                        ready_  = false;
+
+public:
+
+    loadgen_session( ba::io_service &ios, loadgen_worker &worker )
+        :basic_udp_endpoint(ios)
+        ,worker_(worker)
+    {
+        set_buffer_size( 256 ); /// replies are a cookie or "hello!"
+    }
+
+    /// a new socket and handshake; what was in flight is abandoned
+    void open( );
+
+    /// what is still in flight counts as lost
+    void close( );
+
+    bool ready( ) const
+    {
+        return ready_;
+    }
+
+    /// the hello (or its cookie echo) is lost or the server is behind;
+    /// the cookie is stateless, so asking again costs the server nothing
+    void retry( std::int64_t now, std::int64_t timeout );
+
+    void send( std::int64_t stamp, const char *data, std::size_t len )
+    {
+        sent_.push_back( stamp );
+        queue_write_to( data, len, peer_ );
+    }
+
+    void on_read( const bs::error_code &err,
+                  const ba::ip::udp::endpoint &from,
+                  std::uint8_t *data, std::size_t len );
+};
+
+class loadgen_worker {
+
+    const loadgen_config           &cfg_;
+    ba::io_service                 &ios_;
+    ba::steady_timer                timer_;
+
+    std::vector<std::unique_ptr<loadgen_session> > sessions_;
+    std::size_t                     next_session_ = 0;
+    std::size_t                     opening_      = 0;
+
+    std::mt19937_64                 gen_;
+    std::exponential_distribution<double> send_gap_;
+    std::exponential_distribution<double> churn_gap_;
+    double                          send_interval_;    /// ns
+    double                          next_send_;
+    double                          next_churn_;
+    double                          next_open_;
+    double                          open_interval_;    /// ns
+    std::int64_t                    record_from_;
+    std::int64_t                    stop_at_;
+
+    std::vector<char>               payload_;
+    std::vector<char>               hello_;
+
+    void tick( )
+    {
+        const std::int64_t now = now_ns( );
+        const std::int64_t until = std::min( now, stop_at_ );
+
+        while( ( opening_ < sessions_.size( ) ) && ( next_open_ <= until ) ) {
+            sessions_[opening_++]->open( );
+            next_open_ += open_interval_;
+        }
+
+        while( next_send_ <= until ) {
+            const std::int64_t stamp = static_cast<std::int64_t>(next_send_);
+            loadgen_session *s = pick( now );
+            if( stamp >= record_from_ ) {
+                s ? ++sent : ++skipped;
+            }
+            if( s ) {
+                s->send( stamp, payload_.data( ), payload_.size( ) );
+            }
+            next_send_ += cfg_.poisson ? send_gap_( gen_ ) : send_interval_;
+        }
+
+        while( next_churn_ <= until ) {
+            sessions_[gen_( ) % sessions_.size( )]->open( );
+            next_churn_ += churn_gap_( gen_ );
+        }
+
+        if( now >= stop_at_ ) {
+            return; /// replies still come in until the runtime stops
+        }
+        double next = std::min( next_send_, next_churn_ );
+        if( opening_ < sessions_.size( ) ) {
+            next = std::min( next, next_open_ );
+        }
+        timer_.expires_at( loadgen_clock::time_point(
+                           std::chrono::nanoseconds(
+                                std::min( static_cast<std::int64_t>(next),
+                                          stop_at_ ) ) ) );
+        timer_.async_wait( [this]( const bs::error_code &err ) {
+            if( !err ) {
+                tick( );
+            }
+        } );
+    }
+
+    /// the next ready session, round robin; a handshake that got no
+    /// answer within the timeout is asked again on the way
+    loadgen_session *pick( std::int64_t now )
+    {
+        for( std::size_t i = 0; i < sessions_.size( ); ++i ) {
+            loadgen_session *s = sessions_[next_session_].get( );
+            next_session_ = ( next_session_ + 1 ) % sessions_.size( );
+            if( s->ready( ) ) {
+                return s;
+            } else {
+                s->retry( now, cfg_.timeout );
+            }
+        }
+        return nullptr;
+    }
+
+public:
+
+    /// all of it is read once finish( ) has run
+    hdr_histogram   latency;
+    hdr_histogram   connect;
+    std::uint64_t   sent        = 0;
+    std::uint64_t   received    = 0;
+    std::uint64_t   lost        = 0;    /// timed out or abandoned
+    std::uint64_t   skipped     = 0;    /// no session was ready
+    std::uint64_t   unmatched   = 0;    /// a reply nothing waited for
+    std::uint64_t   opened      = 0;
+
+    loadgen_worker( const loadgen_config &cfg, ba::io_service &ios,
+                    std::size_t sessions, double rate, std::uint64_t seed )
+        :cfg_(cfg)
+        ,ios_(ios)
+        ,timer_(ios)
+        ,gen_(seed)
+        ,send_gap_(rate / 1e9)
+        ,churn_gap_(cfg.churn > 0 ? cfg.churn / cfg.threads / 1e9 : 1.0)
+        ,send_interval_(1e9 / rate)
+        ,next_send_(0)
+        ,next_churn_(0)
+        ,next_open_(0)
+        ,open_interval_(0)
+        ,record_from_(0)
+        ,stop_at_(0)
+        ,payload_(std::max<std::size_t>( cfg.size, 1 ), 'x')
+        ,hello_(std::max( payload_.size( ),
+                          std::size_t(cookie_jar::message_size) ), 'h')
+        ,latency(1, 60000000000LL, 3)
+        ,connect(1, 60000000000LL, 3)
+    {
+        for( std::size_t i = 0; i < sessions; ++i ) {
+            sessions_.emplace_back( new loadgen_session( ios_, *this ) );
+        }
+    }
+
+    const loadgen_config &config( ) const
+    {
+        return cfg_;
+    }
+
+    const std::vector<char> &payload( ) const
+    {
+        return payload_;
+    }
+
+    /// at least a cookie long, or the server does not answer it
+    const std::vector<char> &hello( ) const
+    {
+        return hello_;
+    }
+
+    bool recording( std::int64_t stamp ) const
+    {
+        return stamp >= record_from_;
+    }
+
+    /// run on the worker's thread. The sessions open over the first
+    /// half of the warmup: a burst of hellos would overflow the server's
+    /// receive buffer and leave handshakes waiting for a retry
+    void start( std::int64_t record_from, std::int64_t stop_at )
+    {
+        const std::int64_t now = now_ns( );
+        record_from_   = record_from;
+        stop_at_       = stop_at;
+        open_interval_ = 0.5 * std::max<std::int64_t>( record_from - now, 0 )
+                       / sessions_.size( );
+        next_open_     = static_cast<double>(now);
+        next_send_     = static_cast<double>(now);
+        next_churn_    = cfg_.churn > 0 ? next_send_ + churn_gap_( gen_ )
+                                        : static_cast<double>(stop_at_ + 1);
+        tick( );
+    }
+
+    /// run on the worker's thread after the last reply could come
+    void finish( )
+    {
+        timer_.cancel( );
+        for( auto &s: sessions_ ) {
+            s->close( );
+        }
+    }
+};
+
+void loadgen_session::close( )
+{
+    auto &sock = get_socket( );
+    if( sock.is_open( ) ) {
+        bs::error_code ec;
+        sock.close( ec );
+    }
+    for( auto stamp: sent_ ) {
+        worker_.lost += worker_.recording( stamp );
+    }
+    sent_.clear( );
+    ready_ = false;
+}
+
+void loadgen_session::open( )
+{
+    close( );
+
+    const auto &server = worker_.config( ).server;
+    peer_   = server;
+    ready_  = false;
+    opened_ = hello_at_ = now_ns( );
+    ++worker_.opened;
+
+    bind( ba::ip::udp::endpoint( server.address( ).is_v4( )
+                                    ? ba::ip::address( ba::ip::address_v4( ) )
+                                    : ba::ip::address( ba::ip::address_v6( ) ),
+                                 0 ) );
+    const auto &hello = worker_.hello( );
+    queue_write_to( hello.data( ), hello.size( ), peer_ );
+    read_from( peer_ );
+}
+
+void loadgen_session::retry( std::int64_t now, std::int64_t timeout )
+{
+    if( get_socket( ).is_open( ) && ( now - hello_at_ > timeout ) ) {
+        hello_at_ = now;
+        const auto &hello = worker_.hello( );
+        queue_write_to( hello.data( ), hello.size( ), peer_ );
+    }
+}
+
+void loadgen_session::on_read( const bs::error_code &err,
+                               const ba::ip::udp::endpoint &from,
+                               std::uint8_t *data, std::size_t len )
+{
+    if( err ) {
+        return; /// closed by open( ) or the end of the run
+    }
+    const std::int64_t now = now_ns( );
+
+    if( !ready_ ) {
+        if( cookie_jar::is_cookie( data, len ) ) {
+            /// the cookie goes back in front of the hello
+            std::string echo( reinterpret_cast<const char *>(data),
+                              cookie_jar::message_size );
+            echo.append( worker_.hello( ).data( ), worker_.hello( ).size( ) );
+            queue_write_to( echo.data( ), echo.size( ), from );
+        } else {
+            /// the reply comes from the shard endpoint that has the client
+            peer_  = from;
+            ready_ = true;
+            worker_.connect.record( now - opened_ );
+        }
+    } else {
+        const std::int64_t timeout = worker_.config( ).timeout;
+        while( !sent_.empty( ) && ( now - sent_.front( ) > timeout ) ) {
+            worker_.lost += worker_.recording( sent_.front( ) );
+            sent_.pop_front( );
+        }
+        if( sent_.empty( ) ) {
+            worker_.unmatched += worker_.recording( now );
+        } else {
+            if( worker_.recording( sent_.front( ) ) ) {
+                ++worker_.received;
+                worker_.latency.record( now - sent_.front( ) );
+            }
+            sent_.pop_front( );
+        }
+    }
+    read_from( peer_ );
+}
+
+int main( int argc, char *argv[] )
+{
+    loadgen_config cfg;
+    std::string address;
+    std::uint16_t port;
+    std::string arrivals;
+    double timeout_ms;
+
+    po::options_description desc( "udp-loadgen options" );
+    desc.add_options( )
+        ( "help,h", "this help" )
+        ( "server,s", po::value( &address )->default_value( "127.0.0.1" ),
+          "udp-server address" )
+        ( "port,p", po::value( &port )->default_value( 55667 ),
+          "udp-server port" )
+        ( "sessions,n", po::value( &cfg.sessions )->default_value( 1000 ),
+          "concurrent sessions, one source port each" )
+        ( "threads,t", po::value( &cfg.threads )->default_value( 1 ),
+          "sender threads; the sessions are split between them" )
+        ( "size", po::value( &cfg.size )->default_value( 32 ),
+          "payload bytes per datagram" )
+        ( "rate,r", po::value( &cfg.rate )->default_value( 10000 ),
+          "datagrams per second over all sessions" )
+        ( "arrivals", po::value( &arrivals )->default_value( "constant" ),
+          "constant or poisson" )
+        ( "churn", po::value( &cfg.churn )->default_value( 0 ),
+          "sessions per second replaced by new ones (new source port)" )
+        ( "duration,d", po::value( &cfg.duration )->default_value( 10 ),
+          "measured seconds" )
+        ( "warmup", po::value( &cfg.warmup )->default_value( 1 ),
+          "seconds of load before measuring" )
+        ( "timeout", po::value( &timeout_ms )->default_value( 1000 ),
+          "milliseconds after which a reply counts as lost" )
+        ( "distribution", po::bool_switch( &cfg.distribution ),
+          "print the full latency distribution (microseconds)" )
+    ;
+
+    try {
+        po::variables_map vm;
+        po::store( po::parse_command_line( argc, argv, desc ), vm );
+        po::notify( vm );
+        if( vm.count( "help" ) ) {
+            std::cout << desc << "\n";
+            return 0;
+        }
+        if( ( arrivals != "constant" ) && ( arrivals != "poisson" ) ) {
+            throw std::invalid_argument( "arrivals: constant or poisson" );
+        }
+        if( !cfg.sessions || !cfg.threads || ( cfg.rate <= 0 )
+         || ( cfg.duration <= 0 ) || ( cfg.warmup < 0 ) )
+        {
+            throw std::invalid_argument( "sessions, threads, rate and "
+                                         "duration have to be positive" );
+        }
+        cfg.poisson = ( arrivals == "poisson" );
+        cfg.timeout = static_cast<std::int64_t>(timeout_ms * 1e6);
+        cfg.threads = std::min( cfg.threads, cfg.sessions );
+        cfg.server  = ba::ip::udp::endpoint(
+                            ba::ip::address::from_string( address ), port );
+
+        /// a socket per session
+        rlimit lim;
+        if( 0 == ::getrlimit( RLIMIT_NOFILE, &lim ) ) {
+            lim.rlim_cur = lim.rlim_max;
+            ::setrlimit( RLIMIT_NOFILE, &lim );
+            if( lim.rlim_cur < cfg.sessions + 64 ) {
+                std::cerr << "Warning: " << lim.rlim_cur
+                          << " descriptors for " << cfg.sessions
+                          << " sessions\n";
+            }
+        }
+
+        io_runtime runtime( cfg.threads, { }, "loadgen" );
+        runtime.start( );
+
+        /// workers are built on their threads and go before the runtime
+        std::vector<std::unique_ptr<loadgen_worker> > workers;
+        std::random_device seed;
+        for( std::size_t i = 0; i < cfg.threads; ++i ) {
+            const std::size_t sessions = cfg.sessions / cfg.threads
+                                   + ( i < cfg.sessions % cfg.threads );
+            const double rate = cfg.rate * sessions / cfg.sessions;
+            const std::uint64_t s = seed( );
+            workers.emplace_back( runtime.run_on( i, [&]( ) {
+                return new loadgen_worker( cfg, runtime.ios( i ),
+                                           sessions, rate, s );
+            } ) );
+        }
+
+        const std::int64_t start  = now_ns( );
+        const std::int64_t record = start
+                        + static_cast<std::int64_t>(cfg.warmup * 1e9);
+        const std::int64_t stop   = record
+                        + static_cast<std::int64_t>(cfg.duration * 1e9);
+        for( std::size_t i = 0; i < workers.size( ); ++i ) {
+            runtime.run_on( i, [&]( ) { workers[i]->start( record, stop ); } );
+        }
+
+        std::this_thread::sleep_for( std::chrono::nanoseconds(
+                        stop - now_ns( ) + cfg.timeout ) );
+
+        /// the sessions close on their threads and the aborted reads run
+        /// there too (the second run_on) before anything is destroyed
+        for( std::size_t i = 0; i < workers.size( ); ++i ) {
+            runtime.run_on( i, [&]( ) { workers[i]->finish( ); } );
+            runtime.run_on( i, [ ]( ) { } );
+        }
+
+        hdr_histogram latency( workers[0]->latency );
+        hdr_histogram connect( workers[0]->connect );
+        latency.reset( );
+        connect.reset( );
+        std::uint64_t sent = 0, received = 0, lost = 0, skipped = 0;
+        std::uint64_t unmatched = 0, opened = 0;
+        for( auto &w: workers ) {
+            latency.add( w->latency );
+            connect.add( w->connect );
+            sent      += w->sent;
+            received  += w->received;
+            lost      += w->lost;
+            skipped   += w->skipped;
+            unmatched += w->unmatched;
+            opened    += w->opened;
+        }
+        for( std::size_t i = 0; i < workers.size( ); ++i ) {
+            runtime.run_on( i, [&]( ) { workers[i].reset( ); } );
+        }
+        runtime.stop( );
+
+        char line[160];
+        std::snprintf( line, sizeof(line),
+            "sessions %zu (%llu opened)  threads %zu  size %zu  %s %.0f/s"
+            "  churn %.1f/s\n",
+            cfg.sessions, static_cast<unsigned long long>(opened),
+            cfg.threads, cfg.size, arrivals.c_str( ), cfg.rate, cfg.churn );
+        std::cout << line;
+        std::snprintf( line, sizeof(line),
+            "sent %llu  received %llu  lost %llu  skipped %llu"
+            "  unmatched %llu\n",
+            static_cast<unsigned long long>(sent),
+            static_cast<unsigned long long>(received),
+            static_cast<unsigned long long>(lost),
+            static_cast<unsigned long long>(skipped),
+            static_cast<unsigned long long>(unmatched) );
+        std::cout << line;
+        std::snprintf( line, sizeof(line),
+            "throughput %.0f replies/s  %.2f MB/s sent\n",
+            received / cfg.duration,
+            sent * double(cfg.size) / cfg.duration / 1e6 );
+        std::cout << line;
+
+        auto us = []( std::int64_t ns ) { return ns / 1000.0; };
+        std::snprintf( line, sizeof(line),
+            "latency us: min %.1f  p50 %.1f  p90 %.1f  p99 %.1f"
+            "  p99.9 %.1f  p99.99 %.1f  max %.1f\n",
+            us( latency.min( ) ), us( latency.value_at( 50 ) ),
+            us( latency.value_at( 90 ) ), us( latency.value_at( 99 ) ),
+            us( latency.value_at( 99.9 ) ), us( latency.value_at( 99.99 ) ),
+            us( latency.max( ) ) );
+        std::cout << line;
+        std::snprintf( line, sizeof(line),
+            "handshake us: p50 %.1f  p99 %.1f  max %.1f\n",
+            us( connect.value_at( 50 ) ), us( connect.value_at( 99 ) ),
+            us( connect.max( ) ) );
+        std::cout << line;
+
+        if( cfg.distribution ) {
+            std::cout << "\n";
+            latency.print( std::cout, 1000.0 );
+        }
+
+    } catch( const std::exception &ex ) {
+        std::cerr << "Error " << ex.what( ) << "\n";
+        return 1;
+    }
+
+    return 0;
+}
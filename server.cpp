@@ -3,33 +3,38 @@
 #include <iostream>
 #include <set>
 #include <thread>
+#include <atomic>
+#include <random>
+#include <string>
 
 #include "boost/asio.hpp"
 
 #include "async-transport-point.hpp"
 #include "vtrc-delayed-call.h"
+#include "vtrc-timer-wheel.h"
+#include "vtrc-coarse-clock.h"
 
 #include "udp-wrapper.hpp"
+#include "udp-metrics.hpp"
 
 #include "udp-listener.h"
+#include "udp-endpoint-map.hpp"
+#include "udp-cookie.hpp"
+#include "udp-fec.hpp"
 
 namespace ba = boost::asio;
 namespace bs = boost::system;
 
-std::set<std::shared_ptr<udp_connector> > clients;
 ba::io_service ios;
 
+/// read by the exporter on ios; the endpoints add and remove themselves
+metrics_registry metrics;
+
 class udp_endpoint_atapter;
 
 using delayed_call = vtrc::common::delayed_call;
-
-std::uint64_t ticks_now( )
-{
-    using std::chrono::duration_cast;
-    using microsec = std::chrono::microseconds;
-    auto n = std::chrono::high_resolution_clock::now( );
-    return duration_cast<microsec>(n.time_since_epoch( )).count( );
-}
+using timer_wheel  = vtrc::common::timer_wheel;
+using coarse_clock = vtrc::common::timer::coarse_clock;
 
 struct client_info: public std::enable_shared_from_this<client_info> {
 
@@ -37,18 +42,33 @@ struct client_info: public std::enable_shared_from_this<client_info> {
 
     ba::ip::udp::endpoint my_;
 
+    static const std::uint64_t idle_timeout = 10000000; /// microseconds
+
+    /// a partial FEC group gets its parity this long after its first
+    /// reply (microseconds)
+    static const std::uint64_t fec_linger = 100000;
+
     udp_endpoint_atapter *parent_ = nullptr;
+    timer_wheel          &wheel_;
+    coarse_clock         &clock_;
     std::uint64_t         last_;
-    vtrc::common::delayed_call dcall_;
+    timer_wheel::hook     keeper_;
+
+    /// optional; see udp_endpoint_master::set_fec
+    std::unique_ptr<fec_encoder> fec_tx_;
+    std::unique_ptr<fec_decoder> fec_rx_;
+    timer_wheel::hook            fec_flusher_;
 
     client_info( const ba::ip::udp::endpoint myep,
-                 boost::asio::io_service &ios )
+                 timer_wheel &wheel, coarse_clock &clock )
         :my_(myep)
-        ,last_(0ull)
-        ,dcall_(ios)
+        ,wheel_(wheel)
+        ,clock_(clock)
+        ,last_(clock.now( ))
+        ,keeper_([this]( ) { keeper_handler( ); })
+        ,fec_flusher_([this]( ) { fec_flush_handler( ); })
     {
-        last_ = ticks_now( );
-        start_keeper( );
+        start_keeper( idle_timeout );
     }
 
     ba::ip::udp::endpoint &get_endpoint( )
@@ -62,38 +82,86 @@ struct client_info: public std::enable_shared_from_this<client_info> {
 //                  << ":" << my_.port( ) << "\n";
     }
 
-    void keeper_handler( const bs::error_code &err );
+    void keeper_handler( );
 
-    void start_keeper( )
+    void start_keeper( std::uint64_t microsec )
     {
-        dcall_.call_from_now( [this](const bs::error_code &err) {
-            keeper_handler( err );
-        }, delayed_call::seconds( 10 ) );
+        wheel_.schedule( keeper_,
+                wheel_.to_ticks( timer_wheel::microseconds( microsec ) ) );
     }
 
+    void enable_fec( unsigned k, unsigned m );
+
+    void fec_flush_handler( );
+
+    /// through FEC when it is on
+    void send( const char *data, std::size_t len );
+
+    void reply( );
+
     void on_read( const bs::error_code &err, std::uint8_t *, std::size_t );
 };
 
-using client_map = std::map<ba::ip::udp::endpoint, client_info::shared_type>;
+using client_map = endpoint_map<client_info::shared_type>;
 
 class udp_endpoint_atapter: public udp_endpoint {
 
-    bool         master_;
-    client_map   clients_;
+    bool           master_;
+    client_map     clients_;
+    coarse_clock  *clock_ = nullptr;
+
+    /// written by this endpoint, read by the master when it picks one
+    std::atomic<std::size_t>    load_clients_;
+    std::atomic<std::uint64_t>  load_packets_;
+
+    /// packet rate in clients' worth (x load_unit); set by the master
+    std::atomic<std::uint64_t>  load_weight_;
+
+    /// what this socket did; see register_metrics
+    endpoint_metrics            stats_;
+    std::atomic<std::uint64_t>  clients_created_;
+    std::atomic<std::uint64_t>  clients_expired_;
+    metrics_registry           *registry_ = nullptr;
+
+    static void bump( std::atomic<std::uint64_t> &value )
+    {
+        value.store( value.load( std::memory_order_relaxed ) + 1,
+                     std::memory_order_relaxed );
+    }
+
+    std::string owner( ) const
+    {
+        return std::to_string( reinterpret_cast<std::uintptr_t>(this) );
+    }
+
+    void count_packets( std::size_t count )
+    {
+        load_packets_.store(
+            load_packets_.load( std::memory_order_relaxed ) + count,
+            std::memory_order_relaxed );
+    }
 
 public:
 
+    enum { load_unit = 256 };
+
+    /// master only; the rate sampler's state for this endpoint
+    std::uint64_t packets_seen_ = 0;
+    std::uint64_t packet_rate_  = 0;
+
     void add_client( const ba::ip::udp::endpoint &from,
                      client_info::shared_type cl )
     {
-        clients_[from] = cl;
+        clients_.insert( from, std::move(cl) );
+        load_clients_.store( clients_.size( ), std::memory_order_relaxed );
+        bump( clients_created_ );
     }
 
     client_info::shared_type get_client( const ba::ip::udp::endpoint &from )
     {
         auto f = clients_.find( from );
-        if( f != clients_.end( ) ) {
-            return f->second;
+        if( f ) {
+            return *f;
         }
         return client_info::shared_type( );
     }
@@ -102,37 +170,133 @@ public:
 
     udp_endpoint_atapter( ba::io_service &ios  )
         :udp_endpoint(ios)
+        ,load_clients_(0)
+        ,load_packets_(0)
+        ,load_weight_(0)
+        ,clients_created_(0)
+        ,clients_expired_(0)
     { }
 
+    ~udp_endpoint_atapter( )
+    {
+        if( registry_ ) {
+            registry_->remove( owner( ) );
+        }
+    }
+
+    /// counts into stats_ and puts it, the clients and the kernel's
+    /// drops into reg under labels; they leave it with the endpoint.
+    /// Call from the endpoint's thread
+    void register_metrics( metrics_registry &reg, const std::string &labels )
+    {
+        using reg_type = metrics_registry;
+        const std::string id = owner( );
+        registry_ = &reg;
+        set_metrics( &stats_ );
+        reg.add_endpoint( labels, stats_, id );
+        reg.add( reg_type::GAUGE, "udp_clients", "Clients of the socket.",
+                 labels, [this]( ) { return double(load_clients( )); }, id );
+        reg.add( reg_type::COUNTER, "udp_clients_created_total",
+                 "Clients created.", labels, [this]( ) {
+                     return double(clients_created_.load(
+                                        std::memory_order_relaxed ));
+                 }, id );
+        reg.add( reg_type::COUNTER, "udp_clients_expired_total",
+                 "Clients removed for being idle.", labels, [this]( ) {
+                     return double(clients_expired_.load(
+                                        std::memory_order_relaxed ));
+                 }, id );
+        reg.add( reg_type::COUNTER, "udp_receive_drops_total",
+                 "Datagrams the kernel dropped (SO_MEMINFO).", labels,
+                 [this]( ) { return double(receive_drops( )); }, id );
+    }
+
+    /// the clock is refreshed once per read completion
+    void set_clock( coarse_clock *clock )
+    {
+        clock_ = clock;
+    }
+
     std::size_t size( ) const
     {
         return clients_.size( );
     }
 
+    /// clients plus their packet rate; safe from any thread
+    std::uint64_t load( ) const
+    {
+        return load_clients_.load( std::memory_order_relaxed ) * load_unit
+             + load_weight_.load( std::memory_order_relaxed );
+    }
+
+    std::size_t load_clients( ) const
+    {
+        return load_clients_.load( std::memory_order_relaxed );
+    }
+
+    std::uint64_t load_packets( ) const
+    {
+        return load_packets_.load( std::memory_order_relaxed );
+    }
+
+    void set_load_weight( std::uint64_t weight )
+    {
+        load_weight_.store( weight, std::memory_order_relaxed );
+    }
+
     void remove_client( const ba::ip::udp::endpoint &from )
     {
 //        std::cout << "Erase: " << from.address( ).to_string( )
 //                  << ":" << from.port( )
 //                  << std::endl;
         clients_.erase( from );
-        on_remove( );
-    }
-
-    virtual void on_remove( )
-    {
-
+        load_clients_.store( clients_.size( ), std::memory_order_relaxed );
+        bump( clients_expired_ );
     }
 
     virtual void call_client( const bs::error_code &err,
                               const ba::ip::udp::endpoint &from,
                               std::uint8_t *data, std::size_t len ) = 0;
 
+    void start_read( )
+    {
+        if( batch_size( ) ) {
+            read_batch( );
+        } else {
+            read_from( get_endpoint( ) );
+        }
+    }
+
     void on_read( const bs::error_code &err,
                   const ba::ip::udp::endpoint &from,
                   std::uint8_t *data, std::size_t len )
     {
+        if( err == ba::error::operation_aborted ) {
+            return;
+        }
+        if( clock_ ) {
+            clock_->update( );
+        }
+        count_packets( 1 );
         call_client( err, from, data, len );
-        read_from( get_endpoint( ) );
+        start_read( );
+    }
+
+    void on_read_batch( const bs::error_code &err,
+                        datagram *dgrams, std::size_t count )
+    {
+        if( err == ba::error::operation_aborted ) {
+            return;
+        }
+        if( clock_ ) {
+            clock_->update( );
+        }
+        count_packets( count );
+        for( std::size_t i = 0; i < count; ++i ) {
+            call_client( err, dgrams[i].from, dgrams[i].data,
+                         dgrams[i].length );
+        }
+        read_batch( );
     }
 };
 
@@ -153,18 +317,13 @@ public:
         ,parent_master_(master)
     { }
 
-
-    void on_remove( );
-
     void start( )
     {
-        ep_.address( ).is_v4( ) ? get_socket( ).open( ba::ip::udp::v4( ) )
-                                : get_socket( ).open( ba::ip::udp::v6( ) );
-        get_socket( ).bind( ep_ );
+        bind( ep_ );
         ep_ = get_socket( ).local_endpoint( );
 //        std::cout << "open slave ep: " << ep_.address( ).to_string( )
 //                  << ":" << ep_.port( ) << "\n";
-        read_from( get_endpoint( ) );
+        start_read( );
     }
 
     void call_client( const bs::error_code &err,
@@ -183,8 +342,98 @@ class udp_endpoint_master: public udp_endpoint_atapter {
 
     ba::ip::udp::endpoint ep_;
 
+    /// idle expiry for every client of this master and its slaves
+    timer_wheel  wheel_;
+    coarse_clock clock_;
+
     std::vector<std::shared_ptr<udp_endpoint_slave> > slaves_;
 
+    /// packet rates are resampled this often (microseconds)
+    static const std::uint64_t load_period = 1000000;
+    timer_wheel::hook   load_sampler_;
+    std::minstd_rand    pick_gen_;
+
+    udp_endpoint_atapter *endpoint_at( std::size_t id )
+    {
+        return id ? slaves_[id - 1].get( )
+                  : static_cast<udp_endpoint_atapter *>(this);
+    }
+
+    /// power of two choices over the master and its slaves
+    udp_endpoint_atapter *pick_endpoint( )
+    {
+        const std::size_t count = slaves_.size( ) + 1;
+        std::size_t a = 0;
+        std::size_t b = 1;
+        if( count > 2 ) {
+            a = pick_gen_( ) % count;
+            b = pick_gen_( ) % ( count - 1 );
+            b += ( b >= a );
+        } else if( count == 1 ) {
+            return this;
+        }
+        auto ea = endpoint_at( a );
+        auto eb = endpoint_at( b );
+        return ( eb->load( ) < ea->load( ) ) ? eb : ea;
+    }
+
+    /// turns the packet counters into smoothed rates and gives every
+    /// endpoint its share of the traffic in clients' worth, so an
+    /// endpoint with a few busy clients counts as a crowded one
+    void sample_load( )
+    {
+        const std::size_t count = slaves_.size( ) + 1;
+        std::uint64_t total_rate    = 0;
+        std::uint64_t total_clients = 0;
+        for( std::size_t i = 0; i < count; ++i ) {
+            auto e = endpoint_at( i );
+            const std::uint64_t packets = e->load_packets( );
+            e->packet_rate_  = ( e->packet_rate_ * 3
+                               + ( packets - e->packets_seen_ ) ) / 4;
+            e->packets_seen_ = packets;
+            total_rate    += e->packet_rate_;
+            total_clients += e->load_clients( );
+        }
+        for( std::size_t i = 0; i < count; ++i ) {
+            auto e = endpoint_at( i );
+            e->set_load_weight( total_rate
+                ? e->packet_rate_ * total_clients * load_unit / total_rate
+                : 0 );
+        }
+        wheel_.schedule( load_sampler_, wheel_.to_ticks(
+                         timer_wheel::microseconds( load_period ) ) );
+    }
+
+    /// set when unknown sources have to pass the cookie check first
+    std::unique_ptr<cookie_jar> cookies_;
+
+    /// FEC for new clients; 0 is off
+    unsigned fec_k_ = 0;
+    unsigned fec_m_ = 0;
+
+    /// true if the datagram may create a client; strips the cookie.
+    /// Otherwise answers with a fresh cookie (never longer than the
+    /// request, so it can't be used to amplify) and keeps no state
+    bool handshake( const ba::ip::udp::endpoint &from,
+                    std::uint8_t *&data, std::size_t &len )
+    {
+        const std::uint64_t now = clock_.now( );
+        if( cookie_jar::is_cookie( data, len )
+         && cookies_->check( from, now, data ) )
+        {
+            data += cookie_jar::message_size;
+            len  -= cookie_jar::message_size;
+            return true;
+        }
+        if( len >= cookie_jar::message_size ) {
+            char reply[cookie_jar::message_size];
+            cookies_->make( from, now,
+                            reinterpret_cast<std::uint8_t *>(reply) );
+            queue_write_to( reply, sizeof(reply), from );
+        }
+        return false;
+    }
+
 public:
 
     udp_endpoint_master( ba::io_service &ios,
@@ -192,65 +441,83 @@ public:
                          std::uint16_t port, size_t slaves )
         :udp_endpoint_atapter(ios)
         ,ep_(ba::ip::address::from_string(addr), port)
+        ,wheel_(ios, timer_wheel::milliseconds( 100 ))
+        ,clock_(coarse_clock::SOURCE_MONOTONIC_COARSE)
+        ,load_sampler_([this]( ) { sample_load( ); })
+        ,pick_gen_(std::random_device( )( ))
     {
+        set_clock( &clock_ );
         while(slaves--) {
             slaves_.push_back(std::make_shared<udp_endpoint_slave>( ios, std::cref(ep_), this ));
+            slaves_.back( )->set_clock( &clock_ );
         }
     }
 
     void start( )
     {
-        ep_.address( ).is_v4( ) ? get_socket( ).open( ba::ip::udp::v4( ) )
-                                : get_socket( ).open( ba::ip::udp::v6( ) );
-        get_socket( ).bind( ep_ );
+        bind( ep_ );
+        wheel_.start( );
+        wheel_.schedule( load_sampler_, wheel_.to_ticks(
+                         timer_wheel::microseconds( load_period ) ) );
         for( auto s: slaves_ ) {
             s->start( );
         }
-        read_from( get_endpoint( ) );
+        start_read( );
     }
 
-    void dec_slave( udp_endpoint_slave *slave )
+    /// the wheel, the slaves and then the master's own socket
+    void stop( ) override
     {
-        auto f = slaves_.begin( );
-        for( ; f!= slaves_.end( ); ++f) {
-            if( f->get( ) == slave ) {
-                break;
-            }
-        }
-        while( f != slaves_.begin( ) ) {
-            auto prev = f - 1;
-            if( (*prev)->size( ) < (*f)->size( ) ) {
-                std::swap( *f, *prev );
-                f = prev;
-            } else {
-                break;
-            }
+        wheel_.stop( );
+        for( auto s: slaves_ ) {
+            s->stop( );
         }
-        for( auto i: slaves_ ) {
-            std::cout << " " << i->size( ) << std::endl;
+        udp_endpoint_atapter::stop( );
+    }
+
+    void set_batch_size( size_t count )
+    {
+        udp_endpoint::set_batch_size( count );
+        for( auto s: slaves_ ) {
+            s->set_batch_size( count );
         }
     }
 
-    void inc_slave( )
+    /// unknown sources have to echo a cookie before they get a client.
+    /// Call before start( )
+    void set_handshake( bool on )
     {
-        auto f = slaves_.begin( );
-        while( f != slaves_.end( ) ) {
-            auto next = f + 1;
-            if( next != slaves_.end( ) ) {
-                if( (*next)->size( ) < (*f)->size( ) ) {
-                    std::swap( *f, *next );
-                    f = next;
-                } else {
-                    break;
-                }
-            } else {
-                break;
-            }
+        cookies_.reset( on ? new cookie_jar : nullptr );
+    }
+
+    /// m parity datagrams per k to and from every new client;
+    /// the clients have to use it too. Call before start( )
+    void set_fec( unsigned k, unsigned m )
+    {
+        fec_k_ = k;
+        fec_m_ = m;
+    }
+
+    /// the master and every slave, as socket="master" / "slave-N"
+    void register_metrics( metrics_registry &reg, const std::string &labels )
+    {
+        const std::string sep = labels.empty( ) ? "" : ",";
+        udp_endpoint_atapter::register_metrics( reg,
+                                    labels + sep + "socket=\"master\"" );
+        for( std::size_t i = 0; i < slaves_.size( ); ++i ) {
+            slaves_[i]->register_metrics( reg, labels + sep
+                    + "socket=\"slave-" + std::to_string( i + 1 ) + "\"" );
         }
+    }
 
-        for( auto i: slaves_ ) {
-            std::cout << " " << i->size( ) << std::endl;
+    /// the master and every slave; each falls back on its own
+    bool use_io_uring( )
+    {
+        bool res = udp_endpoint::use_io_uring( );
+        for( auto s: slaves_ ) {
+            res = s->use_io_uring( ) && res;
         }
+        return res;
     }
 
     void call_client( const bs::error_code &err,
@@ -259,17 +526,16 @@ public:
     {
         auto cl = get_client( from );
         if( !cl ) {
-            cl = std::make_shared<client_info>( from,
-                                                std::ref(get_io_service( )) );
-            if( (*slaves_.begin( ))->size( ) < size( ) ) {
-                cl->parent_ = slaves_.begin( )->get( );
-                cl->parent_->add_client( from, cl );
-                inc_slave( );
-            } else {
-                cl->parent_ = this;
-                add_client( from, cl );
-                inc_slave( );
+            if( cookies_ && ( err || !handshake( from, data, len ) ) ) {
+                return;
             }
+            cl = std::make_shared<client_info>( from, std::ref(wheel_),
+                                                std::ref(clock_) );
+            cl->parent_ = pick_endpoint( );
+            if( fec_k_ ) {
+                cl->enable_fec( fec_k_, fec_m_ );
+            }
+            cl->parent_->add_client( from, cl );
         } else {
 //            std::cout << "A";
 //            std::cout.flush( );
@@ -278,50 +544,150 @@ public:
     }
 };
 
-void udp_endpoint_slave::on_remove( )
+const std::uint64_t client_info::idle_timeout;
+const std::uint64_t client_info::fec_linger;
+const std::uint64_t udp_endpoint_master::load_period;
+
+void client_info::keeper_handler( )
 {
-    parent_master_->dec_slave( this );
+    /// on_read only stamps last_; the idle check happens here
+    auto idle = clock_.update( ) - last_;
+    if( idle >= idle_timeout ) {
+        parent_->dispatch( [this]( ) {
+            parent_->remove_client( my_ );
+        } );
+    } else {
+        start_keeper( idle_timeout - idle );
+    }
 }
 
-void client_info::keeper_handler( const bs::error_code &err )
+void client_info::enable_fec( unsigned k, unsigned m )
 {
-    if( !err ) {
-        auto now = ticks_now( );
-        if( now - last_ > 10000000 ) {
-            parent_->dispatch( [this]( ) {
-                parent_->remove_client( my_ );
-            } );
-        } else {
-            start_keeper( );
+    fec_tx_.reset( new fec_encoder(
+        [this]( const std::uint8_t *data, std::size_t len ) {
+            parent_->queue_write_to( reinterpret_cast<const char *>(data),
+                                     len, my_ );
+        }, k, m ) );
+    fec_rx_.reset( new fec_decoder(
+        [this]( std::uint8_t *, std::size_t, bool ) {
+            reply( );
+        } ) );
+}
+
+/// the encoder is used on the parent's dispatcher; the client may be
+/// gone by the time the flush runs there
+void client_info::fec_flush_handler( )
+{
+    auto self = shared_from_this( );
+    parent_->dispatch( [self]( ) {
+        self->fec_tx_->flush( );
+    } );
+}
+
+void client_info::send( const char *data, std::size_t len )
+{
+    if( fec_tx_ ) {
+        fec_tx_->send( reinterpret_cast<const std::uint8_t *>(data), len );
+        if( !fec_flusher_.linked( ) ) {
+            wheel_.schedule( fec_flusher_, wheel_.to_ticks(
+                             timer_wheel::microseconds( fec_linger ) ) );
         }
+    } else {
+        parent_->queue_write_to( data, len, my_ );
     }
 }
 
+void client_info::reply( )
+{
+    send( "hello!", 6 );
+}
+
 void client_info::on_read( const bs::error_code &err,
-                           std::uint8_t *, std::size_t )
+                           std::uint8_t *data, std::size_t len )
 {
-    last_ = ticks_now( );
+    last_ = clock_.now( );
 //    std::cout << "Got! " << my_.address( ).to_string( )
 //              << ":" << my_.port( )
 //              << std::endl;
-    parent_->write_to( "hello!", 6, my_ );
+    if( fec_rx_ && !err && fec_rx_->on_packet( data, len ) ) {
+        return; /// the decoder replies per datagram, rebuilt ones too
+    }
+    reply( );
 }
 
-int main( )
+/// udp-server [--handshake] [metrics]
+///   --handshake   unknown sources have to echo a cookie first (off: any
+///                 datagram creates a client, as before)
+///   metrics       a port on 127.0.0.1 or a unix datagram path; any
+///                 datagram sent there gets the Prometheus text back
+int main( int argc, char *argv[] )
 {
 
     try {
 
-        ba::io_service::work wrk(ios);
+        bool handshake = false;
+        std::string metrics_at;
+        for( int i = 1; i < argc; ++i ) {
+            const std::string arg = argv[i];
+            if( arg == "--handshake" ) {
+                handshake = true;
+            } else {
+                metrics_at = arg;
+            }
+        }
 
-        udp_endpoint_master eua( ios, "0.0.0.0", 55667, 6 );
-        eua.start( );
+        /// a shard per cpu we may use, pinned to it
+        std::vector<int> cpus = io_runtime::allowed_cpus( );
+        std::uint32_t shards = static_cast<std::uint32_t>(cpus.size( ));
+
+        /// shards are made one after another by start( )
+        std::uint32_t next_shard = 0;
+
+        test::udp_listener lst( "0.0.0.0", 55667, 6, shards ? shards : 1,
+            [&next_shard, handshake]( ba::io_service &sios,
+                                      const ba::ip::udp::endpoint &ep,
+                                      std::uint32_t slaves )
+            {
+                auto master = std::make_shared<udp_endpoint_master>( sios,
+                                        ep.address( ).to_string( ),
+                                        ep.port( ), slaves );
+                master->set_batch_size( 64 );
+                master->use_io_uring( );
+                master->set_handshake( handshake );
+                master->register_metrics( metrics, "shard=\""
+                                + std::to_string( next_shard++ ) + "\"" );
+                return master;
+            }, cpus );
+
+        lst.start( );
+
+        std::unique_ptr<udp_metrics_exporter>  udp_exporter;
+        std::unique_ptr<unix_metrics_exporter> unix_exporter;
+        if( !metrics_at.empty( ) ) {
+            const std::string &where = metrics_at;
+            if( where.find( '/' ) != std::string::npos ) {
+                unix_exporter.reset( new unix_metrics_exporter( ios,
+                        metrics, ba::local::datagram_protocol::endpoint(
+                                                            where ) ) );
+            } else {
+                udp_exporter.reset( new udp_metrics_exporter( ios, metrics,
+                        ba::ip::udp::endpoint(
+                                ba::ip::address_v4::loopback( ),
+                                static_cast<std::uint16_t>(
+                                        std::stoul( where ) ) ) ) );
+            }
+        }
 
-        std::thread([ ]( ){ ios.run( ); }).detach( );
-        std::thread([ ]( ){ ios.run( ); }).detach( );
-        std::thread([ ]( ){ ios.run( ); }).detach( );
-        std::thread([ ]( ){ ios.run( ); }).detach( );
-        std::thread([ ]( ){ ios.run( ); }).detach( );
+        ba::signal_set signals( ios, SIGINT, SIGTERM );
+        signals.async_wait( [&]( const bs::error_code &, int ) {
+            if( udp_exporter ) {
+                udp_exporter->close( );
+            }
+            if( unix_exporter ) {
+                unix_exporter->close( );
+            }
+            lst.stop( );
+        } );
 
         ios.run( );
 
@@ -2,7 +2,7 @@
 #define UDP_ACCEPTOR_H
 
 #include "udp-wrapper.hpp"
-#include <chrono>
+#include "vtrc-coarse-clock.h"
 
 namespace test {
     class acceptor_base: public udp_endpoint {
@@ -11,10 +11,8 @@ namespace test {
 
         static std::uint64_t ticks_now( )
         {
-            using std::chrono::duration_cast;
-            using microsec = std::chrono::microseconds;
-            auto n = std::chrono::high_resolution_clock::now( );
-            return duration_cast<microsec>(n.time_since_epoch( )).count( );
+            using vtrc::common::timer::coarse_clock;
+            return coarse_clock::read( coarse_clock::SOURCE_STEADY );
         }
 
     public:
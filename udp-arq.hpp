@@ -0,0 +1,741 @@
+#ifndef UDP_ARQ_HPP
+#define UDP_ARQ_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "boost/asio.hpp"
+
+#include "udp-bits.hpp"
+#include "udp-wrapper.hpp"
+#include "udp-congestion.hpp"
+#include "vtrc-delayed-call.h"
+
+/// selective repeat ARQ with reliable (ordered) and unreliable messages.
+/// The channel does no I/O and reads no clock: packets leave through the
+/// output callback, arrive through on_packet( ), and timeouts are run by
+/// poll( ) at next_deadline( ). Times are microseconds.
+/// With a congestion controller set, new packets also wait for its
+/// window and are paced at its rate; retransmissions are not held back.
+///
+/// packets (integers little endian):
+///     DATA        1, seq:4, payload
+///     UNRELIABLE  2, payload
+///     ACK         3, next expected seq:4, words:1, sack:8 * words
+///                    (bit i of the bitmap set: seq next + 1 + i has
+///                    arrived; as many words as the out of order range
+///                    needs, none when there is no hole)
+class arq_channel {
+
+public:
+
+    using output_type  = std::function<void (const std::uint8_t *,
+                                              std::size_t)>;
+    /// data, length, reliable
+    using message_type = std::function<void (const std::uint8_t *,
+                                              std::size_t, bool)>;
+
+    enum packet_type {
+        PKT_DATA        = 1,
+        PKT_UNRELIABLE  = 2,
+        PKT_ACK         = 3
+    };
+
+    enum {
+        data_header         = 5,
+        ack_header          = 6,
+        max_sack_words      = 32,   /// covers a 2048 packet window
+        max_payload         = 1400,
+        reorder_threshold   = 3,    /// sacked packets past a hole
+        default_window      = 64    /// packets; fits a default rcvbuf
+    };
+
+    struct statistics {
+        std::uint64_t sent              = 0;    /// first transmissions
+        std::uint64_t retransmits       = 0;    /// by timeout
+        std::uint64_t fast_retransmits  = 0;    /// by sack
+        std::uint64_t acks              = 0;    /// ack packets sent
+        std::uint64_t delivered         = 0;    /// reliable, in order
+        std::uint64_t duplicates        = 0;
+    };
+
+private:
+
+    struct send_slot {
+        std::vector<std::uint8_t> packet;
+        std::uint64_t             sent  = 0;    /// last transmission
+        std::uint32_t             tries = 0;
+        bool                      acked = false;
+    };
+
+    struct recv_slot {
+        std::vector<std::uint8_t> data;
+        bool                      present = false;
+    };
+
+    output_type     output_;
+    message_type    on_message_;
+
+    std::uint32_t   capacity_;
+    std::uint32_t   mask_;
+
+    /// sender
+    std::vector<send_slot>                  send_;
+    std::deque<std::vector<std::uint8_t> >  backlog_;
+    std::uint32_t   snd_una_ = 0;   /// oldest unacknowledged
+    std::uint32_t   snd_nxt_ = 0;
+    std::uint32_t   send_window_;
+    std::uint64_t   rto_deadline_ = 0;
+    std::uint64_t   acked_sent_   = 0;  /// newest send time acked
+
+    std::unique_ptr<congestion_controller>  cc_;
+    pacer           pacer_;
+    std::uint64_t   pace_due_ = 0;  /// the pacer holds the backlog
+
+    /// receiver
+    std::vector<recv_slot>      recv_;
+    std::vector<std::uint8_t>   scratch_;
+    std::vector<std::uint8_t>   unreliable_;
+    std::uint32_t   rcv_nxt_  = 0;
+    std::uint32_t   buffered_ = 0;  /// out of order slots held
+    std::uint32_t   rcv_high_ = 0;  /// newest of them
+    std::uint32_t   unacked_  = 0;  /// in order packets since the last ack
+    std::uint64_t   ack_due_  = 0;
+
+    /// RFC 6298 estimator
+    std::uint64_t   srtt_    = 0;
+    std::uint64_t   rttvar_  = 0;
+    std::uint64_t   rto_     = 200000;
+    std::uint64_t   min_rto_ = 10000;
+    std::uint64_t   max_rto_ = 2000000;
+    std::uint64_t   ack_delay_ = 1000;
+
+    statistics      stats_;
+
+    static bool before( std::uint32_t a, std::uint32_t b )
+    {
+        return static_cast<std::int32_t>(a - b) < 0;
+    }
+
+    static void put32( std::uint8_t *p, std::uint32_t v )
+    {
+        for( int i = 0; i < 4; ++i ) {
+            p[i] = static_cast<std::uint8_t>(v >> ( i * 8 ));
+        }
+    }
+
+    static void put64( std::uint8_t *p, std::uint64_t v )
+    {
+        for( int i = 0; i < 8; ++i ) {
+            p[i] = static_cast<std::uint8_t>(v >> ( i * 8 ));
+        }
+    }
+
+    static std::uint32_t get32( const std::uint8_t *p )
+    {
+        return   std::uint32_t(p[0])        | ( std::uint32_t(p[1]) << 8 )
+             | ( std::uint32_t(p[2]) << 16 ) | ( std::uint32_t(p[3]) << 24 );
+    }
+
+    static std::uint64_t get64( const std::uint8_t *p )
+    {
+        return std::uint64_t(get32( p ))
+             | ( std::uint64_t(get32( p + 4 )) << 32 );
+    }
+
+    std::uint64_t slot_rto( const send_slot &slot ) const
+    {
+        std::uint64_t res = rto_;
+        for( std::uint32_t i = 1; i < slot.tries && res < max_rto_; ++i ) {
+            res <<= 1;
+        }
+        return res < max_rto_ ? res : max_rto_;
+    }
+
+    void transmit( send_slot &slot, std::uint64_t now )
+    {
+        slot.sent = now;
+        ++slot.tries;
+        output_( slot.packet.data( ), slot.packet.size( ) );
+    }
+
+    void transmit_new( const std::uint8_t *data, std::size_t len,
+                       std::uint64_t now )
+    {
+        send_slot &slot( send_[snd_nxt_ & mask_] );
+        slot.packet.resize( data_header + len );
+        slot.packet[0] = PKT_DATA;
+        put32( &slot.packet[1], snd_nxt_ );
+        if( len ) {
+            std::memcpy( &slot.packet[data_header], data, len );
+        }
+        slot.tries = 0;
+        slot.acked = false;
+        ++snd_nxt_;
+        ++stats_.sent;
+        if( cc_ ) {
+            cc_->on_sent( slot.packet.size( ), now );
+            pacer_.on_send( slot.packet.size( ), now );
+        }
+        if( !rto_deadline_ ) {
+            rto_deadline_ = now + rto_;
+        }
+        transmit( slot, now );
+    }
+
+    /// the window, the congestion window and the pacer let a new
+    /// packet go
+    bool may_send( std::size_t len, std::uint64_t now )
+    {
+        if( snd_nxt_ - snd_una_ >= send_window_ ) {
+            return false;
+        }
+        if( !cc_ ) {
+            return true;
+        }
+        if( !cc_->can_send( data_header + len ) ) {
+            return false;
+        }
+        pacer_.set_rate( cc_->pacing_rate( ) );
+        pace_due_ = pacer_.ready_at( now );
+        return !pace_due_;
+    }
+
+    void fill_window( std::uint64_t now )
+    {
+        while( !backlog_.empty( )
+            && may_send( backlog_.front( ).size( ), now ) )
+        {
+            const std::vector<std::uint8_t> &msg( backlog_.front( ) );
+            transmit_new( msg.data( ), msg.size( ), now );
+            backlog_.pop_front( );
+        }
+    }
+
+    void rtt_sample( std::uint64_t rtt )
+    {
+        if( !srtt_ ) {
+            srtt_   = rtt;
+            rttvar_ = rtt / 2;
+        } else {
+            std::uint64_t err = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+            rttvar_ = ( rttvar_ * 3 + err ) / 4;
+            srtt_   = ( srtt_ * 7 + rtt ) / 8;
+        }
+        /// the peer may hold an ack for ack_delay_
+        rto_ = srtt_ + std::max<std::uint64_t>( rttvar_ * 4, 1000 )
+             + ack_delay_;
+        rto_ = std::min( std::max( rto_, min_rto_ ), max_rto_ );
+    }
+
+    void ack_slot( send_slot &slot, std::uint64_t now )
+    {
+        slot.acked = true;
+        acked_sent_ = std::max( acked_sent_, slot.sent );
+        std::uint64_t rtt = 0;
+        if( slot.tries == 1 ) { /// Karn: no samples from retransmits
+            rtt = now - slot.sent;
+            rtt_sample( rtt );
+        }
+        if( cc_ ) {
+            cc_->on_ack( slot.packet.size( ), rtt, now );
+        }
+    }
+
+    void on_ack( std::uint32_t next, const std::uint8_t *sack,
+                 std::size_t words, std::uint64_t now )
+    {
+        if( before( snd_nxt_, next ) ) {
+            return;
+        }
+        const std::uint32_t una = snd_una_;
+        for( ; before( snd_una_, next ); ++snd_una_ ) {
+            send_slot &slot( send_[snd_una_ & mask_] );
+            if( !slot.acked ) {
+                ack_slot( slot, now );
+            }
+        }
+
+        std::uint32_t highest = next;
+        for( std::size_t w = 0; w < words; ++w ) {
+            std::uint64_t bits = get64( sack + w * 8 );
+            for( ; bits; bits &= bits - 1 ) {
+                std::uint32_t seq = next + 1 + std::uint32_t(w * 64)
+                                  + udp_bits::ctz64( bits );
+                if( !before( seq, snd_nxt_ ) ) {
+                    break;
+                }
+                if( before( seq, snd_una_ ) ) {
+                    continue; /// a stale ack; the slot may be reused
+                }
+                send_slot &slot( send_[seq & mask_] );
+                if( !slot.acked ) {
+                    ack_slot( slot, now );
+                }
+                highest = seq;
+            }
+        }
+
+        /// holes with enough sacked packets past them are lost; resend
+        /// them at once, and again only when something sent after the
+        /// resend has been acked (the resend is lost too)
+        bool lost = false;
+        for( std::uint32_t seq = snd_una_;
+             static_cast<std::int32_t>(highest - seq) >= reorder_threshold;
+             ++seq )
+        {
+            send_slot &slot( send_[seq & mask_] );
+            if( !slot.acked
+             && ( ( slot.tries == 1 ) || ( acked_sent_ > slot.sent ) ) )
+            {
+                ++stats_.fast_retransmits;
+                transmit( slot, now );
+                lost = true;
+            }
+        }
+        if( lost && cc_ ) {
+            cc_->on_loss( now );
+        }
+
+        /// RFC 6298 5.3: progress restarts the timer
+        if( snd_una_ == snd_nxt_ ) {
+            rto_deadline_ = 0;
+        } else if( snd_una_ != una ) {
+            rto_deadline_ = now + rto_;
+        }
+        fill_window( now );
+    }
+
+    void deliver( const std::uint8_t *data, std::size_t len )
+    {
+        ++rcv_nxt_;
+        ++stats_.delivered;
+        on_message_( data, len, true );
+    }
+
+    void on_data( std::uint32_t seq, const std::uint8_t *data,
+                  std::size_t len, std::uint64_t now )
+    {
+        const std::int32_t off = static_cast<std::int32_t>(seq - rcv_nxt_);
+        if( off < 0 ) {
+            /// our ack got lost
+            ++stats_.duplicates;
+            send_ack( );
+            return;
+        }
+        if( off >= static_cast<std::int32_t>(capacity_) ) {
+            return;
+        }
+
+        recv_slot &slot( recv_[seq & mask_] );
+        if( slot.present ) {
+            ++stats_.duplicates;
+            send_ack( );
+            return;
+        }
+
+        if( off > 0 ) {
+            slot.data.assign( data, data + len );
+            slot.present = true;
+            if( !buffered_++ || before( rcv_high_, seq ) ) {
+                rcv_high_ = seq;
+            }
+            send_ack( ); /// tells the sender about the hole right away
+            return;
+        }
+
+        deliver( data, len );
+        bool drained = false;
+        while( buffered_ ) {
+            recv_slot &next( recv_[rcv_nxt_ & mask_] );
+            if( !next.present ) {
+                break;
+            }
+            next.present = false;
+            --buffered_;
+            drained = true;
+            /// the handler may feed packets back in; hand it a copy
+            scratch_.swap( next.data );
+            deliver( scratch_.data( ), scratch_.size( ) );
+        }
+
+        if( drained || buffered_ || ( ++unacked_ >= 2 ) ) {
+            send_ack( );
+        } else if( !ack_due_ ) {
+            ack_due_ = now + ack_delay_;
+        }
+    }
+
+    void send_ack( )
+    {
+        std::uint8_t pkt[ack_header + max_sack_words * 8];
+        std::size_t words = 0;
+        if( buffered_ ) {
+            const std::uint32_t span = rcv_high_ - rcv_nxt_;
+            words = std::min<std::size_t>( ( span + 63 ) / 64,
+                                           max_sack_words );
+            for( std::size_t w = 0; w < words; ++w ) {
+                std::uint64_t bits = 0;
+                for( std::uint32_t i = 0; i < 64; ++i ) {
+                    std::uint32_t seq = rcv_nxt_ + 1
+                                      + std::uint32_t(w * 64) + i;
+                    if( !before( rcv_high_, seq )
+                     && recv_[seq & mask_].present )
+                    {
+                        bits |= std::uint64_t(1) << i;
+                    }
+                }
+                put64( pkt + ack_header + w * 8, bits );
+            }
+        }
+        pkt[0] = PKT_ACK;
+        put32( pkt + 1, rcv_nxt_ );
+        pkt[5] = static_cast<std::uint8_t>(words);
+        unacked_ = 0;
+        ack_due_ = 0;
+        ++stats_.acks;
+        output_( pkt, ack_header + words * 8 );
+    }
+
+public:
+
+    /// capacity is the receive window and the largest send window in
+    /// packets (a power of 2). Without a congestion controller nothing
+    /// slows a burst down, so the send window starts at default_window;
+    /// see set_send_window
+    arq_channel( output_type output, message_type on_message,
+                 std::uint32_t capacity = 1024 )
+        :output_(std::move(output))
+        ,on_message_(std::move(on_message))
+        ,capacity_(capacity)
+        ,mask_(capacity - 1)
+        ,send_(capacity)
+        ,send_window_(std::min<std::uint32_t>( capacity, default_window ))
+        ,recv_(capacity)
+    { }
+
+    arq_channel( const arq_channel & ) = delete;
+    arq_channel &operator = ( const arq_channel & ) = delete;
+
+    /// queued when the window is full; false if len > max_payload
+    bool send_reliable( const std::uint8_t *data, std::size_t len,
+                        std::uint64_t now )
+    {
+        if( len > max_payload ) {
+            return false;
+        }
+        if( backlog_.empty( ) && may_send( len, now ) ) {
+            transmit_new( data, len, now );
+        } else {
+            backlog_.emplace_back( data, data + len );
+        }
+        return true;
+    }
+
+    /// sent once, never acknowledged; not ordered with reliable messages
+    bool send_unreliable( const std::uint8_t *data, std::size_t len )
+    {
+        if( len > max_payload ) {
+            return false;
+        }
+        unreliable_.resize( len + 1 );
+        unreliable_[0] = PKT_UNRELIABLE;
+        if( len ) {
+            std::memcpy( &unreliable_[1], data, len );
+        }
+        output_( unreliable_.data( ), unreliable_.size( ) );
+        return true;
+    }
+
+    void on_packet( const std::uint8_t *data, std::size_t len,
+                    std::uint64_t now )
+    {
+        if( !len ) {
+            return;
+        }
+        switch( data[0] ) {
+        case PKT_DATA:
+            if( len >= data_header ) {
+                on_data( get32( data + 1 ), data + data_header,
+                         len - data_header, now );
+            }
+            break;
+        case PKT_UNRELIABLE:
+            on_message_( data + 1, len - 1, false );
+            break;
+        case PKT_ACK:
+            if( ( len >= ack_header )
+             && ( len >= ack_header + std::size_t(data[5]) * 8 ) )
+            {
+                on_ack( get32( data + 1 ), data + ack_header, data[5], now );
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    /// sends a delayed ack, paced packets and retransmits what has
+    /// timed out
+    void poll( std::uint64_t now )
+    {
+        if( ack_due_ && ( now >= ack_due_ ) ) {
+            send_ack( );
+        }
+        if( pace_due_ && ( now >= pace_due_ ) ) {
+            pace_due_ = 0;
+            fill_window( now );
+        }
+        if( !rto_deadline_ || ( now < rto_deadline_ ) ) {
+            return;
+        }
+        rto_deadline_ = 0;
+        bool timed_out = false;
+        for( std::uint32_t seq = snd_una_; seq != snd_nxt_; ++seq ) {
+            send_slot &slot( send_[seq & mask_] );
+            if( slot.acked ) {
+                continue;
+            }
+            if( now - slot.sent >= slot_rto( slot ) ) {
+                ++stats_.retransmits;
+                transmit( slot, now );
+                timed_out = true;
+            }
+            std::uint64_t due = slot.sent + slot_rto( slot );
+            if( !rto_deadline_ || ( due < rto_deadline_ ) ) {
+                rto_deadline_ = due;
+            }
+        }
+        if( timed_out && cc_ ) {
+            cc_->on_timeout( now );
+        }
+    }
+
+    /// when poll( ) has work next; 0 if nothing is pending
+    std::uint64_t next_deadline( ) const
+    {
+        std::uint64_t res = 0;
+        for( std::uint64_t due: { ack_due_, rto_deadline_, pace_due_ } ) {
+            if( due && ( !res || due < res ) ) {
+                res = due;
+            }
+        }
+        return res;
+    }
+
+    /// reliable messages in flight or waiting for the window
+    std::size_t pending( ) const
+    {
+        return ( snd_nxt_ - snd_una_ ) + backlog_.size( );
+    }
+
+    /// packets in flight; a congestion controller may lower it
+    void set_send_window( std::uint32_t packets )
+    {
+        send_window_ = std::max<std::uint32_t>( 1,
+                            std::min( packets, capacity_ ) );
+    }
+
+    /// nullptr turns congestion control and pacing off. Resets the
+    /// send window: the whole capacity under a controller, which keeps
+    /// its own window, default_window without one
+    void set_congestion( std::unique_ptr<congestion_controller> cc )
+    {
+        cc_ = std::move(cc);
+        send_window_ = cc_ ? capacity_
+                           : std::min<std::uint32_t>( capacity_,
+                                                      default_window );
+        pacer_.set_rate( 0 );
+        pace_due_ = 0;
+    }
+
+    const congestion_controller *congestion( ) const
+    {
+        return cc_.get( );
+    }
+
+    const pacer &get_pacer( ) const
+    {
+        return pacer_;
+    }
+
+    void set_rto_bounds( std::uint64_t min_rto, std::uint64_t max_rto )
+    {
+        min_rto_ = min_rto;
+        max_rto_ = max_rto;
+    }
+
+    void set_ack_delay( std::uint64_t delay )
+    {
+        ack_delay_ = delay;
+    }
+
+    std::uint64_t srtt( ) const
+    {
+        return srtt_;
+    }
+
+    std::uint64_t rto( ) const
+    {
+        return rto_;
+    }
+
+    const statistics &stats( ) const
+    {
+        return stats_;
+    }
+};
+
+/// drops a share of the packets; put in front of an output to test
+/// recovery over loopback
+class loss_shim {
+
+    std::minstd_rand    gen_;
+    std::uint32_t       threshold_;
+    std::uint64_t       dropped_ = 0;
+
+public:
+
+    explicit loss_shim( double rate, unsigned seed = 1 )
+        :gen_(seed)
+        ,threshold_(static_cast<std::uint32_t>(
+                        rate * double(std::minstd_rand::max( ))))
+    { }
+
+    bool drop( )
+    {
+        if( gen_( ) < threshold_ ) {
+            ++dropped_;
+            return true;
+        }
+        return false;
+    }
+
+    std::uint64_t dropped( ) const
+    {
+        return dropped_;
+    }
+};
+
+/// an arq_channel between a udp_endpoint and one peer.
+/// Use it on the endpoint's strand: call send_* from there and feed
+/// on_packet( ) from the endpoint's on_read
+class arq_session {
+
+    using delayed_call = vtrc::common::delayed_call;
+
+    udp_endpoint                &ep_;
+    ba::ip::udp::endpoint        peer_;
+    arq_channel                  chan_;
+    delayed_call                 timer_;
+    std::uint64_t                armed_ = 0;
+    std::unique_ptr<loss_shim>   loss_;
+
+    void output( const std::uint8_t *data, std::size_t len )
+    {
+        if( loss_ && loss_->drop( ) ) {
+            return;
+        }
+        ep_.queue_write_to( reinterpret_cast<const char *>(data), len, peer_ );
+    }
+
+    void on_timer( )
+    {
+        armed_ = 0;
+        chan_.poll( now( ) );
+        rearm( );
+    }
+
+    /// the timer only moves forward; firing early just polls
+    void rearm( )
+    {
+        std::uint64_t due = chan_.next_deadline( );
+        if( !due || ( armed_ && armed_ <= due ) ) {
+            return;
+        }
+        armed_ = due;
+        std::uint64_t cur = now( );
+        timer_.call_from_now( [this]( const bs::error_code &err ) {
+                if( !err ) {
+                    ep_.dispatch( [this]( ) { on_timer( ); } );
+                }
+            }, delayed_call::microseconds( due > cur ? due - cur : 0 ) );
+    }
+
+public:
+
+    arq_session( udp_endpoint &ep, const ba::ip::udp::endpoint &peer,
+                 arq_channel::message_type on_message,
+                 std::uint32_t capacity = 1024 )
+        :ep_(ep)
+        ,peer_(peer)
+        ,chan_([this]( const std::uint8_t *data, std::size_t len ) {
+                    output( data, len );
+               }, std::move(on_message), capacity)
+        ,timer_(ep.get_io_service( ))
+    { }
+
+    ~arq_session( )
+    {
+        timer_.cancel( );
+    }
+
+    static std::uint64_t now( )
+    {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(
+                    steady_clock::now( ).time_since_epoch( ) ).count( );
+    }
+
+    bool send_reliable( const void *data, std::size_t len )
+    {
+        bool res = chan_.send_reliable(
+                        static_cast<const std::uint8_t *>(data), len, now( ) );
+        rearm( );
+        return res;
+    }
+
+    bool send_unreliable( const void *data, std::size_t len )
+    {
+        return chan_.send_unreliable(
+                        static_cast<const std::uint8_t *>(data), len );
+    }
+
+    void on_packet( const std::uint8_t *data, std::size_t len )
+    {
+        chan_.on_packet( data, len, now( ) );
+        rearm( );
+    }
+
+    /// drops this share of outgoing packets (testing only)
+    void set_loss( double rate, unsigned seed = 1 )
+    {
+        loss_.reset( rate > 0 ? new loss_shim( rate, seed ) : nullptr );
+    }
+
+    const ba::ip::udp::endpoint &peer( ) const
+    {
+        return peer_;
+    }
+
+    arq_channel &channel( )
+    {
+        return chan_;
+    }
+
+    const loss_shim *loss( ) const
+    {
+        return loss_.get( );
+    }
+};
+
+#endif // UDP_ARQ_HPP
@@ -0,0 +1,1805 @@
+#include <map>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <cstdlib>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <cmath>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <time.h>
+
+#include "boost/asio.hpp"
+#include "boost/version.hpp"
+
+#include "udp-endpoint-map.hpp"
+#include "udp-cookie.hpp"
+#include "udp-arq.hpp"
+#include "udp-fragment.hpp"
+#include "udp-fec.hpp"
+#include "udp-busy-poll.hpp"
+#include "udp-metrics.hpp"
+#include "udp-wrapper.hpp"
+#include "udp-listener.h"
+#include "udp-runtime.hpp"
+#include "vtrc-coarse-clock.h"
+#include "vtrc-delayed-call.h"
+#include "vtrc-timer-wheel.h"
+#include "async-transport-point.hpp"
+
+namespace ba = boost::asio;
+
+namespace {
+    std::atomic<std::size_t> allocations(0);
+}
+
+/// counted global allocation; kept out of line so gcc does not pair
+/// the inlined malloc/free with new/delete expressions
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+BENCH_NOINLINE void *operator new( std::size_t len )
+{
+    allocations.fetch_add( 1, std::memory_order_relaxed );
+    if( void *ptr = std::malloc( len ? len : 1 ) ) {
+        return ptr;
+    }
+    throw std::bad_alloc( );
+}
+
+BENCH_NOINLINE void operator delete( void *ptr ) noexcept
+{
+    std::free( ptr );
+}
+
+BENCH_NOINLINE void operator delete( void *ptr, std::size_t ) noexcept
+{
+    std::free( ptr );
+}
+
+namespace {
+
+    using clock_type = std::chrono::steady_clock;
+    using value_type = std::shared_ptr<int>;
+
+    /// keeps the optimizer from dropping the measured loop
+    volatile std::size_t sink = 0;
+
+    double ns_per_op( clock_type::time_point start, std::size_t ops )
+    {
+        auto d = clock_type::now( ) - start;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d);
+        return double(ns.count( )) / double(ops ? ops : 1);
+    }
+
+    /// every result of the run, as JSON objects
+    std::vector<std::string> results;
+
+    /// the run number added to each result (--repeat)
+    std::size_t current_run = 0;
+
+    std::string json_string( const std::string &value )
+    {
+        std::string res( "\"" );
+        for( char c: value ) {
+            if( ( c == '"' ) || ( c == '\\' ) ) {
+                res.push_back( '\\' );
+                res.push_back( c );
+            } else if( static_cast<unsigned char>(c) < 0x20 ) {
+                char esc[8];
+                std::snprintf( esc, sizeof(esc), "\\u%04x", c );
+                res.append( esc );
+            } else {
+                res.push_back( c );
+            }
+        }
+        res.push_back( '"' );
+        return res;
+    }
+
+    /// one result: fields are added with set( ) and the destructor
+    /// prints them as a line to stderr and keeps them for the report.
+    /// Names carry their unit ("_ns", "_mbps", "_pct")
+    class bench_result {
+
+        std::string         bench_;
+        std::ostringstream  json_;
+        std::ostringstream  text_;
+
+        bench_result &field( const char *key, const std::string &json,
+                             const std::string &text )
+        {
+            json_ << ", " << json_string( key ) << ": " << json;
+            text_ << " " << key << "=" << text;
+            return *this;
+        }
+
+    public:
+
+        explicit bench_result( const char *bench )
+            :bench_(bench)
+        {
+            json_ << "{\"bench\": " << json_string( bench_ )
+                  << ", \"run\": " << current_run;
+            text_ << bench_;
+        }
+
+        bench_result( const bench_result & ) = delete;
+        bench_result &operator = ( const bench_result & ) = delete;
+
+        ~bench_result( )
+        {
+            json_ << "}";
+            results.push_back( json_.str( ) );
+            std::cerr << text_.str( ) << "\n";
+        }
+
+        bench_result &set( const char *key, const std::string &value )
+        {
+            return field( key, json_string( value ), value );
+        }
+
+        bench_result &set( const char *key, const char *value )
+        {
+            return set( key, std::string( value ) );
+        }
+
+        bench_result &set( const char *key, bool value )
+        {
+            return field( key, value ? "true" : "false",
+                               value ? "true" : "false" );
+        }
+
+        template <typename T>
+        typename std::enable_if<std::is_arithmetic<T>::value,
+                                bench_result &>::type
+        set( const char *key, T value )
+        {
+            const double v = static_cast<double>(value);
+            if( !std::isfinite( v ) ) {
+                return field( key, "null", "-" );
+            }
+            std::ostringstream out;
+            out.precision( 7 );
+            out << value;
+            return field( key, out.str( ), out.str( ) );
+        }
+    };
+
+    std::vector<ba::ip::udp::endpoint> make_endpoints( std::size_t count )
+    {
+        std::vector<ba::ip::udp::endpoint> res;
+        res.reserve( count );
+        std::mt19937 gen(count);
+        for( std::size_t i = 0; i < count; ++i ) {
+            ba::ip::address_v4 addr( 0x0A000000u | ( gen( ) & 0x00FFFFFF ) );
+            res.emplace_back( addr, std::uint16_t(1024 + i % 60000) );
+        }
+        return res;
+    }
+
+    struct result {
+        double insert;
+        double lookup;
+        double erase;
+    };
+
+    template <typename Map, typename Insert, typename Find, typename Erase>
+    result run_table( const std::vector<ba::ip::udp::endpoint> &eps,
+                      const std::vector<std::size_t> &order,
+                      Insert ins, Find fnd, Erase ers )
+    {
+        result res;
+        Map map;
+        auto value = std::make_shared<int>( 0 );
+
+        auto start = clock_type::now( );
+        for( auto &ep: eps ) {
+            ins( map, ep, value );
+        }
+        res.insert = ns_per_op( start, eps.size( ) );
+
+        std::size_t found = 0;
+        start = clock_type::now( );
+        for( auto i: order ) {
+            found += fnd( map, eps[i] );
+        }
+        res.lookup = ns_per_op( start, order.size( ) );
+        sink += found;
+
+        start = clock_type::now( );
+        for( auto &ep: eps ) {
+            ers( map, ep );
+        }
+        res.erase = ns_per_op( start, eps.size( ) );
+
+        return res;
+    }
+
+    /// get_client( ) is a lookup in the endpoint's client_map
+    void print( const char *name, std::size_t count, const result &r )
+    {
+        bench_result( "client_table" )
+            .set( "map", name ).set( "clients", count )
+            .set( "insert_ns", r.insert ).set( "lookup_ns", r.lookup )
+            .set( "erase_ns", r.erase );
+    }
+
+    void bench_client_table( std::size_t count )
+    {
+        using std_map  = std::map<ba::ip::udp::endpoint, value_type>;
+        using flat_map = endpoint_map<value_type>;
+
+        auto eps = make_endpoints( count );
+
+        std::vector<std::size_t> order;
+        const std::size_t lookups = std::max<std::size_t>( count, 1000000 );
+        order.reserve( lookups );
+        std::mt19937 gen(42);
+        for( std::size_t i = 0; i < lookups; ++i ) {
+            order.push_back( gen( ) % count );
+        }
+
+        print( "std::map", count, run_table<std_map>( eps, order,
+            []( std_map &m, const ba::ip::udp::endpoint &ep,
+                const value_type &v ) { m[ep] = v; },
+            []( std_map &m, const ba::ip::udp::endpoint &ep ) {
+                return m.find( ep ) != m.end( );
+            },
+            []( std_map &m, const ba::ip::udp::endpoint &ep ) {
+                m.erase( ep );
+            } ) );
+
+        print( "endpoint_map", count, run_table<flat_map>( eps, order,
+            []( flat_map &m, const ba::ip::udp::endpoint &ep,
+                const value_type &v ) { m.insert( ep, v ); },
+            []( flat_map &m, const ba::ip::udp::endpoint &ep ) {
+                return m.find( ep ) != nullptr;
+            },
+            []( flat_map &m, const ba::ip::udp::endpoint &ep ) {
+                m.erase( ep );
+            } ) );
+    }
+
+    template <typename Call>
+    void run_clock( const char *name, Call call )
+    {
+        const std::size_t count = 10000000;
+        std::uint64_t acc = 0;
+        auto start = clock_type::now( );
+        for( std::size_t i = 0; i < count; ++i ) {
+            acc += call( );
+        }
+        sink += static_cast<std::size_t>(acc);
+        bench_result( "clock" ).set( "source", name )
+                               .set( "read_ns", ns_per_op( start, count ) );
+    }
+
+    void bench_clock( )
+    {
+        using vtrc::common::timer::coarse_clock;
+        using std::chrono::high_resolution_clock;
+
+        coarse_clock cached( coarse_clock::SOURCE_MONOTONIC_COARSE );
+
+        run_clock( "high_resolution_clock", [ ]( ) {
+            return std::uint64_t(
+                high_resolution_clock::now( ).time_since_epoch( ).count( ) );
+        } );
+        run_clock( "monotonic_coarse", [ ]( ) {
+            return coarse_clock::read( coarse_clock::SOURCE_MONOTONIC_COARSE );
+        } );
+        run_clock( "coarse_clock::now", [&cached]( ) {
+            return cached.now( );
+        } );
+    }
+
+    class counting_receiver: public udp_endpoint {
+
+        bool batch_;
+
+    public:
+
+        std::size_t count = 0;
+        std::size_t bytes = 0;
+
+        counting_receiver( ba::io_service &ios, bool batch,
+                           bool uring = false )
+            :udp_endpoint(ios)
+            ,batch_(batch)
+        {
+            if( uring && !use_io_uring( ) ) {
+                throw std::runtime_error( "io_uring is not available" );
+            }
+        }
+
+        void start( ) override
+        {
+            bind( ba::ip::udp::endpoint( ba::ip::address_v4::loopback( ), 0 ) );
+            next( );
+        }
+
+        void next( )
+        {
+            batch_ ? read_batch( ) : read_from( get_endpoint( ) );
+        }
+
+        void on_read( const bs::error_code &err,
+                      const ba::ip::udp::endpoint &,
+                      std::uint8_t *, std::size_t ) override
+        {
+            if( !err ) {
+                ++count;
+                next( );
+            }
+        }
+
+        void on_read_batch( const bs::error_code &err,
+                            datagram *dgrams, std::size_t n ) override
+        {
+            if( !err ) {
+                count += n;
+                for( std::size_t i = 0; i < n; ++i ) {
+                    bytes += dgrams[i].length;
+                }
+                next( );
+            }
+        }
+    };
+
+    class bulk_sender: public udp_endpoint {
+
+    public:
+
+        std::size_t done = 0;
+
+        explicit bulk_sender( ba::io_service &ios )
+            :udp_endpoint(ios)
+        { }
+
+        void start( ) override
+        {
+            open_v4( );
+        }
+
+        void on_read( const bs::error_code &, const ba::ip::udp::endpoint &,
+                      std::uint8_t *, std::size_t ) override
+        { }
+
+        void on_write( const bs::error_code &, std::size_t ) override
+        {
+            ++done;
+        }
+    };
+
+    /// heap allocations per received datagram in steady state
+    void bench_read_allocations( bool batch )
+    {
+        ba::io_service ios;
+        counting_receiver rx( ios, batch );
+        if( batch ) {
+            rx.set_batch_size( 16 );
+        }
+        rx.start( );
+
+        ba::ip::udp::socket tx( ios, ba::ip::udp::v4( ) );
+        auto to = rx.get_socket( ).local_endpoint( );
+
+        auto run = [&]( std::size_t packets ) {
+            rx.count = 0;
+            for( std::size_t i = 0; i < packets; ++i ) {
+                tx.send_to( ba::buffer( "x", 1 ), to );
+                if( ( i % 64 ) == 63 ) {
+                    ios.poll( );
+                }
+            }
+            while( rx.count < packets ) {
+                ios.run_one( );
+            }
+        };
+
+        const std::size_t packets = 10000;
+        run( 1000 );
+        std::size_t before = allocations.load( );
+        run( packets );
+        std::size_t used = allocations.load( ) - before;
+
+        bench_result( "read_allocations" )
+            .set( "read", batch ? "read_batch" : "read_from" )
+            .set( "allocs_per_datagram", double(used) / packets );
+    }
+
+    /// 64K bursts of 1400 byte datagrams: one send_to per datagram,
+    /// or UDP_SEGMENT on send and UDP_GRO on receive
+    void bench_bulk( bool offload )
+    {
+        const char *name = offload ? "gso/gro" : "per-datagram";
+
+        ba::io_service ios;
+        counting_receiver rx( ios, true );
+        rx.set_batch_size( 64 );
+        rx.start( );
+        rx.get_socket( ).set_option(
+                    ba::socket_base::receive_buffer_size( 8 << 20 ) );
+        if( offload && !rx.set_gro( true ) ) {
+            bench_result( "bulk" ).set( "mode", name )
+                                  .set( "skipped", "no UDP_GRO" );
+            return;
+        }
+
+        bulk_sender tx( ios );
+        tx.start( );
+        auto to = rx.get_socket( ).local_endpoint( );
+
+        const std::size_t segment = 1400;
+        const std::size_t burst   = segment * 46;
+        const std::size_t bursts  = 20000;
+        std::vector<char> payload( burst, 'x' );
+
+        auto start = clock_type::now( );
+        for( std::size_t i = 0; i < bursts; ++i ) {
+            if( offload ) {
+                tx.write_to_segmented( &payload[0], burst, segment, to );
+                while( tx.done <= i ) {
+                    ios.run_one( );
+                }
+            } else {
+                for( std::size_t off = 0; off < burst; off += segment ) {
+                    tx.get_socket( ).send_to(
+                            ba::buffer( &payload[off], segment ), to );
+                }
+            }
+            ios.poll( );
+        }
+        while( ios.run_one_for( std::chrono::milliseconds( 50 ) ) ) { }
+
+        auto d = clock_type::now( ) - start;
+        double sec = std::chrono::duration<double>(d).count( );
+
+        bench_result( "bulk" ).set( "mode", name )
+            .set( "mbps", rx.bytes / sec / 1e6 )
+            .set( "datagrams", rx.count )
+            .set( "received_pct", 100.0 * rx.bytes / ( burst * bursts ) );
+    }
+
+    std::uint64_t thread_cpu_ns( )
+    {
+        timespec ts;
+        ::clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+        return std::uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    /// cpu time of the receiving thread per datagram;
+    /// the sender runs in its own thread
+    void bench_receive_cpu( bool uring )
+    {
+        const char *name = uring ? "io_uring" : "reactor";
+
+        ba::io_service ios;
+        std::unique_ptr<counting_receiver> rx;
+        try {
+            rx.reset( new counting_receiver( ios, true, uring ) );
+        } catch( const std::exception &ex ) {
+            bench_result( "receive_cpu" ).set( "backend", name )
+                                         .set( "skipped", ex.what( ) );
+            return;
+        }
+        rx->set_batch_size( 64 );
+        rx->start( );
+        rx->get_socket( ).set_option(
+                    ba::socket_base::receive_buffer_size( 8 << 20 ) );
+
+        const std::size_t packets = 500000;
+        auto to = rx->get_socket( ).local_endpoint( );
+        std::atomic<bool> done(false);
+
+        std::thread sender( [&]( ) {
+            ba::io_service sios;
+            ba::ip::udp::socket tx( sios, ba::ip::udp::v4( ) );
+            char payload[64] = { 0 };
+            for( std::size_t i = 0; i < packets; ++i ) {
+                tx.send_to( ba::buffer( payload ), to );
+            }
+            done = true;
+        } );
+
+        std::uint64_t start = thread_cpu_ns( );
+        while( rx->count < packets ) {
+            if( !ios.run_one_for( std::chrono::milliseconds( 50 ) )
+                && done )
+            {
+                break; /// the rest was dropped
+            }
+        }
+        std::uint64_t used = thread_cpu_ns( ) - start;
+        sender.join( );
+
+        bench_result( "receive_cpu" ).set( "backend", name )
+            .set( "cpu_ns_per_datagram",
+                  double(used) / double(rx->count ? rx->count : 1) )
+            .set( "received", rx->count );
+    }
+
+    /// datagrams bigger than the read buffer between small ones: the
+    /// big ones are counted as truncated and dropped, never delivered
+    /// cut, and their buffers keep the receive going
+    void bench_truncation( bool uring )
+    {
+        const char *name = uring ? "io_uring" : "reactor";
+
+        ba::io_service ios;
+        std::unique_ptr<counting_receiver> rx;
+        try {
+            rx.reset( new counting_receiver( ios, true, uring ) );
+        } catch( const std::exception &ex ) {
+            bench_result( "truncation" ).set( "backend", name )
+                                        .set( "skipped", ex.what( ) );
+            return;
+        }
+        rx->set_batch_size( 16 );
+        rx->start( );
+
+        ba::ip::udp::socket tx( ios, ba::ip::udp::v4( ) );
+        auto to = rx->get_socket( ).local_endpoint( );
+
+        /// twice the ring, so leaked buffers would stall the receive
+        const std::size_t rounds = 512;
+        const std::size_t small  = 64;
+        std::vector<char> big( rx->get_pool( ).slab_size( ) + 1000, 'B' );
+        std::vector<char> payload( small, 's' );
+
+        for( std::size_t i = 0; i < rounds; ++i ) {
+            tx.send_to( ba::buffer( big ), to );
+            tx.send_to( ba::buffer( payload ), to );
+            if( ( i % 16 ) == 15 ) {
+                ios.poll( );
+            }
+        }
+        while( rx->count < rounds ) {
+            if( !ios.run_one_for( std::chrono::milliseconds( 200 ) ) ) {
+                break;
+            }
+        }
+
+        const bool ok = ( rx->count == rounds )
+                     && ( rx->bytes == rounds * small )
+                     && ( rx->truncated( ) == rounds );
+        bench_result( "truncation" ).set( "backend", name )
+            .set( "check", ok ? "ok" : "FAILED" )
+            .set( "delivered", rx->count )
+            .set( "delivered_bytes", rx->bytes )
+            .set( "truncated", rx->truncated( ) );
+    }
+
+    /// one datagram per completion, where the event dispatch is paid
+    /// per packet: udp_acceptor (virtual on_read + std::function) vs
+    /// basic_udp_acceptor (inlined handler); receiving thread cpu time
+    template <typename Acceptor>
+    void receive_cpu( const char *name, Acceptor &rx, ba::io_service &ios,
+                      const std::size_t &count )
+    {
+        rx.start( );
+        rx.get_socket( ).set_option(
+                    ba::socket_base::receive_buffer_size( 8 << 20 ) );
+
+        const std::size_t packets = 300000;
+        auto to = rx.get_socket( ).local_endpoint( );
+        std::atomic<bool> done(false);
+
+        std::thread sender( [&]( ) {
+            ba::io_service sios;
+            ba::ip::udp::socket tx( sios, ba::ip::udp::v4( ) );
+            char payload[64] = { 0 };
+            for( std::size_t i = 0; i < packets; ++i ) {
+                tx.send_to( ba::buffer( payload ), to );
+            }
+            done = true;
+        } );
+
+        std::uint64_t start = thread_cpu_ns( );
+        while( count < packets ) {
+            if( !ios.run_one_for( std::chrono::milliseconds( 50 ) )
+                && done )
+            {
+                break;
+            }
+        }
+        std::uint64_t used = thread_cpu_ns( ) - start;
+        sender.join( );
+
+        bench_result( "dispatch" ).set( "acceptor", name )
+            .set( "cpu_ns_per_datagram",
+                  double(used) / double(count ? count : 1) )
+            .set( "received", count );
+    }
+
+    void bench_dispatch( )
+    {
+        {
+            ba::io_service ios;
+            std::size_t count = 0;
+            auto rx = std::make_shared<udp_acceptor>( std::ref(ios),
+                                                      "127.0.0.1", 0 );
+            rx->on_accept = [&count]( const ba::ip::udp::endpoint &,
+                                      std::uint8_t *, std::size_t )
+            {
+                ++count;
+            };
+            receive_cpu( "virtual", *rx, ios, count );
+        }
+        {
+            ba::io_service ios;
+            std::size_t count = 0;
+            auto rx = make_udp_acceptor( ios, "127.0.0.1", 0,
+                [&count]( const ba::ip::udp::endpoint &,
+                          std::uint8_t *, std::size_t )
+                {
+                    ++count;
+                } );
+            receive_cpu( "typed", *rx, ios, count );
+        }
+    }
+
+    /// q-quantile of sorted samples
+    std::uint64_t quantile( const std::vector<std::uint64_t> &sorted,
+                            double q )
+    {
+        return sorted.empty( ) ? 0
+             : sorted[std::min( sorted.size( ) - 1,
+                                std::size_t(q * sorted.size( )) )];
+    }
+
+    /// one side of bench_threading's ping-pong; the echo has no rtt
+    template <typename Threading>
+    struct ping_pong {
+
+        using endpoint_type = basic_udp_acceptor<ping_pong, Threading>;
+        using clock         = std::chrono::steady_clock;
+
+        endpoint_type              **self;
+        std::vector<std::uint64_t>  *rtt;
+        clock::time_point           *sent;
+        const ba::ip::udp::endpoint *peer;
+        std::size_t                  rounds;
+
+        void operator ( )( const ba::ip::udp::endpoint &from,
+                           std::uint8_t *data, std::size_t len ) const
+        {
+            if( rtt ) {
+                rtt->push_back( std::chrono::duration_cast<
+                        std::chrono::nanoseconds>(
+                            clock::now( ) - *sent ).count( ) );
+                if( rtt->size( ) >= rounds ) {
+                    (*self)->get_io_service( ).stop( );
+                    return;
+                }
+                *sent = clock::now( );
+            }
+            (*self)->queue_write_to( reinterpret_cast<const char *>(data),
+                                     len, rtt ? *peer : from );
+        }
+    };
+
+    /// ping-pong between two endpoints on one io_service run by this
+    /// thread; per packet latency is half the round trip
+    template <typename Threading>
+    void bench_threading( const char *name )
+    {
+        using handler = ping_pong<Threading>;
+        using endpoint_type = typename handler::endpoint_type;
+
+        const std::size_t rounds = 100000;
+        ba::io_service ios;
+        std::vector<std::uint64_t> rtt;
+        rtt.reserve( rounds );
+        typename handler::clock::time_point sent;
+        ba::ip::udp::endpoint echo_ep;
+        endpoint_type *echo_raw = nullptr;
+        endpoint_type *ping_raw = nullptr;
+
+        handler on_echo = { &echo_raw, nullptr, nullptr, nullptr, 0 };
+        handler on_ping = { &ping_raw, &rtt, &sent, &echo_ep, rounds };
+
+        auto echo = make_udp_acceptor<Threading>( ios, "127.0.0.1", 0,
+                                                  on_echo );
+        auto ping = make_udp_acceptor<Threading>( ios, "127.0.0.1", 0,
+                                                  on_ping );
+        echo_raw = echo.get( );
+        ping_raw = ping.get( );
+        echo->start( );
+        ping->start( );
+        echo_ep = echo->get_socket( ).local_endpoint( );
+
+        char payload[64] = { 0 };
+        sent = handler::clock::now( );
+        ping->queue_write_to( payload, sizeof(payload), echo_ep );
+        while( ( rtt.size( ) < rounds )
+            && ios.run_one_for( std::chrono::milliseconds( 100 ) ) )
+        { }
+
+        std::sort( rtt.begin( ), rtt.end( ) );
+        bench_result( "threading" ).set( "policy", name )
+            .set( "rtt_p50_ns", quantile( rtt, 0.5 ) )
+            .set( "rtt_p99_ns", quantile( rtt, 0.99 ) )
+            .set( "rtt_p999_ns", quantile( rtt, 0.999 ) )
+            .set( "round_trips", rtt.size( ) );
+    }
+
+    /// loopback round trips of size bytes to an echo thread that blocks
+    /// as usual; this side either blocks in run( ) too or spins for
+    /// spin_usec first (bench "busy_poll")
+    void bench_echo( const char *bench, std::size_t size,
+                     std::uint64_t spin_usec )
+    {
+        using handler = ping_pong<strand_threading>;
+        using endpoint_type = handler::endpoint_type;
+
+        const std::size_t rounds = 50000;
+        ba::io_service echo_ios;
+        ba::io_service ping_ios;
+        std::vector<std::uint64_t> rtt;
+        rtt.reserve( rounds );
+        handler::clock::time_point sent;
+        ba::ip::udp::endpoint echo_ep;
+        endpoint_type *echo_raw = nullptr;
+        endpoint_type *ping_raw = nullptr;
+
+        handler on_echo = { &echo_raw, nullptr, nullptr, nullptr, 0 };
+        handler on_ping = { &ping_raw, &rtt, &sent, &echo_ep, rounds };
+
+        auto echo = make_udp_acceptor( echo_ios, "127.0.0.1", 0, on_echo );
+        auto ping = make_udp_acceptor( ping_ios, "127.0.0.1", 0, on_ping );
+        echo_raw = echo.get( );
+        ping_raw = ping.get( );
+        echo->start( );
+        ping->start( );
+        echo_ep = echo->get_socket( ).local_endpoint( );
+        const bool so_busy = spin_usec
+                          && ping->set_busy_poll(
+                                    static_cast<unsigned>(spin_usec) );
+
+        std::thread echo_thread( [&echo_ios]( ) { echo_ios.run( ); } );
+
+        std::vector<char> payload( size );
+        sent = handler::clock::now( );
+        ping->queue_write_to( payload.data( ), payload.size( ), echo_ep );
+        busy_poll_runner runner( ping_ios, spin_usec );
+        if( spin_usec ) {
+            runner.run( );
+        } else {
+            ping_ios.run( );
+        }
+
+        echo_ios.stop( );
+        echo_thread.join( );
+
+        std::sort( rtt.begin( ), rtt.end( ) );
+        bench_result res( bench );
+        res.set( "size", size ).set( "spin_us", spin_usec )
+           .set( "rtt_p50_ns", quantile( rtt, 0.5 ) )
+           .set( "rtt_p99_ns", quantile( rtt, 0.99 ) )
+           .set( "rtt_p999_ns", quantile( rtt, 0.999 ) )
+           .set( "round_trips", rtt.size( ) );
+        if( spin_usec ) {
+            res.set( "polls", runner.polls( ) )
+               .set( "sleeps", runner.sleeps( ) )
+               .set( "so_busy_poll", so_busy );
+        }
+    }
+
+    /// teardown with operations still queued: a sharded udp_listener
+    /// stop( )s under traffic, then endpoints are destroyed after their
+    /// io_runtime stopped (what udp-loadgen used to do). Nothing to
+    /// measure but the time; build with -fsanitize=address to check it
+    void bench_shutdown( )
+    {
+        const std::size_t cycles    = 20;
+        const std::size_t endpoints = 4;
+        const std::size_t burst     = 256;
+        char payload[64] = { 0 };
+
+        auto make_receivers = [&]( io_runtime &rt ) {
+            std::vector<std::shared_ptr<counting_receiver> > res;
+            for( std::size_t i = 0; i < endpoints; ++i ) {
+                res.push_back( rt.run_on( i % rt.size( ), [&rt, i]( ) {
+                    auto r = std::make_shared<counting_receiver>(
+                                        rt.ios( i % rt.size( ) ), true );
+                    r->set_batch_size( 16 );
+                    r->start( );
+                    return r;
+                } ) );
+            }
+            /// every one sends to the next; some of it is still queued
+            for( std::size_t i = 0; i < endpoints; ++i ) {
+                auto to = res[( i + 1 ) % endpoints]->get_socket( )
+                                                    .local_endpoint( );
+                auto from = res[i];
+                rt.run_on( i % rt.size( ), [&, from, to]( ) {
+                    for( std::size_t j = 0; j < burst; ++j ) {
+                        from->queue_write_to( payload, sizeof(payload), to );
+                    }
+                } );
+            }
+            return res;
+        };
+
+        std::int64_t listener_ns = 0;
+        std::int64_t runtime_ns  = 0;
+        for( std::size_t c = 0; c < cycles; ++c ) {
+            test::udp_listener lst( "127.0.0.1", 0, 0, 2,
+                [ ]( ba::io_service &ios, const ba::ip::udp::endpoint &,
+                     std::uint32_t )
+                {
+                    auto r = std::make_shared<counting_receiver>( ios, true );
+                    r->set_batch_size( 16 );
+                    return r;
+                } );
+            lst.start( );
+            auto traffic = make_receivers( lst.runtime( ) );
+            auto start = clock_type::now( );
+            lst.stop( );
+            traffic.clear( );
+            listener_ns += std::chrono::duration_cast<
+                std::chrono::nanoseconds>( clock_type::now( ) - start )
+                                                                .count( );
+
+            io_runtime rt( 2, { }, "shutdown" );
+            rt.start( );
+            auto points = make_receivers( rt );
+            start = clock_type::now( );
+            rt.stop( );
+            points.clear( );
+            runtime_ns += std::chrono::duration_cast<
+                std::chrono::nanoseconds>( clock_type::now( ) - start )
+                                                                .count( );
+        }
+
+        bench_result( "shutdown" ).set( "order", "listener_stop" )
+            .set( "cycles", cycles )
+            .set( "stop_us", double(listener_ns) / cycles / 1000 );
+        bench_result( "shutdown" ).set( "order", "runtime_then_endpoints" )
+            .set( "cycles", cycles )
+            .set( "stop_us", double(runtime_ns) / cycles / 1000 );
+    }
+
+    class arq_peer: public udp_endpoint {
+
+    public:
+
+        std::unique_ptr<arq_session> session;
+
+        explicit arq_peer( ba::io_service &ios )
+            :udp_endpoint(ios)
+        { }
+
+        void start( ) override
+        {
+            bind( ba::ip::udp::endpoint( ba::ip::address_v4::loopback( ), 0 ) );
+            get_socket( ).set_option(
+                        ba::socket_base::receive_buffer_size( 8 << 20 ) );
+            read_batch( );
+        }
+
+        void on_read( const bs::error_code &, const ba::ip::udp::endpoint &,
+                      std::uint8_t *, std::size_t ) override
+        { }
+
+        void on_read_batch( const bs::error_code &err,
+                            datagram *dgrams, std::size_t n ) override
+        {
+            if( err ) {
+                return;
+            }
+            for( std::size_t i = 0; i < n; ++i ) {
+                session->on_packet( dgrams[i].data, dgrams[i].length );
+            }
+            read_batch( );
+        }
+    };
+
+    /// 1200 byte messages over loopback with the loss shim on both
+    /// directions; reliable = false is the unreliable sub-channel,
+    /// i.e. raw UDP plus one byte of header
+    void bench_arq( double loss, bool reliable )
+    {
+        ba::io_service ios;
+        auto tx = std::make_shared<arq_peer>( std::ref(ios) );
+        auto rx = std::make_shared<arq_peer>( std::ref(ios) );
+        tx->set_batch_size( 64 );
+        rx->set_batch_size( 64 );
+        tx->start( );
+        rx->start( );
+
+        std::size_t received = 0;
+        std::size_t order_errors = 0;
+        auto ignore = [ ]( const std::uint8_t *, std::size_t, bool ) { };
+        auto count = [&]( const std::uint8_t *data, std::size_t, bool ) {
+            std::uint32_t id;
+            std::memcpy( &id, data, sizeof(id) );
+            order_errors += reliable && ( id != received );
+            ++received;
+        };
+        tx->session.reset( new arq_session( *tx,
+                    rx->get_socket( ).local_endpoint( ), ignore ) );
+        rx->session.reset( new arq_session( *rx,
+                    tx->get_socket( ).local_endpoint( ), count ) );
+        tx->session->set_loss( loss, 1 );
+        rx->session->set_loss( loss, 2 );
+
+        const std::size_t messages = 100000;
+        const std::size_t window   = 1024;
+        std::vector<std::uint8_t> msg( 1200, 0 );
+        std::size_t sent = 0;
+
+        auto start = clock_type::now( );
+        auto last  = start;
+        while( received < messages ) {
+            while( ( sent < messages )
+                && ( tx->session->channel( ).pending( ) < window ) )
+            {
+                std::uint32_t id = static_cast<std::uint32_t>(sent++);
+                std::memcpy( &msg[0], &id, sizeof(id) );
+                if( reliable ) {
+                    tx->session->send_reliable( msg.data( ), msg.size( ) );
+                } else {
+                    tx->session->send_unreliable( msg.data( ), msg.size( ) );
+                }
+                if( !reliable && !( sent % 64 ) ) {
+                    break;
+                }
+            }
+            std::size_t before = received;
+            if( !ios.poll( ) ) {
+                ios.run_one_for( std::chrono::milliseconds( 1 ) );
+            }
+            auto now = clock_type::now( );
+            if( received != before ) {
+                last = now;
+            } else if( now - last > std::chrono::milliseconds( 200 ) ) {
+                break; /// unreliable: the rest is gone
+            }
+        }
+        auto secs = std::chrono::duration<double>( last - start ).count( );
+
+        const auto &st = tx->session->channel( ).stats( );
+        {
+            bench_result res( "arq" );
+            res.set( "mode", reliable ? "reliable" : "unreliable" )
+               .set( "loss_pct", loss * 100 )
+               .set( "goodput_mbps",
+                     double(received * msg.size( )) / secs / 1e6 )
+               .set( "delivered", received ).set( "messages", messages );
+            if( reliable && !loss ) {
+                /// nothing is lost on loopback unless the sender
+                /// overruns the receiver
+                res.set( "no_rto", st.retransmits ? "FAILED" : "ok" );
+            }
+            if( reliable ) {
+                res.set( "order_errors", order_errors )
+                   .set( "rto_retx", st.retransmits )
+                   .set( "fast_retx", st.fast_retransmits )
+                   .set( "acks", rx->session->channel( ).stats( ).acks )
+                   .set( "srtt_us", tx->session->channel( ).srtt( ) );
+            }
+        }
+
+        tx->session.reset( );
+        rx->session.reset( );
+        ios.poll( );
+    }
+
+    class fragment_peer: public udp_endpoint {
+
+    public:
+
+        std::unique_ptr<reassembler> parts;
+        bool zero_copy = true;
+
+        explicit fragment_peer( ba::io_service &ios )
+            :udp_endpoint(ios)
+        { }
+
+        void start( ) override
+        {
+            bind( ba::ip::udp::endpoint( ba::ip::address_v4::loopback( ), 0 ) );
+            get_socket( ).set_option(
+                        ba::socket_base::receive_buffer_size( 8 << 20 ) );
+            read_batch( );
+        }
+
+        void on_read( const bs::error_code &, const ba::ip::udp::endpoint &,
+                      std::uint8_t *, std::size_t ) override
+        { }
+
+        void on_read_batch( const bs::error_code &err,
+                            datagram *dgrams, std::size_t n ) override
+        {
+            if( err ) {
+                return;
+            }
+            const std::uint64_t now = arq_session::now( );
+            for( std::size_t i = 0; i < n; ++i ) {
+                datagram &d( dgrams[i] );
+                if( zero_copy ) {
+                    parts->on_datagram( d.from, d.data, d.length,
+                                        d.buffer, now );
+                } else {
+                    parts->on_datagram( d.from, d.data, d.length, now );
+                }
+            }
+            read_batch( );
+        }
+    };
+
+    /// 1MB messages split into 1400 byte datagrams over loopback;
+    /// zero_copy keeps the read buffers, else every fragment is copied
+    void bench_fragments( bool zero_copy )
+    {
+        ba::io_service ios;
+        auto tx = std::make_shared<fragment_peer>( std::ref(ios) );
+        auto rx = std::make_shared<fragment_peer>( std::ref(ios) );
+        rx->zero_copy = zero_copy;
+        rx->set_batch_size( 64 );
+        tx->start( );
+        rx->start( );
+
+        const std::size_t messages = 200;
+        const std::size_t size     = 1 << 20;
+        std::size_t received = 0;
+        std::size_t corrupt  = 0;
+        std::size_t bytes    = 0;
+
+        rx->parts.reset( new reassembler(
+            [&]( const ba::ip::udp::endpoint &, buffer_chain &msg ) {
+                const std::uint8_t fill =
+                        static_cast<std::uint8_t>(received++);
+                for( auto &p: msg ) {
+                    corrupt += ( p.data[0] != fill )
+                            || ( p.data[p.length - 1] != fill );
+                }
+                corrupt += ( msg.size( ) != size );
+                bytes   += msg.size( );
+            } ) );
+
+        fragmenter frag( 1400 );
+        std::vector<std::uint8_t> msg( size );
+        auto to = rx->get_socket( ).local_endpoint( );
+
+        auto start = clock_type::now( );
+        for( std::size_t i = 0; i < messages; ++i ) {
+            std::fill( msg.begin( ), msg.end( ),
+                       static_cast<std::uint8_t>(i) );
+            frag.send( *tx, msg.data( ), msg.size( ), to );
+            while( ( received <= i )
+                && ios.run_one_for( std::chrono::milliseconds( 50 ) ) )
+            { }
+        }
+        auto secs = std::chrono::duration<double>(
+                            clock_type::now( ) - start ).count( );
+
+        const auto &st = rx->parts->stats( );
+        bench_result( "fragments" )
+            .set( "mode", zero_copy ? "zero-copy" : "copy" )
+            .set( "mbps", double(bytes) / secs / 1e6 )
+            .set( "delivered", received ).set( "messages", messages )
+            .set( "corrupt", corrupt ).set( "expired", st.expired )
+            .set( "evicted", st.evicted ).set( "copied", st.copied );
+
+        rx->parts.reset( );
+        ios.poll( );
+    }
+
+    /// dst ^= src over one datagram's worth, per kernel
+    void bench_fec_kernels( )
+    {
+        const std::size_t len    = 1400;
+        const std::size_t rounds = 2000000;
+        std::vector<std::uint8_t> dst( len, 1 );
+        std::vector<std::uint8_t> src( len, 2 );
+
+        for( auto &kern: fec_detail::xor_kernels( ) ) {
+            auto start = clock_type::now( );
+            for( std::size_t i = 0; i < rounds; ++i ) {
+                kern.func( &dst[0], &src[0], len );
+            }
+            auto secs = std::chrono::duration<double>(
+                                clock_type::now( ) - start ).count( );
+            bench_result( "fec_xor" ).set( "kernel", kern.name )
+                .set( "gbps", double(len * rounds) / secs / 1e9 )
+                .set( "used", kern.func == fec_detail::best_xor( ).func )
+                .set( "check", int(dst[len - 1]) );
+        }
+    }
+
+    /// k data + m parity per group with random loss in memory;
+    /// k = 0 is the plain stream
+    void bench_fec( unsigned k, unsigned m, double loss )
+    {
+        const std::size_t messages = 200000;
+        std::vector<std::uint8_t> msg( 1200, 0 );
+        std::size_t delivered = 0;
+        std::size_t recovered = 0;
+        std::size_t wire      = 0;
+        loss_shim shim( loss, 3 );
+
+        fec_decoder dec( [&]( std::uint8_t *, std::size_t, bool rebuilt ) {
+            ++delivered;
+            recovered += rebuilt;
+        } );
+        fec_encoder enc( [&]( const std::uint8_t *data, std::size_t len ) {
+            ++wire;
+            if( !shim.drop( ) ) {
+                dec.on_packet( const_cast<std::uint8_t *>(data), len );
+            }
+        }, k ? k : 1, m ? m : 1 );
+
+        auto start = clock_type::now( );
+        for( std::size_t i = 0; i < messages; ++i ) {
+            std::memcpy( &msg[0], &i, sizeof(i) );
+            if( k ) {
+                enc.send( msg.data( ), msg.size( ) );
+            } else {
+                ++wire;
+                delivered += !shim.drop( );
+            }
+        }
+        enc.flush( );
+        auto secs = std::chrono::duration<double>(
+                            clock_type::now( ) - start ).count( );
+
+        bench_result( "fec" ).set( "k", k ).set( "m", m )
+            .set( "loss_pct", loss * 100 )
+            .set( "delivered_pct", 100.0 * delivered / messages )
+            .set( "recovered", recovered )
+            .set( "malformed", dec.stats( ).malformed )
+            .set( "overhead_pct", 100.0 * ( wire - messages ) / messages )
+            .set( "ns_per_message", secs * 1e9 / messages );
+    }
+
+    /// a full 64 message group with one message lost on the way has to
+    /// come back whole: the group's masks use every bit of a word
+    void bench_fec_full_group( )
+    {
+        const unsigned k = fec_detail::max_group;
+        std::vector<std::uint8_t> msg( 100, 0 );
+        std::size_t delivered = 0;
+        std::size_t recovered = 0;
+        std::size_t packets   = 0;
+
+        fec_decoder dec( [&]( std::uint8_t *, std::size_t, bool rebuilt ) {
+            ++delivered;
+            recovered += rebuilt;
+        } );
+        fec_encoder enc( [&]( const std::uint8_t *data, std::size_t len ) {
+            if( packets++ != 10 ) {
+                dec.on_packet( const_cast<std::uint8_t *>(data), len );
+            }
+        }, k, 1 );
+        for( unsigned i = 0; i < k; ++i ) {
+            msg[0] = static_cast<std::uint8_t>(i);
+            enc.send( msg.data( ), msg.size( ) );
+        }
+        enc.flush( );
+
+        const bool ok = ( delivered == k ) && ( recovered == 1 )
+                     && ( dec.stats( ).malformed == 0 );
+        bench_result( "fec" ).set( "k", k ).set( "m", 1u )
+            .set( "round_trip", ok ? "ok" : "FAILED" )
+            .set( "delivered", delivered )
+            .set( "recovered", recovered )
+            .set( "malformed", dec.stats( ).malformed );
+    }
+
+    /// datagrams of a peer without FEC, starting with the old type
+    /// bytes, must pass the decoder untouched
+    void bench_fec_plain( )
+    {
+        std::size_t delivered = 0;
+        fec_decoder dec( [&]( std::uint8_t *, std::size_t, bool ) {
+            ++delivered;
+        } );
+
+        std::size_t passed = 0;
+        for( const char *text: { "PING 0123456789abcdef",
+                                 "EHLO client.example.org" } )
+        {
+            std::vector<std::uint8_t> msg( text, text + std::strlen( text ) );
+            passed += !dec.on_packet( msg.data( ), msg.size( ) );
+        }
+
+        const bool ok = ( passed == 2 ) && ( delivered == 0 )
+                     && ( dec.stats( ).malformed == 0 );
+        bench_result( "fec" ).set( "plain", ok ? "ok" : "FAILED" )
+            .set( "passed", passed )
+            .set( "malformed", dec.stats( ).malformed );
+    }
+
+    /// a bottleneck link in simulated time: packets leave one after
+    /// another at rate, wait delay, and are tail dropped past queue
+    struct sim_link {
+
+        struct packet {
+            std::uint64_t               at;
+            std::vector<std::uint8_t>   data;
+        };
+
+        std::uint64_t       rate;       /// bytes per second
+        std::uint64_t       delay;
+        std::size_t         queue;      /// packets
+        std::uint64_t       busy  = 0;  /// the wire is free after this
+        std::uint64_t       drops = 0;
+        std::deque<packet>  flight;
+        std::uint64_t       queue_delay = 0;
+        std::uint64_t       delivered   = 0;
+
+        sim_link( std::uint64_t r, std::uint64_t d, std::size_t q )
+            :rate(r)
+            ,delay(d)
+            ,queue(q)
+        { }
+
+        void send( const std::uint8_t *data, std::size_t len,
+                   std::uint64_t now )
+        {
+            std::uint64_t start = std::max( busy, now );
+            if( ( start - now ) * rate / 1000000 / 1200 >= queue ) {
+                ++drops;
+                return;
+            }
+            busy = start + len * 1000000 / rate;
+            queue_delay += start - now;
+            ++delivered;
+            packet p = { busy + delay,
+                         std::vector<std::uint8_t>( data, data + len ) };
+            flight.push_back( std::move(p) );
+        }
+
+        std::uint64_t next( ) const
+        {
+            return flight.empty( ) ? 0 : flight.front( ).at;
+        }
+    };
+
+    /// one flow over a 100Mbit/s, 20ms RTT link with a 64 packet queue
+    void bench_congestion( const char *name,
+                           std::unique_ptr<congestion_controller> cc )
+    {
+        std::uint64_t now = 1;
+        sim_link up( 12500000, 10000, 64 );
+        sim_link down( 12500000, 10000, 64 );
+        std::size_t received = 0;
+
+        arq_channel tx( [&]( const std::uint8_t *d, std::size_t l ) {
+                            up.send( d, l, now );
+                        },
+                        [ ]( const std::uint8_t *, std::size_t, bool ) { } );
+        arq_channel rx( [&]( const std::uint8_t *d, std::size_t l ) {
+                            down.send( d, l, now );
+                        },
+                        [&]( const std::uint8_t *, std::size_t, bool ) {
+                            ++received;
+                        } );
+        tx.set_congestion( std::move(cc) );
+
+        const std::size_t messages = 50000;
+        std::vector<std::uint8_t> msg( 1200, 0 );
+        std::size_t sent = 0;
+
+        auto start = clock_type::now( );
+        while( received < messages ) {
+            while( ( sent < messages ) && ( tx.pending( ) < 2048 ) ) {
+                tx.send_reliable( msg.data( ), msg.size( ), now );
+                ++sent;
+            }
+            std::uint64_t due = 0;
+            for( std::uint64_t t: { up.next( ), down.next( ),
+                                    tx.next_deadline( ),
+                                    rx.next_deadline( ) } )
+            {
+                if( t && ( !due || t < due ) ) {
+                    due = t;
+                }
+            }
+            now = std::max( now, due );
+            while( up.next( ) && up.next( ) <= now ) {
+                rx.on_packet( up.flight.front( ).data.data( ),
+                              up.flight.front( ).data.size( ), now );
+                up.flight.pop_front( );
+            }
+            while( down.next( ) && down.next( ) <= now ) {
+                tx.on_packet( down.flight.front( ).data.data( ),
+                              down.flight.front( ).data.size( ), now );
+                down.flight.pop_front( );
+            }
+            tx.poll( now );
+            rx.poll( now );
+        }
+        double wall = ns_per_op( start, messages );
+
+        const auto &st = tx.stats( );
+        const double link = double(messages * msg.size( )) / 12500000.0;
+        bench_result( "congestion" ).set( "controller", name )
+            .set( "link_use_pct", 100.0 * link / ( double(now) / 1e6 ) )
+            .set( "drops", up.drops )
+            .set( "retx", st.retransmits + st.fast_retransmits )
+            .set( "avg_queue_us",
+                  up.queue_delay / ( up.delivered ? up.delivered : 1 ) )
+            .set( "srtt_us", tx.srtt( ) )
+            .set( "ns_per_message", wall );
+    }
+
+    /// the master's per-datagram cost for unknown sources in handshake
+    /// mode: answering with a cookie and checking an echoed one
+    void bench_cookie( )
+    {
+        cookie_jar jar;
+        auto eps = make_endpoints( 100000 );
+        const std::uint64_t now = 1000000000;
+        const std::size_t ops = 2000000;
+
+        std::vector<std::uint8_t> msgs( eps.size( )
+                                      * cookie_jar::message_size );
+        auto start = clock_type::now( );
+        for( std::size_t i = 0; i < ops; ++i ) {
+            std::size_t id = i % eps.size( );
+            jar.make( eps[id], now,
+                      &msgs[id * cookie_jar::message_size] );
+        }
+        double make = ns_per_op( start, ops );
+
+        /// echoed a whole epoch later: the check needs both hashes
+        std::size_t ok = 0;
+        start = clock_type::now( );
+        for( std::size_t i = 0; i < ops; ++i ) {
+            std::size_t id = i % eps.size( );
+            ok += jar.check( eps[id], now + 10000000,
+                             &msgs[id * cookie_jar::message_size] );
+        }
+        double check = ns_per_op( start, ops );
+        sink += ok;
+
+        bench_result( "cookie" ).set( "make_ns", make )
+            .set( "check_prev_epoch_ns", check )
+            .set( "valid", ok ).set( "ops", ops );
+    }
+
+    /// point_iface over one end of a local stream pair
+    class queue_point: public msctl::async_transport::point_iface<
+                                        ba::local::stream_protocol::socket> {
+
+        void on_read( char *, size_t ) override
+        { }
+
+    public:
+
+        explicit queue_point( ba::io_service &ios )
+            :point_iface(ios, 4096, OPT_NONE)
+        { }
+    };
+
+    /// 64 byte messages through point_iface::write from producer threads
+    /// to the thread running the io_service; this thread drains the
+    /// other end of the stream. Producers keep at most `cap` messages
+    /// queued. A warm up round that queues more than that before the
+    /// writer starts leaves enough nodes and slabs behind, so the
+    /// measured round must not allocate at all
+    void bench_write_queue( std::size_t producers )
+    {
+        const std::size_t messages = 400000;
+        const std::size_t size     = 64;
+        const std::size_t cap      = 4096;
+        const std::size_t warm     = cap + producers;
+        const std::size_t each     = messages / producers;
+        const std::size_t total    = each * producers * size;
+
+        ba::io_service ios;
+        auto point = std::make_shared<queue_point>( std::ref(ios) );
+        ba::local::stream_protocol::socket peer( ios );
+        ba::local::connect_pair( point->get_stream( ), peer );
+
+        /// the peak is read back the way the exporter would
+        metrics_registry reg;
+        reg.add_write_queue( "point=\"bench\"", *point );
+
+        const std::string msg( size, 'q' );
+        std::atomic<std::size_t> warmed(0);
+        std::atomic<bool> go(false);
+
+        std::vector<std::thread> threads;
+        for( std::size_t p = 0; p < producers; ++p ) {
+            threads.emplace_back( [&, each]( ) {
+                for( std::size_t i = 0; i < warm; ++i ) {
+                    point->write( msg );
+                }
+                ++warmed;
+                while( !go ) {
+                    std::this_thread::yield( );
+                }
+                for( std::size_t i = 0; i < each; ++i ) {
+                    while( point->write_queue_depth( ) >= cap ) {
+                        std::this_thread::yield( );
+                    }
+                    point->write( msg );
+                }
+            } );
+        }
+        while( warmed < producers ) {
+            std::this_thread::yield( );
+        }
+
+        std::unique_ptr<ba::io_service::work> work(
+                                    new ba::io_service::work( ios ) );
+        std::thread writer( [&ios]( ) { ios.run( ); } );
+
+        std::vector<char> buf( 64 * 1024 );
+        std::size_t got = 0;
+        while( got < warm * producers * size ) {
+            got += peer.read_some( ba::buffer( buf ) );
+        }
+
+        std::size_t before = allocations.load( );
+        auto start = clock_type::now( );
+        go = true;
+
+        got = 0;
+        while( got < total ) {
+            got += peer.read_some( ba::buffer( buf ) );
+        }
+        double secs = std::chrono::duration<double>(
+                                clock_type::now( ) - start ).count( );
+        std::size_t used = allocations.load( ) - before;
+
+        for( auto &t: threads ) {
+            t.join( );
+        }
+        /// run( ) returns once the last write has completed
+        work.reset( );
+        writer.join( );
+
+        double peak = 0;
+        for( auto &f: reg.snapshot( ) ) {
+            if( f.name == "point_write_queue_peak" ) {
+                peak = f.samples[0].value;
+            }
+        }
+
+        bench_result( "write_queue" ).set( "producers", producers )
+            .set( "size", size )
+            .set( "queue_peak", peak )
+            .set( "msgs_per_sec", double(each * producers) / secs )
+            .set( "mbps", double(total) / secs / 1e6 )
+            .set( "allocs_per_message",
+                  double(used) / double(each * producers) )
+            .set( "no_malloc", used == 0 ? "ok" : "FAILED" );
+    }
+
+    /// re-arming a pending timeout, as an idle check does per packet:
+    /// delayed_call cancels the old wait and posts its abort each time,
+    /// the timer wheel relinks a hook
+    void bench_rearm( )
+    {
+        using vtrc::common::delayed_call;
+        using vtrc::common::timer_wheel;
+
+        const std::size_t count = 1000000;
+        ba::io_service ios;
+
+        delayed_call call( ios );
+        std::size_t aborted = 0;
+        auto handler = [&aborted]( const bs::error_code &err ) {
+            aborted += ( err == ba::error::operation_aborted );
+        };
+        std::size_t before = allocations.load( );
+        auto start = clock_type::now( );
+        for( std::size_t i = 0; i < count; ++i ) {
+            call.call_from_now( handler, delayed_call::seconds( 10 ) );
+            if( ( i & 63 ) == 63 ) {
+                ios.poll( );
+            }
+        }
+        ios.poll( );
+        double dc_ns = ns_per_op( start, count );
+        std::size_t dc_allocs = allocations.load( ) - before;
+        call.cancel( );
+        ios.poll( );
+
+        timer_wheel wheel( ios, timer_wheel::milliseconds( 100 ) );
+        timer_wheel::hook hook( [ ]( ) { } );
+        const std::uint64_t ticks =
+                    wheel.to_ticks( timer_wheel::seconds( 10 ) );
+        before = allocations.load( );
+        start = clock_type::now( );
+        for( std::size_t i = 0; i < count; ++i ) {
+            wheel.schedule( hook, ticks + ( i & 7 ) );
+        }
+        double wheel_ns = ns_per_op( start, count );
+        std::size_t wheel_allocs = allocations.load( ) - before;
+        wheel.cancel( hook );
+
+        bench_result( "rearm" ).set( "timer", "delayed_call" )
+            .set( "rearm_ns", dc_ns )
+            .set( "allocs_per_rearm", double(dc_allocs) / count )
+            .set( "aborted", aborted );
+        bench_result( "rearm" ).set( "timer", "timer_wheel" )
+            .set( "rearm_ns", wheel_ns )
+            .set( "allocs_per_rearm", double(wheel_allocs) / count );
+    }
+
+    /// threads counting into one endpoint_metrics, against the same
+    /// adds on a single shared atomic; then the handler histogram and
+    /// a scrape of 16 endpoints
+    void bench_metrics( std::size_t threads )
+    {
+        const std::size_t count = 2000000;
+
+        auto run = [threads, count]( std::function<void ( )> add ) {
+            std::vector<std::thread> pool;
+            auto start = clock_type::now( );
+            for( std::size_t t = 0; t < threads; ++t ) {
+                pool.emplace_back( [&add, count]( ) {
+                    for( std::size_t i = 0; i < count; ++i ) {
+                        add( );
+                    }
+                } );
+            }
+            for( auto &t: pool ) {
+                t.join( );
+            }
+            return ns_per_op( start, count );
+        };
+
+        endpoint_metrics m;
+        double sharded_ns = run( [&m]( ) {
+            m.add( endpoint_metrics::PACKETS_IN );
+        } );
+        std::atomic<std::uint64_t> shared(0);
+        double shared_ns = run( [&shared]( ) {
+            shared.fetch_add( 1, std::memory_order_relaxed );
+        } );
+        std::uint64_t value = 0;
+        double record_ns = run( [&m, &value]( ) {
+            m.handler_ns.record( std::int64_t( 100 + ( value++ & 4095 ) ) );
+        } );
+
+        bench_result( "metrics" ).set( "threads", threads )
+            .set( "counter", "sharded" ).set( "add_ns", sharded_ns )
+            .set( "total", m.value( endpoint_metrics::PACKETS_IN ) );
+        bench_result( "metrics" ).set( "threads", threads )
+            .set( "counter", "shared_atomic" ).set( "add_ns", shared_ns );
+        bench_result( "metrics" ).set( "threads", threads )
+            .set( "counter", "histogram" ).set( "add_ns", record_ns );
+
+        if( threads != 1 ) {
+            return;
+        }
+        const std::size_t endpoints = 16;
+        const std::size_t scrapes   = 50;
+        std::vector<std::unique_ptr<endpoint_metrics> > all;
+        metrics_registry reg;
+        for( std::size_t i = 0; i < endpoints; ++i ) {
+            all.emplace_back( new endpoint_metrics );
+            all.back( )->handler_ns.record( 1000 );
+            reg.add_endpoint( "socket=\"" + std::to_string( i ) + "\"",
+                              *all.back( ) );
+        }
+        std::size_t bytes = 0;
+        auto start = clock_type::now( );
+        for( std::size_t i = 0; i < scrapes; ++i ) {
+            bytes += reg.prometheus( ).size( );
+        }
+        bench_result( "metrics" ).set( "endpoints", endpoints )
+            .set( "scrape_us", ns_per_op( start, scrapes ) / 1000 )
+            .set( "bytes", bytes / scrapes );
+    }
+
+}
+
+namespace {
+
+    struct bench_entry {
+        const char             *name;
+        std::function<void ()>  run;
+    };
+
+    std::vector<bench_entry> suite( )
+    {
+        return {
+            { "client_table", [ ]( ) {
+                for( std::size_t count: { 1000, 100000, 1000000 } ) {
+                    bench_client_table( count );
+                }
+            } },
+            { "clock", &bench_clock },
+            { "cookie", &bench_cookie },
+            { "rearm", &bench_rearm },
+            { "metrics", [ ]( ) {
+                bench_metrics( 1 );
+                bench_metrics( 4 );
+            } },
+            { "write_queue", [ ]( ) {
+                bench_write_queue( 1 );
+                bench_write_queue( 4 );
+            } },
+            { "read_allocations", [ ]( ) {
+                bench_read_allocations( false );
+                bench_read_allocations( true );
+            } },
+            { "receive_cpu", [ ]( ) {
+                bench_receive_cpu( false );
+                bench_receive_cpu( true );
+            } },
+            { "truncation", [ ]( ) {
+                bench_truncation( false );
+                bench_truncation( true );
+            } },
+            { "dispatch", &bench_dispatch },
+            { "threading", [ ]( ) {
+                bench_threading<strand_threading>( "strand" );
+                bench_threading<single_threading>( "single" );
+            } },
+            { "echo", [ ]( ) {
+                bench_echo( "echo", 64, 0 );
+                bench_echo( "echo", 1400, 0 );
+            } },
+            { "shutdown", &bench_shutdown },
+            { "busy_poll", [ ]( ) {
+                for( std::uint64_t spin: { 50, 1000 } ) {
+                    bench_echo( "busy_poll", 64, spin );
+                }
+            } },
+            { "bulk", [ ]( ) {
+                bench_bulk( false );
+                bench_bulk( true );
+            } },
+            { "arq", [ ]( ) {
+                bench_arq( 0, false );
+                for( double loss: { 0.0, 0.01, 0.05 } ) {
+                    bench_arq( loss, true );
+                }
+            } },
+            { "fragments", [ ]( ) {
+                bench_fragments( true );
+                bench_fragments( false );
+            } },
+            { "fec_xor", &bench_fec_kernels },
+            { "fec", [ ]( ) {
+                for( double loss: { 0.01, 0.05 } ) {
+                    bench_fec( 0, 0, loss );
+                    bench_fec( 8, 1, loss );
+                    bench_fec( 8, 2, loss );
+                    bench_fec( 4, 2, loss );
+                    bench_fec( 64, 1, loss );
+                }
+                bench_fec_full_group( );
+                bench_fec_plain( );
+            } },
+            { "congestion", [ ]( ) {
+                bench_congestion( "none", nullptr );
+                bench_congestion( "aimd",
+                    std::unique_ptr<congestion_controller>(
+                                            new aimd_controller ) );
+                bench_congestion( "bbr-lite",
+                    std::unique_ptr<congestion_controller>(
+                                            new bbr_lite_controller ) );
+            } },
+        };
+    }
+
+    void usage( )
+    {
+        std::cerr << "udp-bench [--list] [--repeat N] [--out FILE]"
+                     " [bench ...]\n"
+                     "  runs the named benches (all by default); results"
+                     " go to stdout or FILE\n"
+                     "  as JSON, progress to stderr\n";
+    }
+
+    /// what the numbers depend on besides the code
+    void write_report( std::ostream &os, std::size_t repeat )
+    {
+        os << "{\n  \"suite\": \"udp-bench\",\n"
+           << "  \"timestamp\": " << std::time( nullptr ) << ",\n"
+#if defined(__VERSION__)
+           << "  \"compiler\": " << json_string( __VERSION__ ) << ",\n"
+#endif
+           << "  \"boost\": " << json_string( BOOST_LIB_VERSION ) << ",\n"
+#if defined(NDEBUG)
+           << "  \"ndebug\": true,\n"
+#else
+           << "  \"ndebug\": false,\n"
+#endif
+#if defined(UDP_ENDPOINT_IO_URING)
+           << "  \"io_uring\": true,\n"
+#else
+           << "  \"io_uring\": false,\n"
+#endif
+           << "  \"cpus\": " << std::thread::hardware_concurrency( ) << ",\n"
+           << "  \"repeat\": " << repeat << ",\n"
+           << "  \"results\": [";
+        for( std::size_t i = 0; i < results.size( ); ++i ) {
+            os << ( i ? ",\n    " : "\n    " ) << results[i];
+        }
+        os << "\n  ]\n}\n";
+    }
+
+}
+
+int main( int argc, char *argv[] )
+{
+    try {
+
+        auto benches = suite( );
+        std::vector<std::string> names;
+        std::size_t repeat = 1;
+        std::string out;
+
+        for( int i = 1; i < argc; ++i ) {
+            const std::string arg( argv[i] );
+            if( arg == "--list" ) {
+                for( auto &b: benches ) {
+                    std::cout << b.name << "\n";
+                }
+                return 0;
+            } else if( ( arg == "--repeat" ) && ( i + 1 < argc ) ) {
+                repeat = std::max( std::atoi( argv[++i] ), 1 );
+            } else if( ( arg == "--out" ) && ( i + 1 < argc ) ) {
+                out = argv[++i];
+            } else if( ( arg == "--help" ) || ( arg[0] == '-' ) ) {
+                usage( );
+                return arg == "--help" ? 0 : 1;
+            } else {
+                names.push_back( arg );
+            }
+        }
+
+        for( auto &n: names ) {
+            if( std::none_of( benches.begin( ), benches.end( ),
+                    [&n]( const bench_entry &b ) { return n == b.name; } ) )
+            {
+                std::cerr << "Unknown bench " << n << "; see --list\n";
+                return 1;
+            }
+        }
+
+        for( current_run = 0; current_run < repeat; ++current_run ) {
+            for( auto &b: benches ) {
+                if( names.empty( )
+                 || std::count( names.begin( ), names.end( ), b.name ) )
+                {
+                    b.run( );
+                }
+            }
+        }
+
+        if( out.empty( ) ) {
+            write_report( std::cout, repeat );
+        } else {
+            std::ofstream file( out );
+            write_report( file, repeat );
+            if( !file ) {
+                std::cerr << "Error writing " << out << "\n";
+                return 1;
+            }
+        }
+
+    } catch( const std::exception &ex ) {
+        std::cerr << "Error " << ex.what( ) << "\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef UDP_BITS_HPP
+#define UDP_BITS_HPP
+
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/// bit scans for the gcc/clang builtins and their MSVC intrinsics.
+/// clz64 and ctz64 want a non zero value
+namespace udp_bits {
+
+    inline int clz64( std::uint64_t value )
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse64( &index, value );
+        return 63 - static_cast<int>(index);
+#else
+        return __builtin_clzll( value );
+#endif
+    }
+
+    inline int ctz64( std::uint64_t value )
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward64( &index, value );
+        return static_cast<int>(index);
+#else
+        return __builtin_ctzll( value );
+#endif
+    }
+
+    inline int popcount64( std::uint64_t value )
+    {
+#if defined(_MSC_VER)
+        return static_cast<int>(__popcnt64( value ));
+#else
+        return __builtin_popcountll( value );
+#endif
+    }
+
+}
+
+#endif // UDP_BITS_HPP
@@ -0,0 +1,309 @@
+#ifndef UDP_BUFFER_POOL_HPP
+#define UDP_BUFFER_POOL_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <cstring>
+#include <stdexcept>
+
+#include "boost/asio/buffer.hpp"
+
+class buffer_pool;
+class buffer_handle;
+
+namespace pool_detail {
+
+    struct pool_state;
+
+    /// slab header; the payload follows the header in the same block
+    struct slab {
+
+        std::atomic<std::uint32_t>  refs_;
+        slab                       *next_;
+        pool_state                 *pool_;
+        std::size_t                 capacity_;
+        std::size_t                 length_;
+
+        std::uint8_t *data( )
+        {
+            return reinterpret_cast<std::uint8_t *>(this + 1);
+        }
+    };
+
+    /// shared by the owner and by every slab it has created, so
+    /// handles may outlive the buffer_pool object
+    struct pool_state {
+
+        std::atomic<std::size_t>    refs_;
+        std::atomic<slab *>         returned_; /// pushed by any thread
+        std::atomic<bool>           closed_;
+        slab                       *free_;     /// owner only
+        std::size_t                 slab_size_;
+
+        explicit pool_state( std::size_t slab_size )
+            :refs_(1)
+            ,returned_(nullptr)
+            ,closed_(false)
+            ,free_(nullptr)
+            ,slab_size_(slab_size)
+        { }
+
+        void release( )
+        {
+            if( refs_.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ) {
+                delete this;
+            }
+        }
+
+        slab *create( )
+        {
+            void *mem = ::operator new( sizeof(slab) + slab_size_ );
+            slab *s = new (mem) slab;
+            s->refs_.store( 0, std::memory_order_relaxed );
+            s->next_     = nullptr;
+            s->pool_     = this;
+            s->capacity_ = slab_size_;
+            s->length_   = 0;
+            refs_.fetch_add( 1, std::memory_order_relaxed );
+            return s;
+        }
+
+        static void destroy( slab *s )
+        {
+            pool_state *ps = s->pool_;
+            s->~slab( );
+            ::operator delete( s );
+            ps->release( );
+        }
+
+        static void destroy_chain( slab *s )
+        {
+            while( s ) {
+                slab *next = s->next_;
+                destroy( s );
+                s = next;
+            }
+        }
+
+        /// any thread; the last handle gives the slab back. Once it is
+        /// pushed, close( ) may destroy it and with it the slab's
+        /// reference to this state, so recycle holds one of its own
+        void recycle( slab *s )
+        {
+            refs_.fetch_add( 1, std::memory_order_relaxed );
+
+            slab *head = returned_.load( std::memory_order_relaxed );
+            do {
+                s->next_ = head;
+            } while( !returned_.compare_exchange_weak( head, s ) );
+
+            /// pairs with close( ): either we see the flag or it sees us
+            if( closed_.load( ) ) {
+                destroy_chain( returned_.exchange( nullptr ) );
+            }
+            release( );
+        }
+
+        /// owner only
+        slab *get( )
+        {
+            while( true ) {
+                if( !free_ ) {
+                    free_ = returned_.exchange( nullptr,
+                                                std::memory_order_acquire );
+                    if( !free_ ) {
+                        return create( );
+                    }
+                }
+                slab *s = free_;
+                free_ = s->next_;
+                if( s->capacity_ == slab_size_ ) {
+                    return s;
+                }
+                destroy( s ); /// slab size was changed
+            }
+        }
+
+        void close( )
+        {
+            closed_.store( true );
+            destroy_chain( free_ );
+            free_ = nullptr;
+            destroy_chain( returned_.exchange( nullptr ) );
+            release( );
+        }
+    };
+}
+
+/// intrusive reference to a pooled packet buffer
+class buffer_handle {
+
+    friend class buffer_pool;
+
+    pool_detail::slab *slab_;
+
+    explicit buffer_handle( pool_detail::slab *s )
+        :slab_(s)
+    {
+        slab_->refs_.store( 1, std::memory_order_relaxed );
+        slab_->length_ = slab_->capacity_;
+    }
+
+    void add_ref( )
+    {
+        if( slab_ ) {
+            slab_->refs_.fetch_add( 1, std::memory_order_relaxed );
+        }
+    }
+
+public:
+
+    buffer_handle( )
+        :slab_(nullptr)
+    { }
+
+    buffer_handle( const buffer_handle &other )
+        :slab_(other.slab_)
+    {
+        add_ref( );
+    }
+
+    buffer_handle( buffer_handle &&other )
+        :slab_(other.slab_)
+    {
+        other.slab_ = nullptr;
+    }
+
+    buffer_handle &operator = ( buffer_handle other )
+    {
+        swap( other );
+        return *this;
+    }
+
+    ~buffer_handle( )
+    {
+        reset( );
+    }
+
+    void swap( buffer_handle &other )
+    {
+        pool_detail::slab *tmp = slab_;
+        slab_ = other.slab_;
+        other.slab_ = tmp;
+    }
+
+    void reset( )
+    {
+        if( slab_ ) {
+            if( slab_->refs_.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ) {
+                slab_->pool_->recycle( slab_ );
+            }
+            slab_ = nullptr;
+        }
+    }
+
+    explicit operator bool ( ) const
+    {
+        return slab_ != nullptr;
+    }
+
+    bool unique( ) const
+    {
+        return slab_ && ( slab_->refs_.load( std::memory_order_acquire ) == 1 );
+    }
+
+    std::uint8_t *data( ) const
+    {
+        return slab_->data( );
+    }
+
+    std::size_t size( ) const
+    {
+        return slab_->length_;
+    }
+
+    std::size_t capacity( ) const
+    {
+        return slab_ ? slab_->capacity_ : 0;
+    }
+
+    /// length must not exceed capacity( )
+    void resize( std::size_t length )
+    {
+        slab_->length_ = length;
+    }
+
+    boost::asio::const_buffer buffer( ) const
+    {
+        return boost::asio::const_buffer( slab_->data( ), slab_->length_ );
+    }
+};
+
+/// pool of fixed size slabs. get( ) must be called by one thread at a
+/// time (the owner's strand); handles may be released from any thread.
+/// Steady state does no heap allocation.
+class buffer_pool {
+
+    pool_detail::pool_state *state_;
+
+public:
+
+    explicit buffer_pool( std::size_t slab_size = 2048 )
+        :state_(new pool_detail::pool_state(slab_size))
+    { }
+
+    buffer_pool( const buffer_pool & ) = delete;
+    buffer_pool &operator = ( const buffer_pool & ) = delete;
+
+    ~buffer_pool( )
+    {
+        state_->close( );
+    }
+
+    /// the calling thread's own pool
+    static buffer_pool &local( )
+    {
+        static thread_local buffer_pool pool;
+        return pool;
+    }
+
+    buffer_handle get( )
+    {
+        return buffer_handle( state_->get( ) );
+    }
+
+    buffer_handle copy( const void *data, std::size_t length )
+    {
+        if( length > slab_size( ) ) {
+            throw std::length_error( "buffer_pool::copy" );
+        }
+        buffer_handle res(get( ));
+        std::memcpy( res.data( ), data, length );
+        res.resize( length );
+        return res;
+    }
+
+    std::size_t slab_size( ) const
+    {
+        return state_->slab_size_;
+    }
+
+    /// slabs of the old size are dropped when they come back
+    void set_slab_size( std::size_t len )
+    {
+        state_->slab_size_ = len;
+    }
+
+    void reserve( std::size_t count )
+    {
+        while( count-- ) {
+            pool_detail::slab *s = state_->create( );
+            s->next_ = state_->free_;
+            state_->free_ = s;
+        }
+    }
+};
+
+#endif // UDP_BUFFER_POOL_HPP
@@ -0,0 +1,99 @@
+#ifndef UDP_BUSY_POLL_HPP
+#define UDP_BUSY_POLL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "boost/asio.hpp"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/// runs an io_service like run( ), but keeps calling poll( ) for up to
+/// spin microseconds after the last handler before it blocks in
+/// run_one( ). A datagram that comes within the budget is picked up
+/// without an epoll sleep and wakeup; the price is a core at 100%.
+/// Pin the thread to an isolated core (isolcpus, nohz_full) and give
+/// the sockets set_busy_poll( ) to spin in the driver as well.
+class busy_poll_runner {
+
+    boost::asio::io_service    &ios_;
+    std::uint64_t               spin_;
+    int                         cpu_;
+    std::atomic<std::uint64_t>  polls_;
+    std::atomic<std::uint64_t>  sleeps_;
+
+public:
+
+    /// cpu < 0 leaves the thread where it is
+    explicit busy_poll_runner( boost::asio::io_service &ios,
+                               std::uint64_t spin_usec = 50,
+                               int cpu = -1 )
+        :ios_(ios)
+        ,spin_(spin_usec)
+        ,cpu_(cpu)
+        ,polls_(0)
+        ,sleeps_(0)
+    { }
+
+    /// false if the cpu is not allowed or not linux
+    static bool pin_this_thread( int cpu )
+    {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( cpu, &set );
+        return 0 == ::pthread_setaffinity_np( ::pthread_self( ),
+                                              sizeof(set), &set );
+#else
+        (void)cpu;
+        return false;
+#endif
+    }
+
+    /// returns when the io_service is stopped or runs out of work
+    void run( )
+    {
+        using clock = std::chrono::steady_clock;
+        if( cpu_ >= 0 ) {
+            pin_this_thread( cpu_ );
+        }
+        const auto budget = std::chrono::microseconds( spin_ );
+
+        while( !ios_.stopped( ) ) {
+            auto until = clock::now( ) + budget;
+            std::uint64_t polls = 0;
+            while( true ) {
+                ++polls;
+                if( ios_.poll( ) ) {
+                    until = clock::now( ) + budget;
+                } else if( ios_.stopped( ) || ( clock::now( ) >= until ) ) {
+                    break;
+                }
+            }
+            polls_.fetch_add( polls, std::memory_order_relaxed );
+            if( ios_.stopped( ) ) {
+                break;
+            }
+            sleeps_.fetch_add( 1, std::memory_order_relaxed );
+            ios_.run_one( );
+        }
+    }
+
+    /// poll( ) calls
+    std::uint64_t polls( ) const
+    {
+        return polls_.load( std::memory_order_relaxed );
+    }
+
+    /// times the budget ran out and the thread blocked
+    std::uint64_t sleeps( ) const
+    {
+        return sleeps_.load( std::memory_order_relaxed );
+    }
+};
+
+#endif // UDP_BUSY_POLL_HPP
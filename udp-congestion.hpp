@@ -0,0 +1,382 @@
+#ifndef UDP_CONGESTION_HPP
+#define UDP_CONGESTION_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+/// congestion control for a flow with acknowledgements (see arq_channel).
+/// Sizes are bytes, times microseconds, rates bytes per second.
+/// The sender reports every first transmission (on_sent), every newly
+/// acknowledged packet (on_ack), detected losses and timeouts; it may
+/// send new data while can_send( ) and no faster than pacing_rate( ).
+
+struct congestion_stats {
+    std::uint64_t sent_bytes    = 0;
+    std::uint64_t acked_bytes   = 0;
+    std::uint64_t losses        = 0;
+    std::uint64_t timeouts      = 0;
+};
+
+class congestion_controller {
+
+protected:
+
+    std::uint64_t       mss_;
+    std::uint64_t       in_flight_  = 0;
+    std::uint64_t       srtt_       = 0;
+    std::uint64_t       min_rtt_    = 0;
+    congestion_stats    stats_;
+
+    virtual void sent( std::size_t /*bytes*/, std::uint64_t /*now*/ ) { }
+    virtual void acked( std::size_t bytes, std::uint64_t rtt,
+                        std::uint64_t now ) = 0;
+    virtual void lost( std::uint64_t now ) = 0;
+    virtual void timed_out( std::uint64_t now ) = 0;
+
+public:
+
+    explicit congestion_controller( std::size_t mss )
+        :mss_(mss)
+    { }
+
+    virtual ~congestion_controller( ) { }
+
+    void on_sent( std::size_t bytes, std::uint64_t now )
+    {
+        in_flight_ += bytes;
+        stats_.sent_bytes += bytes;
+        sent( bytes, now );
+    }
+
+    /// rtt is 0 when the packet was retransmitted
+    void on_ack( std::size_t bytes, std::uint64_t rtt, std::uint64_t now )
+    {
+        in_flight_ -= std::min<std::uint64_t>( bytes, in_flight_ );
+        stats_.acked_bytes += bytes;
+        if( rtt ) {
+            srtt_    = srtt_ ? ( srtt_ * 7 + rtt ) / 8 : rtt;
+            min_rtt_ = min_rtt_ ? std::min( min_rtt_, rtt ) : rtt;
+        }
+        acked( bytes, rtt, now );
+    }
+
+    void on_loss( std::uint64_t now )
+    {
+        ++stats_.losses;
+        lost( now );
+    }
+
+    void on_timeout( std::uint64_t now )
+    {
+        ++stats_.timeouts;
+        timed_out( now );
+    }
+
+    /// one packet may always be in flight
+    bool can_send( std::size_t bytes ) const
+    {
+        return !in_flight_ || ( in_flight_ + bytes <= cwnd( ) );
+    }
+
+    std::uint64_t in_flight( ) const
+    {
+        return in_flight_;
+    }
+
+    std::uint64_t srtt( ) const
+    {
+        return srtt_;
+    }
+
+    const congestion_stats &stats( ) const
+    {
+        return stats_;
+    }
+
+    virtual std::uint64_t cwnd( ) const = 0;
+
+    /// 0: not paced
+    virtual std::uint64_t pacing_rate( ) const = 0;
+
+    virtual const char *name( ) const = 0;
+};
+
+/// Reno style: slow start, +1 mss per window of acks, halve on a loss
+/// (once per round trip), restart from 2 mss on a timeout
+class aimd_controller: public congestion_controller {
+
+    std::uint64_t   cwnd_;
+    std::uint64_t   ssthresh_;
+    std::uint64_t   acc_        = 0;    /// acked bytes toward the next mss
+    std::uint64_t   recovery_   = 0;    /// no cuts before this time
+
+    void cut( std::uint64_t now, std::uint64_t to )
+    {
+        ssthresh_ = std::max( cwnd_ / 2, mss_ * 2 );
+        cwnd_     = to ? to : ssthresh_;
+        acc_      = 0;
+        recovery_ = now + ( srtt_ ? srtt_ : 1000 );
+    }
+
+protected:
+
+    void acked( std::size_t bytes, std::uint64_t, std::uint64_t ) override
+    {
+        if( cwnd_ < ssthresh_ ) {
+            cwnd_ += bytes;
+            return;
+        }
+        acc_ += bytes;
+        if( acc_ >= cwnd_ ) {
+            acc_  -= cwnd_;
+            cwnd_ += mss_;
+        }
+    }
+
+    void lost( std::uint64_t now ) override
+    {
+        if( now >= recovery_ ) {
+            cut( now, 0 );
+        }
+    }
+
+    void timed_out( std::uint64_t now ) override
+    {
+        cut( now, mss_ * 2 );
+    }
+
+public:
+
+    explicit aimd_controller( std::size_t mss = 1200,
+                              std::size_t initial_packets = 10 )
+        :congestion_controller(mss)
+        ,cwnd_(mss * initial_packets)
+        ,ssthresh_(~std::uint64_t(0))
+    { }
+
+    std::uint64_t cwnd( ) const override
+    {
+        return cwnd_;
+    }
+
+    /// a window per round trip; 2x in slow start, 1.25x after
+    std::uint64_t pacing_rate( ) const override
+    {
+        if( !srtt_ ) {
+            return 0;
+        }
+        std::uint64_t rate = cwnd_ * 1000000 / srtt_;
+        return ( cwnd_ < ssthresh_ ) ? rate * 2 : rate * 5 / 4;
+    }
+
+    const char *name( ) const override
+    {
+        return "aimd";
+    }
+};
+
+/// BBR-like model: paces at the bottleneck bandwidth (max delivery rate
+/// over the last rounds) and keeps about two bandwidth-delay products in
+/// flight. Loss is not a congestion signal; timeouts are.
+/// Missing from full BBR: PROBE_RTT and per-packet delivery rate samples;
+/// the rate is measured per round trip, so app-limited rounds read low
+/// until they age out of the filter.
+class bbr_lite_controller: public congestion_controller {
+
+    enum mode {
+        STARTUP,
+        DRAIN,
+        PROBE_BW
+    };
+
+    enum {
+        bw_rounds   = 10,
+        cycle_len   = 8
+    };
+
+    static double high_gain( )
+    {
+        return 2.885;
+    }
+
+    mode            mode_       = STARTUP;
+    std::uint64_t   bw_[bw_rounds];
+    std::uint64_t   round_      = 0;
+    std::uint64_t   round_start_ = 0;
+    std::uint64_t   round_bytes_ = 0;
+    std::uint64_t   full_bw_    = 0;
+    unsigned        full_bw_rounds_ = 0;
+    unsigned        cycle_      = 0;
+    std::uint64_t   initial_cwnd_;
+    std::uint64_t   timeout_cap_ = 0;   /// cwnd limit after a timeout
+
+    std::uint64_t btl_bw( ) const
+    {
+        return *std::max_element( bw_, bw_ + bw_rounds );
+    }
+
+    std::uint64_t bdp( ) const
+    {
+        return btl_bw( ) * min_rtt_ / 1000000;
+    }
+
+    double pacing_gain( ) const
+    {
+        static const double cycle[cycle_len] = {
+            1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0
+        };
+        switch( mode_ ) {
+        case STARTUP:   return high_gain( );
+        case DRAIN:     return 1.0 / high_gain( );
+        default:        return cycle[cycle_];
+        }
+    }
+
+    void end_round( std::uint64_t now )
+    {
+        std::uint64_t elapsed = now - round_start_;
+        bw_[round_ % bw_rounds] = round_bytes_ * 1000000 / elapsed;
+        ++round_;
+        round_start_ = now;
+        round_bytes_ = 0;
+        timeout_cap_ = 0;
+
+        if( mode_ == STARTUP ) {
+            /// the pipe is full once 3 rounds bring < 25% more bandwidth
+            if( btl_bw( ) >= full_bw_ * 5 / 4 ) {
+                full_bw_ = btl_bw( );
+                full_bw_rounds_ = 0;
+            } else if( ++full_bw_rounds_ >= 3 ) {
+                mode_ = DRAIN;
+            }
+        } else if( mode_ == DRAIN ) {
+            if( in_flight_ <= bdp( ) ) {
+                mode_  = PROBE_BW;
+                cycle_ = 0;
+            }
+        } else {
+            cycle_ = ( cycle_ + 1 ) % cycle_len;
+        }
+    }
+
+protected:
+
+    void acked( std::size_t bytes, std::uint64_t, std::uint64_t now ) override
+    {
+        if( !round_start_ ) {
+            round_start_ = now;
+        }
+        round_bytes_ += bytes;
+        if( min_rtt_ && ( now - round_start_ >= min_rtt_ ) ) {
+            end_round( now );
+        }
+    }
+
+    void lost( std::uint64_t ) override
+    { }
+
+    void timed_out( std::uint64_t ) override
+    {
+        timeout_cap_ = mss_ * 4;
+    }
+
+public:
+
+    explicit bbr_lite_controller( std::size_t mss = 1200,
+                                  std::size_t initial_packets = 10 )
+        :congestion_controller(mss)
+        ,initial_cwnd_(mss * initial_packets)
+    {
+        std::fill( bw_, bw_ + bw_rounds, 0 );
+    }
+
+    std::uint64_t cwnd( ) const override
+    {
+        if( timeout_cap_ ) {
+            return timeout_cap_;
+        }
+        if( !btl_bw( ) ) {
+            return initial_cwnd_;
+        }
+        const double gain = ( mode_ == PROBE_BW ) ? 2.0 : high_gain( );
+        return std::max<std::uint64_t>(
+                    static_cast<std::uint64_t>(double(bdp( )) * gain),
+                    mss_ * 4 );
+    }
+
+    std::uint64_t pacing_rate( ) const override
+    {
+        std::uint64_t bw = btl_bw( );
+        if( !bw ) {
+            return srtt_ ? initial_cwnd_ * 1000000 / srtt_ * 2 : 0;
+        }
+        return static_cast<std::uint64_t>(double(bw) * pacing_gain( ));
+    }
+
+    std::uint64_t bottleneck_bandwidth( ) const
+    {
+        return btl_bw( );
+    }
+
+    const char *name( ) const override
+    {
+        return "bbr-lite";
+    }
+};
+
+/// spaces packets at a rate; up to burst microseconds of unused time
+/// may be spent at once
+class pacer {
+
+    std::uint64_t   rate_   = 0;
+    std::uint64_t   burst_  = 1000;
+    std::uint64_t   next_   = 0;
+    std::uint64_t   delays_ = 0;
+
+public:
+
+    /// 0 turns pacing off
+    void set_rate( std::uint64_t bytes_per_second )
+    {
+        rate_ = bytes_per_second;
+    }
+
+    void set_burst( std::uint64_t microseconds )
+    {
+        burst_ = microseconds;
+    }
+
+    std::uint64_t rate( ) const
+    {
+        return rate_;
+    }
+
+    /// 0 if a packet may go now, else the time it may
+    std::uint64_t ready_at( std::uint64_t now )
+    {
+        if( !rate_ || ( next_ <= now ) ) {
+            return 0;
+        }
+        ++delays_;
+        return next_;
+    }
+
+    void on_send( std::size_t bytes, std::uint64_t now )
+    {
+        if( !rate_ ) {
+            return;
+        }
+        const std::uint64_t earliest = now > burst_ ? now - burst_ : 0;
+        next_ = std::max( next_, earliest )
+              + std::uint64_t(bytes) * 1000000 / rate_;
+    }
+
+    /// how often a packet had to wait
+    std::uint64_t delays( ) const
+    {
+        return delays_;
+    }
+};
+
+#endif // UDP_CONGESTION_HPP
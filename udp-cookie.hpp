@@ -0,0 +1,144 @@
+#ifndef UDP_COOKIE_HPP
+#define UDP_COOKIE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <random>
+
+#include "boost/asio.hpp"
+
+#include "udp-endpoint-map.hpp"
+
+/// stateless return-routability check.
+/// An unknown source gets a cookie = siphash( secret, address, port, epoch );
+/// it has to send it back in front of its next datagram before anything is
+/// allocated for it. Cookies from the current and the previous epoch pass.
+///
+/// wire format: 4 bytes magic, 8 bytes cookie (little endian)
+class cookie_jar {
+
+    std::uint64_t k0_;
+    std::uint64_t k1_;
+    std::uint64_t epoch_len_;   /// microseconds
+
+    static std::uint64_t rotl( std::uint64_t x, int b )
+    {
+        return ( x << b ) | ( x >> ( 64 - b ) );
+    }
+
+    static void sipround( std::uint64_t &v0, std::uint64_t &v1,
+                          std::uint64_t &v2, std::uint64_t &v3 )
+    {
+        v0 += v1; v1 = rotl( v1, 13 ); v1 ^= v0; v0 = rotl( v0, 32 );
+        v2 += v3; v3 = rotl( v3, 16 ); v3 ^= v2;
+        v0 += v3; v3 = rotl( v3, 21 ); v3 ^= v0;
+        v2 += v1; v1 = rotl( v1, 17 ); v1 ^= v2; v2 = rotl( v2, 32 );
+    }
+
+    /// SipHash-2-4 over whole 64 bit words
+    std::uint64_t siphash( const std::uint64_t *m, std::size_t words ) const
+    {
+        std::uint64_t v0 = k0_ ^ 0x736f6d6570736575ULL;
+        std::uint64_t v1 = k1_ ^ 0x646f72616e646f6dULL;
+        std::uint64_t v2 = k0_ ^ 0x6c7967656e657261ULL;
+        std::uint64_t v3 = k1_ ^ 0x7465646279746573ULL;
+
+        for( std::size_t i = 0; i < words; ++i ) {
+            v3 ^= m[i];
+            sipround( v0, v1, v2, v3 );
+            sipround( v0, v1, v2, v3 );
+            v0 ^= m[i];
+        }
+
+        const std::uint64_t last = std::uint64_t( words * 8 ) << 56;
+        v3 ^= last;
+        sipround( v0, v1, v2, v3 );
+        sipround( v0, v1, v2, v3 );
+        v0 ^= last;
+
+        v2 ^= 0xff;
+        sipround( v0, v1, v2, v3 );
+        sipround( v0, v1, v2, v3 );
+        sipround( v0, v1, v2, v3 );
+        sipround( v0, v1, v2, v3 );
+        return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+    std::uint64_t compute( const endpoint_key &key, std::uint64_t epoch ) const
+    {
+        const std::uint64_t m[4] = {
+            key.hi,
+            key.lo,
+            ( std::uint64_t(key.port_family) << 32 ) | key.scope,
+            epoch
+        };
+        return siphash( m, 4 );
+    }
+
+    static std::uint64_t load_le( const std::uint8_t *p )
+    {
+        std::uint64_t res = 0;
+        for( int i = 7; i >= 0; --i ) {
+            res = ( res << 8 ) | p[i];
+        }
+        return res;
+    }
+
+    static void store_le( std::uint8_t *p, std::uint64_t val )
+    {
+        for( int i = 0; i < 8; ++i ) {
+            p[i] = static_cast<std::uint8_t>(val >> ( i * 8 ));
+        }
+    }
+
+public:
+
+    enum {
+        magic_size   = 4,
+        message_size = magic_size + 8
+    };
+
+    static const std::uint8_t *magic( )
+    {
+        static const std::uint8_t m[magic_size] = { 0xC0, 0x0C, 0x1E, 0x01 };
+        return m;
+    }
+
+    /// epoch_len in microseconds; a cookie lives between one and two epochs
+    explicit cookie_jar( std::uint64_t epoch_len = 10000000 )
+        :epoch_len_(epoch_len)
+    {
+        std::random_device rd;
+        k0_ = ( std::uint64_t(rd( )) << 32 ) | rd( );
+        k1_ = ( std::uint64_t(rd( )) << 32 ) | rd( );
+    }
+
+    static bool is_cookie( const std::uint8_t *data, std::size_t len )
+    {
+        return ( len >= message_size )
+            && ( std::memcmp( data, magic( ), magic_size ) == 0 );
+    }
+
+    /// writes message_size bytes to out
+    void make( const boost::asio::ip::udp::endpoint &from, std::uint64_t now,
+               std::uint8_t *out ) const
+    {
+        std::memcpy( out, magic( ), magic_size );
+        store_le( out + magic_size,
+                  compute( endpoint_key::from( from ), now / epoch_len_ ) );
+    }
+
+    /// data has to start with a cookie message (see is_cookie)
+    bool check( const boost::asio::ip::udp::endpoint &from, std::uint64_t now,
+                const std::uint8_t *data ) const
+    {
+        const std::uint64_t value = load_le( data + magic_size );
+        const endpoint_key  key   = endpoint_key::from( from );
+        const std::uint64_t epoch = now / epoch_len_;
+        return ( compute( key, epoch ) == value )
+            || ( epoch && ( compute( key, epoch - 1 ) == value ) );
+    }
+};
+
+#endif // UDP_COOKIE_HPP
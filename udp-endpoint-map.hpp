@@ -0,0 +1,243 @@
+#ifndef UDP_ENDPOINT_MAP_HPP
+#define UDP_ENDPOINT_MAP_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "boost/asio.hpp"
+
+/// compact (address, port) key built straight from the endpoint's sockaddr
+struct endpoint_key {
+
+    std::uint64_t hi;
+    std::uint64_t lo;
+    std::uint32_t port_family;
+    std::uint32_t scope;
+
+    static endpoint_key from( const boost::asio::ip::udp::endpoint &ep )
+    {
+        endpoint_key k;
+        const sockaddr *sa = reinterpret_cast<const sockaddr *>(ep.data( ));
+        if( sa->sa_family == AF_INET ) {
+            const sockaddr_in *in = reinterpret_cast<const sockaddr_in *>(sa);
+            k.hi          = 0;
+            k.lo          = in->sin_addr.s_addr;
+            k.port_family = ( std::uint32_t(in->sin_port) << 16 ) | 4;
+            k.scope       = 0;
+        } else {
+            const sockaddr_in6 *in6 =
+                    reinterpret_cast<const sockaddr_in6 *>(sa);
+            std::memcpy( &k.hi, &in6->sin6_addr.s6_addr[0], 8 );
+            std::memcpy( &k.lo, &in6->sin6_addr.s6_addr[8], 8 );
+            k.port_family = ( std::uint32_t(in6->sin6_port) << 16 ) | 6;
+            k.scope       = in6->sin6_scope_id;
+        }
+        return k;
+    }
+
+    static std::uint64_t mix( std::uint64_t h )
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    std::uint64_t hash( ) const
+    {
+        std::uint64_t tail = ( std::uint64_t(port_family) << 32 ) | scope;
+        return mix( hi ^ mix( lo ^ mix( tail ) ) );
+    }
+
+    bool operator == ( const endpoint_key &other ) const
+    {
+        return ( lo == other.lo )
+            && ( port_family == other.port_family )
+            && ( hi == other.hi )
+            && ( scope == other.scope );
+    }
+};
+
+/// open addressing (robin hood) table keyed on endpoint_key;
+/// erase shifts the following cluster back, so there are no tombstones
+template <typename T>
+class endpoint_map {
+
+    struct slot {
+        std::uint32_t   dist;  /// probe distance + 1; 0 is an empty slot
+        std::uint32_t   hash;
+        endpoint_key    key;
+        T               value;
+
+        slot( )
+            :dist(0)
+            ,hash(0)
+        { }
+    };
+
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
+    std::vector<slot>   slots_;
+    std::size_t         mask_;
+    std::size_t         size_;
+
+    static std::size_t round_up( std::size_t value )
+    {
+        std::size_t res = 16;
+        while( res < value ) {
+            res <<= 1;
+        }
+        return res;
+    }
+
+    std::size_t find_index( const endpoint_key &key,
+                            std::uint32_t hash ) const
+    {
+        std::size_t idx = hash & mask_;
+        for( std::uint32_t dist = 1; ; ++dist ) {
+            const slot &s( slots_[idx] );
+            if( s.dist < dist ) {
+                return npos;
+            }
+            if( ( s.hash == hash ) && ( s.key == key ) ) {
+                return idx;
+            }
+            idx = ( idx + 1 ) & mask_;
+        }
+    }
+
+    /// key must not be in the table
+    void insert_new( slot cur )
+    {
+        std::size_t idx = cur.hash & mask_;
+        cur.dist = 1;
+        while( true ) {
+            slot &s( slots_[idx] );
+            if( 0 == s.dist ) {
+                s = std::move( cur );
+                ++size_;
+                return;
+            }
+            if( s.dist < cur.dist ) {
+                std::swap( s, cur );
+            }
+            ++cur.dist;
+            idx = ( idx + 1 ) & mask_;
+        }
+    }
+
+    void rehash( std::size_t count )
+    {
+        std::vector<slot> old( count );
+        old.swap( slots_ );
+        mask_ = count - 1;
+        size_ = 0;
+        for( auto &s: old ) {
+            if( s.dist ) {
+                insert_new( std::move( s ) );
+            }
+        }
+    }
+
+    void erase_index( std::size_t idx )
+    {
+        while( true ) {
+            std::size_t next = ( idx + 1 ) & mask_;
+            if( slots_[next].dist <= 1 ) {
+                break;
+            }
+            slots_[idx] = std::move( slots_[next] );
+            --slots_[idx].dist;
+            idx = next;
+        }
+        slots_[idx].dist  = 0;
+        slots_[idx].value = T( );
+        --size_;
+    }
+
+public:
+
+    explicit endpoint_map( std::size_t reserve = 16 )
+        :slots_(round_up(reserve + reserve / 4))
+        ,mask_(slots_.size( ) - 1)
+        ,size_(0)
+    { }
+
+    std::size_t size( ) const
+    {
+        return size_;
+    }
+
+    bool empty( ) const
+    {
+        return 0 == size_;
+    }
+
+    void clear( )
+    {
+        for( auto &s: slots_ ) {
+            s = slot( );
+        }
+        size_ = 0;
+    }
+
+    T *find( const endpoint_key &key )
+    {
+        std::size_t idx = find_index( key, std::uint32_t(key.hash( )) );
+        return ( idx == npos ) ? nullptr : &slots_[idx].value;
+    }
+
+    T *find( const boost::asio::ip::udp::endpoint &ep )
+    {
+        return find( endpoint_key::from( ep ) );
+    }
+
+    /// inserts or replaces the value
+    void insert( const boost::asio::ip::udp::endpoint &ep, T value )
+    {
+        slot s;
+        s.key  = endpoint_key::from( ep );
+        s.hash = std::uint32_t(s.key.hash( ));
+
+        std::size_t idx = find_index( s.key, s.hash );
+        if( idx != npos ) {
+            slots_[idx].value = std::move( value );
+            return;
+        }
+
+        /// keep the load factor under 7/8
+        if( ( size_ + 1 ) * 8 > slots_.size( ) * 7 ) {
+            rehash( slots_.size( ) * 2 );
+        }
+
+        s.value = std::move( value );
+        insert_new( std::move( s ) );
+    }
+
+    bool erase( const boost::asio::ip::udp::endpoint &ep )
+    {
+        endpoint_key key(endpoint_key::from( ep ));
+        std::size_t idx = find_index( key, std::uint32_t(key.hash( )) );
+        if( idx == npos ) {
+            return false;
+        }
+        erase_index( idx );
+        return true;
+    }
+
+    template <typename Func>
+    void for_each( Func call )
+    {
+        for( auto &s: slots_ ) {
+            if( s.dist ) {
+                call( s.key, s.value );
+            }
+        }
+    }
+};
+
+#endif // UDP_ENDPOINT_MAP_HPP
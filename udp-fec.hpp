@@ -0,0 +1,517 @@
+#ifndef UDP_FEC_HPP
+#define UDP_FEC_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "udp-bits.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/// forward error correction with XOR parity.
+/// Every group of k datagrams gets m parity datagrams; parity j covers the
+/// data with index % m == j, so any loss of at most one per stripe (e.g. a
+/// burst of up to m) is rebuilt without a round trip. Redundancy is m / k.
+///
+/// wire format (little endian):
+///     magic:3, version:1, type:1, group:4, index:1, k:1, m:1, length:2,
+///     payload
+/// data:   type 0x45, length of the payload, k as configured
+/// parity: type 0x50, xor of the members' lengths, k as sent (a flushed
+///         group is shorter), payload = xor of the members padded with 0
+/// Anything without the magic and version is not FEC and passes through
+
+namespace fec_detail {
+
+    enum {
+        magic_size  = 3,
+        version     = 1,
+        data_type   = 0x45,
+        parity_type = 0x50,
+        header_size = 14,
+        max_group   = 64
+    };
+
+    inline const std::uint8_t *magic( )
+    {
+        static const std::uint8_t m[magic_size] = { 0xFE, 0xC0, 0xA5 };
+        return m;
+    }
+
+    using xor_func = void (*)( std::uint8_t *, const std::uint8_t *,
+                               std::size_t );
+
+    /// the n low bits; a group of max_group has all 64 of them
+    inline std::uint64_t low_bits( unsigned n )
+    {
+        return ( n >= 64 ) ? ~std::uint64_t(0)
+                           : ( std::uint64_t(1) << n ) - 1;
+    }
+
+    /// dst ^= src
+    inline void xor_scalar( std::uint8_t *dst, const std::uint8_t *src,
+                            std::size_t len )
+    {
+        std::size_t i = 0;
+        for( ; i + 8 <= len; i += 8 ) {
+            std::uint64_t a;
+            std::uint64_t b;
+            std::memcpy( &a, dst + i, 8 );
+            std::memcpy( &b, src + i, 8 );
+            a ^= b;
+            std::memcpy( dst + i, &a, 8 );
+        }
+        for( ; i < len; ++i ) {
+            dst[i] ^= src[i];
+        }
+    }
+
+#if defined(__SSE2__)
+    inline void xor_sse2( std::uint8_t *dst, const std::uint8_t *src,
+                          std::size_t len )
+    {
+        std::size_t i = 0;
+        for( ; i + 16 <= len; i += 16 ) {
+            __m128i a = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i *>(dst + i) );
+            __m128i b = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i *>(src + i) );
+            _mm_storeu_si128( reinterpret_cast<__m128i *>(dst + i),
+                              _mm_xor_si128( a, b ) );
+        }
+        xor_scalar( dst + i, src + i, len - i );
+    }
+#define UDP_FEC_HAS_SSE2 1
+#endif
+
+#if ( defined(__GNUC__) || defined(__clang__) ) \
+ && ( defined(__x86_64__) || defined(__i386__) )
+    /// built for AVX2 whatever the -m flags; called only if the cpu has it
+    __attribute__((target("avx2")))
+    inline void xor_avx2( std::uint8_t *dst, const std::uint8_t *src,
+                          std::size_t len )
+    {
+        std::size_t i = 0;
+        for( ; i + 32 <= len; i += 32 ) {
+            __m256i a = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i *>(dst + i) );
+            __m256i b = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i *>(src + i) );
+            _mm256_storeu_si256( reinterpret_cast<__m256i *>(dst + i),
+                                 _mm256_xor_si256( a, b ) );
+        }
+        for( ; i + 8 <= len; i += 8 ) {
+            std::uint64_t a;
+            std::uint64_t b;
+            std::memcpy( &a, dst + i, 8 );
+            std::memcpy( &b, src + i, 8 );
+            a ^= b;
+            std::memcpy( dst + i, &a, 8 );
+        }
+        for( ; i < len; ++i ) {
+            dst[i] ^= src[i];
+        }
+    }
+
+    inline bool has_avx2( )
+    {
+        __builtin_cpu_init( );
+        return __builtin_cpu_supports( "avx2" );
+    }
+#define UDP_FEC_HAS_AVX2 1
+#endif
+
+    struct xor_kernel {
+        const char *name;
+        xor_func    func;
+    };
+
+    /// the kernels this cpu can run, best last
+    inline std::vector<xor_kernel> xor_kernels( )
+    {
+        std::vector<xor_kernel> res;
+        res.push_back( xor_kernel { "scalar", &xor_scalar } );
+#if defined(UDP_FEC_HAS_SSE2)
+        res.push_back( xor_kernel { "sse2", &xor_sse2 } );
+#endif
+#if defined(UDP_FEC_HAS_AVX2)
+        if( has_avx2( ) ) {
+            res.push_back( xor_kernel { "avx2", &xor_avx2 } );
+        }
+#endif
+        return res;
+    }
+
+    /// picked once, on first use
+    inline const xor_kernel &best_xor( )
+    {
+        static const xor_kernel best = xor_kernels( ).back( );
+        return best;
+    }
+
+    inline void put16( std::uint8_t *p, std::uint16_t v )
+    {
+        p[0] = static_cast<std::uint8_t>(v);
+        p[1] = static_cast<std::uint8_t>(v >> 8);
+    }
+
+    inline std::uint16_t get16( const std::uint8_t *p )
+    {
+        return static_cast<std::uint16_t>(p[0] | ( p[1] << 8 ));
+    }
+
+    inline void put32( std::uint8_t *p, std::uint32_t v )
+    {
+        put16( p, static_cast<std::uint16_t>(v) );
+        put16( p + 2, static_cast<std::uint16_t>(v >> 16) );
+    }
+
+    inline std::uint32_t get32( const std::uint8_t *p )
+    {
+        return std::uint32_t(get16( p ))
+             | ( std::uint32_t(get16( p + 2 )) << 16 );
+    }
+}
+
+/// adds the FEC header to outgoing datagrams and emits the parity after
+/// every k of them. A group is only protected once its parity is out:
+/// call flush( ) when the stream goes idle.
+class fec_encoder {
+
+public:
+
+    using output_type = std::function<void (const std::uint8_t *,
+                                            std::size_t)>;
+
+private:
+
+    output_type                 output_;
+    unsigned                    k_;
+    unsigned                    m_;
+    std::size_t                 max_payload_;
+    fec_detail::xor_func        xor_;
+    std::uint32_t               group_ = 0;
+    unsigned                    count_ = 0;
+    std::vector<std::uint8_t>   packet_;
+    std::vector<std::uint8_t>   parity_;    /// m packets
+    std::vector<std::size_t>    used_;      /// payload bytes per parity
+
+    std::uint8_t *parity( unsigned j )
+    {
+        return &parity_[j * ( fec_detail::header_size + max_payload_ )];
+    }
+
+    static void header( std::uint8_t *p, std::uint8_t type,
+                        std::uint32_t group, unsigned index,
+                        unsigned k, unsigned m )
+    {
+        std::memcpy( p, fec_detail::magic( ), fec_detail::magic_size );
+        p[3] = fec_detail::version;
+        p[4] = type;
+        fec_detail::put32( p + 5, group );
+        p[9]  = static_cast<std::uint8_t>(index);
+        p[10] = static_cast<std::uint8_t>(k);
+        p[11] = static_cast<std::uint8_t>(m);
+    }
+
+public:
+
+    /// 1 <= m <= k <= 64
+    fec_encoder( output_type output, unsigned k, unsigned m,
+                 std::size_t max_payload = 1400 )
+        :output_(std::move(output))
+        ,k_(std::min<unsigned>( std::max( k, 1u ), fec_detail::max_group ))
+        ,m_(std::min( std::max( m, 1u ), k_ ))
+        ,max_payload_(std::min<std::size_t>( max_payload, 0xFFFF ))
+        ,xor_(fec_detail::best_xor( ).func)
+        ,packet_(fec_detail::header_size + max_payload_)
+        ,parity_(( fec_detail::header_size + max_payload_ ) * m_, 0)
+        ,used_(m_, 0)
+    { }
+
+    /// false if len > max_payload
+    bool send( const std::uint8_t *data, std::size_t len )
+    {
+        using namespace fec_detail;
+        if( len > max_payload_ ) {
+            return false;
+        }
+        header( &packet_[0], data_type, group_, count_, k_, m_ );
+        put16( &packet_[12], static_cast<std::uint16_t>(len) );
+        std::memcpy( &packet_[header_size], data, len );
+        output_( &packet_[0], header_size + len );
+
+        const unsigned j = count_ % m_;
+        std::uint8_t *p  = parity( j );
+        xor_( p + header_size, data, len );
+        put16( p + 12, get16( p + 12 ) ^ static_cast<std::uint16_t>(len) );
+        used_[j] = std::max( used_[j], len );
+
+        if( ++count_ == k_ ) {
+            flush( );
+        }
+        return true;
+    }
+
+    /// sends the parity of a partial group
+    void flush( )
+    {
+        using namespace fec_detail;
+        if( !count_ ) {
+            return;
+        }
+        const unsigned parities = std::min( count_, m_ );
+        for( unsigned j = 0; j < parities; ++j ) {
+            std::uint8_t *p = parity( j );
+            header( p, parity_type, group_, j, count_, m_ );
+            output_( p, header_size + used_[j] );
+        }
+        for( unsigned j = 0; j < m_; ++j ) {
+            std::memset( parity( j ) + 12, 0, 2 + used_[j] );
+            used_[j] = 0;
+        }
+        count_ = 0;
+        ++group_;
+    }
+
+    unsigned k( ) const
+    {
+        return k_;
+    }
+
+    unsigned m( ) const
+    {
+        return m_;
+    }
+
+    std::size_t max_payload( ) const
+    {
+        return max_payload_;
+    }
+};
+
+/// delivers data datagrams as they come and rebuilds lost ones from the
+/// parity; rebuilt datagrams are late and flagged so.
+/// The last window groups are kept; anything older is dropped.
+class fec_decoder {
+
+public:
+
+    using message_type = std::function<void (std::uint8_t *, std::size_t,
+                                             bool /*recovered*/)>;
+
+    struct statistics {
+        std::uint64_t data          = 0;
+        std::uint64_t parity        = 0;
+        std::uint64_t recovered     = 0;
+        std::uint64_t lost          = 0;    /// gone with their group
+        std::uint64_t duplicates    = 0;
+        std::uint64_t stale         = 0;    /// older than the window
+        std::uint64_t malformed     = 0;
+    };
+
+private:
+
+    struct group {
+        bool            used    = false;
+        std::uint32_t   id      = 0;
+        unsigned        k       = 0;
+        unsigned        m       = 0;
+        bool            exact   = false;    /// k comes from a parity
+        std::uint64_t   have    = 0;        /// data by index
+        std::uint64_t   parity  = 0;        /// parity by index
+        std::uint64_t   done    = 0;        /// stripes with nothing missing
+        std::vector<std::uint16_t>  lens;   /// k data + m parity
+        std::vector<std::uint8_t>   store;  /// (k + m) * max_payload
+    };
+
+    message_type            on_message_;
+    std::size_t             max_payload_;
+    fec_detail::xor_func    xor_;
+    std::vector<group>      groups_;
+    std::vector<std::uint8_t> scratch_;
+    statistics              stats_;
+
+    std::uint8_t *slot( group &g, unsigned id )
+    {
+        return &g.store[id * max_payload_];
+    }
+
+    void retire( group &g )
+    {
+        if( g.used ) {
+            stats_.lost += udp_bits::popcount64(
+                                fec_detail::low_bits( g.k ) & ~g.have );
+        }
+        g.used = false;
+    }
+
+    group *find( std::uint32_t id, unsigned k, unsigned m )
+    {
+        group &g( groups_[id % groups_.size( )] );
+        if( g.used && ( g.id == id ) ) {
+            return &g;
+        }
+        if( g.used && ( std::int32_t(id - g.id) < 0 ) ) {
+            ++stats_.stale;
+            return nullptr;
+        }
+        retire( g );
+        g.used   = true;
+        g.id     = id;
+        g.k      = k;
+        g.m      = m;
+        g.exact  = false;
+        g.have   = 0;
+        g.parity = 0;
+        g.done   = 0;
+        g.lens.assign( k + m, 0 );
+        g.store.resize( ( k + m ) * max_payload_ );
+        return &g;
+    }
+
+    /// rebuilds the one missing member of stripe j, if that is the case
+    void repair( group &g, unsigned j )
+    {
+        const std::uint64_t bit = std::uint64_t(1) << j;
+        if( !( g.parity & bit ) || ( g.done & bit ) ) {
+            return;
+        }
+        unsigned missing = g.k;
+        for( unsigned i = j; i < g.k; i += g.m ) {
+            if( !( g.have & ( std::uint64_t(1) << i ) ) ) {
+                if( missing != g.k ) {
+                    return; /// two or more
+                }
+                missing = i;
+            }
+        }
+        g.done |= bit;
+        if( missing == g.k ) {
+            return;
+        }
+
+        const std::size_t plen = g.lens[g.k + j];
+        std::uint16_t len      = fec_detail::get16( slot( g, g.k + j ) );
+        std::uint8_t *out      = slot( g, missing );
+        std::memcpy( out, slot( g, g.k + j ) + 2, plen );
+        for( unsigned i = j; i < g.k; i += g.m ) {
+            if( i != missing ) {
+                xor_( out, slot( g, i ), g.lens[i] );
+                len ^= g.lens[i];
+            }
+        }
+        if( len > plen ) {
+            ++stats_.malformed;
+            return;
+        }
+        g.have |= std::uint64_t(1) << missing;
+        g.lens[missing] = len;
+        ++stats_.recovered;
+        on_message_( out, len, true );
+    }
+
+public:
+
+    fec_decoder( message_type on_message, std::size_t max_payload = 1400,
+                 std::size_t window = 32 )
+        :on_message_(std::move(on_message))
+        ,max_payload_(std::min<std::size_t>( max_payload, 0xFFFF ) + 2)
+        ,xor_(fec_detail::best_xor( ).func)
+        ,groups_(window ? window : 1)
+    { }
+
+    static bool is_fec( const std::uint8_t *data, std::size_t len )
+    {
+        using namespace fec_detail;
+        return ( len >= header_size )
+            && ( std::memcmp( data, magic( ), magic_size ) == 0 )
+            && ( data[3] == version )
+            && ( ( data[4] == data_type ) || ( data[4] == parity_type ) );
+    }
+
+    /// data datagrams are delivered from data; false if not FEC
+    bool on_packet( std::uint8_t *data, std::size_t len )
+    {
+        using namespace fec_detail;
+        if( !is_fec( data, len ) ) {
+            return false;
+        }
+        const bool          is_data = ( data[4] == data_type );
+        const std::uint32_t id      = get32( data + 5 );
+        const unsigned      index   = data[9];
+        const unsigned      k       = data[10];
+        const unsigned      m       = data[11];
+        const std::uint16_t length  = get16( data + 12 );
+        const std::size_t   payload = len - header_size;
+
+        if( !k || !m || ( k > max_group ) || ( is_data && ( m > k ) )
+         || ( index >= ( is_data ? k : std::min( k, m ) ) )
+         || ( payload + 2 > max_payload_ )
+         || ( is_data && ( length != payload ) ) )
+        {
+            ++stats_.malformed;
+            return true;
+        }
+
+        group *g = find( id, k, m );
+        if( !g ) {
+            return true;
+        }
+        if( ( m != g->m ) || ( !is_data && ( k > g->k ) )
+         || ( index >= ( is_data ? g->k : g->m ) ) )
+        {
+            ++stats_.malformed;
+            return true;
+        }
+
+        const std::uint64_t bit = std::uint64_t(1) << index;
+        if( is_data ) {
+            if( g->have & bit ) {
+                ++stats_.duplicates;
+                return true;
+            }
+            ++stats_.data;
+            g->have |= bit;
+            g->lens[index] = length;
+            std::memcpy( slot( *g, index ), data + header_size, payload );
+            on_message_( data + header_size, payload, false );
+        } else {
+            if( g->parity & bit ) {
+                ++stats_.duplicates;
+                return true;
+            }
+            ++stats_.parity;
+            if( !g->exact ) {
+                /// a flushed group is shorter than announced
+                g->exact = true;
+                g->k     = k;
+            }
+            g->parity |= bit;
+            g->lens[g->k + index] = static_cast<std::uint16_t>(payload);
+            std::uint8_t *p = slot( *g, g->k + index );
+            put16( p, length );
+            std::memcpy( p + 2, data + header_size, payload );
+        }
+
+        if( g->have & ~low_bits( g->k ) ) {
+            ++stats_.malformed; /// data past a flushed group's end
+            g->have &= low_bits( g->k );
+        }
+        repair( *g, is_data ? index % g->m : index );
+        return true;
+    }
+
+    const statistics &stats( ) const
+    {
+        return stats_;
+    }
+};
+
+#endif // UDP_FEC_HPP
@@ -0,0 +1,484 @@
+#ifndef UDP_FRAGMENT_HPP
+#define UDP_FRAGMENT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "boost/asio.hpp"
+
+#include "udp-buffer-pool.hpp"
+#include "udp-endpoint-map.hpp"
+#include "udp-wrapper.hpp"
+
+/// messages larger than a datagram go out as fragments:
+///     0x46, message id:4, index:2, count:2, payload   (little endian)
+/// every fragment but the last carries the same payload size.
+
+namespace fragment_detail {
+
+    enum {
+        fragment_type   = 0x46,
+        header_size     = 9,
+        max_fragments   = 65535
+    };
+
+    inline void put16( std::uint8_t *p, std::uint16_t v )
+    {
+        p[0] = static_cast<std::uint8_t>(v);
+        p[1] = static_cast<std::uint8_t>(v >> 8);
+    }
+
+    inline void put32( std::uint8_t *p, std::uint32_t v )
+    {
+        put16( p, static_cast<std::uint16_t>(v) );
+        put16( p + 2, static_cast<std::uint16_t>(v >> 16) );
+    }
+
+    inline std::uint16_t get16( const std::uint8_t *p )
+    {
+        return static_cast<std::uint16_t>(p[0] | ( p[1] << 8 ));
+    }
+
+    inline std::uint32_t get32( const std::uint8_t *p )
+    {
+        return std::uint32_t(get16( p ))
+             | ( std::uint32_t(get16( p + 2 )) << 16 );
+    }
+}
+
+/// a reassembled message: the payloads in order, left in the buffers
+/// they were received in
+class buffer_chain {
+
+public:
+
+    struct piece {
+        buffer_handle        buffer;
+        const std::uint8_t  *data;
+        std::size_t          length;
+    };
+
+private:
+
+    std::vector<piece>  pieces_;
+    std::size_t         size_;
+
+public:
+
+    buffer_chain( )
+        :size_(0)
+    { }
+
+    void push_back( piece p )
+    {
+        size_ += p.length;
+        pieces_.push_back( std::move(p) );
+    }
+
+    void clear( )
+    {
+        pieces_.clear( );
+        size_ = 0;
+    }
+
+    /// total payload bytes
+    std::size_t size( ) const
+    {
+        return size_;
+    }
+
+    std::vector<piece>::const_iterator begin( ) const
+    {
+        return pieces_.begin( );
+    }
+
+    std::vector<piece>::const_iterator end( ) const
+    {
+        return pieces_.end( );
+    }
+
+    /// a ConstBufferSequence for asio calls
+    std::vector<boost::asio::const_buffer> buffers( ) const
+    {
+        std::vector<boost::asio::const_buffer> res;
+        res.reserve( pieces_.size( ) );
+        for( auto &p: pieces_ ) {
+            res.emplace_back( p.data, p.length );
+        }
+        return res;
+    }
+
+    /// out must hold size( ) bytes
+    void copy_to( void *out ) const
+    {
+        std::uint8_t *ptr = static_cast<std::uint8_t *>(out);
+        for( auto &p: pieces_ ) {
+            std::memcpy( ptr, p.data, p.length );
+            ptr += p.length;
+        }
+    }
+};
+
+/// splits messages into fragments of at most mtu bytes.
+/// Fragments come from an own buffer_pool; use one fragmenter per thread
+class fragmenter {
+
+    buffer_pool     pool_;
+    std::size_t     mtu_;
+    std::uint32_t   next_id_;
+
+public:
+
+    explicit fragmenter( std::size_t mtu = 1200 )
+        :pool_(mtu)
+        ,mtu_(mtu)
+        ,next_id_(1)
+    { }
+
+    std::size_t mtu( ) const
+    {
+        return mtu_;
+    }
+
+    /// payload bytes per fragment
+    std::size_t payload( ) const
+    {
+        return mtu_ - fragment_detail::header_size;
+    }
+
+    std::size_t max_message( ) const
+    {
+        return payload( ) * fragment_detail::max_fragments;
+    }
+
+    /// calls out( const buffer_handle & ) for every fragment in order;
+    /// false if the message is larger than max_message( )
+    template <typename Out>
+    bool split( const void *data, std::size_t len, Out out )
+    {
+        using namespace fragment_detail;
+        if( len > max_message( ) ) {
+            return false;
+        }
+        const std::size_t step  = payload( );
+        const std::size_t count = len ? ( len + step - 1 ) / step : 1;
+        const std::uint32_t id  = next_id_++;
+        const std::uint8_t *src = static_cast<const std::uint8_t *>(data);
+
+        for( std::size_t i = 0; i < count; ++i ) {
+            const std::size_t part = std::min( step, len - i * step );
+            buffer_handle buf( pool_.get( ) );
+            std::uint8_t *ptr = buf.data( );
+            ptr[0] = fragment_type;
+            put32( ptr + 1, id );
+            put16( ptr + 5, static_cast<std::uint16_t>(i) );
+            put16( ptr + 7, static_cast<std::uint16_t>(count) );
+            if( part ) {
+                std::memcpy( ptr + header_size, src + i * step, part );
+            }
+            buf.resize( header_size + part );
+            out( buf );
+        }
+        return true;
+    }
+
+    /// queues the fragments on the endpoint without copying them again
+    bool send( udp_endpoint &ep, const void *data, std::size_t len,
+               const boost::asio::ip::udp::endpoint &to )
+    {
+        return split( data, len, [&ep, &to]( const buffer_handle &buf ) {
+            ep.queue_write_to( buf, to );
+        } );
+    }
+};
+
+/// puts fragments back together. In-progress messages are keyed by
+/// source and id; there are at most max_messages of them, holding at
+/// most max_bytes of buffers (the oldest goes first), and a message
+/// not completed within timeout microseconds is dropped.
+/// Fragments that come with their read buffer are kept in it;
+/// others are copied to an own pool. Use on one thread.
+class reassembler {
+
+public:
+
+    using message_type = std::function<void (
+                                const boost::asio::ip::udp::endpoint &,
+                                buffer_chain &)>;
+
+    struct statistics {
+        std::uint64_t completed     = 0;
+        std::uint64_t expired       = 0;
+        std::uint64_t evicted       = 0;    /// made room for a newer one
+        std::uint64_t rejected      = 0;    /// malformed or too large
+        std::uint64_t duplicates    = 0;
+        std::uint64_t copied        = 0;    /// fragments without a buffer
+    };
+
+private:
+
+    struct partial {
+        bool                            used    = false;
+        endpoint_key                    key;
+        boost::asio::ip::udp::endpoint  from;
+        std::uint32_t                   id      = 0;
+        std::uint32_t                   count   = 0;
+        std::uint32_t                   have    = 0;
+        std::uint64_t                   started = 0;
+        std::size_t                     bytes   = 0;
+        std::vector<std::uint64_t>      bits;
+        std::vector<buffer_chain::piece> pieces;
+    };
+
+    message_type            on_message_;
+    std::vector<partial>    slots_;
+    std::size_t             max_bytes_;
+    std::size_t             held_;
+    std::uint64_t           timeout_;
+    std::uint64_t           last_expire_;
+    buffer_pool             copies_;
+    buffer_chain            chain_;
+    statistics              stats_;
+
+    void drop( partial &p )
+    {
+        held_ -= p.bytes;
+        p.used  = false;
+        p.bytes = 0;
+        for( auto &piece: p.pieces ) {
+            piece.buffer.reset( );
+        }
+    }
+
+    partial *oldest( )
+    {
+        partial *res = nullptr;
+        for( auto &p: slots_ ) {
+            if( p.used && ( !res || p.started < res->started ) ) {
+                res = &p;
+            }
+        }
+        return res;
+    }
+
+    partial *find( const endpoint_key &key, std::uint32_t id )
+    {
+        for( auto &p: slots_ ) {
+            if( p.used && ( p.id == id ) && ( p.key == key ) ) {
+                return &p;
+            }
+        }
+        return nullptr;
+    }
+
+    partial *start( const endpoint_key &key,
+                    const boost::asio::ip::udp::endpoint &from,
+                    std::uint32_t id, std::uint32_t count,
+                    std::uint64_t now )
+    {
+        partial *res = nullptr;
+        for( auto &p: slots_ ) {
+            if( !p.used ) {
+                res = &p;
+                break;
+            }
+        }
+        if( !res ) {
+            res = oldest( );
+            drop( *res );
+            ++stats_.evicted;
+        }
+        res->used    = true;
+        res->key     = key;
+        res->from    = from;
+        res->id      = id;
+        res->count   = count;
+        res->have    = 0;
+        res->started = now;
+        res->bits.assign( ( count + 63 ) / 64, 0 );
+        res->pieces.resize( count );
+        return res;
+    }
+
+    /// frees the oldest messages until bytes fit; false if they can't
+    bool make_room( std::size_t bytes, const partial *keep )
+    {
+        while( held_ + bytes > max_bytes_ ) {
+            partial *victim = nullptr;
+            for( auto &p: slots_ ) {
+                if( p.used && ( &p != keep )
+                 && ( !victim || p.started < victim->started ) )
+                {
+                    victim = &p;
+                }
+            }
+            if( !victim ) {
+                return false;
+            }
+            drop( *victim );
+            ++stats_.evicted;
+        }
+        return true;
+    }
+
+    void complete( partial &p )
+    {
+        chain_.clear( );
+        for( auto &piece: p.pieces ) {
+            chain_.push_back( std::move(piece) );
+        }
+        held_ -= p.bytes;
+        p.used  = false;
+        p.bytes = 0;
+        ++stats_.completed;
+        on_message_( p.from, chain_ );
+        chain_.clear( );
+    }
+
+    bool fragment( const boost::asio::ip::udp::endpoint &from,
+                   const std::uint8_t *data, std::size_t len,
+                   const buffer_handle *buf, std::uint64_t now )
+    {
+        using namespace fragment_detail;
+        if( !is_fragment( data, len ) ) {
+            return false;
+        }
+        if( now - last_expire_ >= timeout_ / 4 ) {
+            expire( now );
+        }
+
+        const std::uint32_t id    = get32( data + 1 );
+        const std::uint32_t index = get16( data + 5 );
+        const std::uint32_t count = get16( data + 7 );
+        if( !count || ( index >= count ) ) {
+            ++stats_.rejected;
+            return true;
+        }
+
+        buffer_chain::piece piece;
+        piece.length = len - header_size;
+        if( buf && *buf ) {
+            piece.buffer = *buf;
+            piece.data   = data + header_size;
+        } else if( piece.length <= copies_.slab_size( ) ) {
+            piece.buffer = copies_.copy( data + header_size, piece.length );
+            piece.data   = piece.buffer.data( );
+            ++stats_.copied;
+        } else {
+            ++stats_.rejected;
+            return true;
+        }
+
+        if( count == 1 ) {
+            chain_.clear( );
+            chain_.push_back( std::move(piece) );
+            ++stats_.completed;
+            on_message_( from, chain_ );
+            chain_.clear( );
+            return true;
+        }
+
+        const endpoint_key key = endpoint_key::from( from );
+        partial *p = find( key, id );
+        if( p && ( p->count != count ) ) {
+            ++stats_.rejected;
+            return true;
+        }
+
+        const std::size_t bytes = piece.buffer.capacity( );
+        if( !make_room( bytes, p ) ) {
+            ++stats_.rejected; /// one message is larger than max_bytes
+            if( p ) {
+                drop( *p );
+            }
+            return true;
+        }
+        if( !p ) {
+            p = start( key, from, id, count, now );
+        }
+
+        std::uint64_t &word( p->bits[index / 64] );
+        const std::uint64_t bit = std::uint64_t(1) << ( index % 64 );
+        if( word & bit ) {
+            ++stats_.duplicates;
+            return true;
+        }
+        word |= bit;
+        p->pieces[index] = std::move(piece);
+        p->bytes += bytes;
+        held_    += bytes;
+
+        if( ++p->have == p->count ) {
+            complete( *p );
+        }
+        return true;
+    }
+
+public:
+
+    reassembler( message_type on_message,
+                 std::size_t max_messages = 16,
+                 std::size_t max_bytes = 16 << 20,
+                 std::uint64_t timeout = 2000000,
+                 std::size_t max_fragment = 2048 )
+        :on_message_(std::move(on_message))
+        ,slots_(max_messages ? max_messages : 1)
+        ,max_bytes_(max_bytes)
+        ,held_(0)
+        ,timeout_(timeout)
+        ,last_expire_(0)
+        ,copies_(max_fragment)
+    { }
+
+    static bool is_fragment( const std::uint8_t *data, std::size_t len )
+    {
+        return ( len >= fragment_detail::header_size )
+            && ( data[0] == fragment_detail::fragment_type );
+    }
+
+    /// keeps a reference to buf instead of copying (read_batch datagrams);
+    /// false if this is not a fragment
+    bool on_datagram( const boost::asio::ip::udp::endpoint &from,
+                      const std::uint8_t *data, std::size_t len,
+                      const buffer_handle &buf, std::uint64_t now )
+    {
+        return fragment( from, data, len, &buf, now );
+    }
+
+    /// copies the payload; for buffers that are reused after the call
+    bool on_datagram( const boost::asio::ip::udp::endpoint &from,
+                      const std::uint8_t *data, std::size_t len,
+                      std::uint64_t now )
+    {
+        return fragment( from, data, len, nullptr, now );
+    }
+
+    /// drops messages older than the timeout
+    void expire( std::uint64_t now )
+    {
+        last_expire_ = now;
+        for( auto &p: slots_ ) {
+            if( p.used && ( now - p.started >= timeout_ ) ) {
+                drop( p );
+                ++stats_.expired;
+            }
+        }
+    }
+
+    /// bytes of buffers held by incomplete messages
+    std::size_t held( ) const
+    {
+        return held_;
+    }
+
+    const statistics &stats( ) const
+    {
+        return stats_;
+    }
+};
+
+#endif // UDP_FRAGMENT_HPP
@@ -0,0 +1,144 @@
+#ifndef UDP_HANDLER_MEMORY_HPP
+#define UDP_HANDLER_MEMORY_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/// storage for the operation objects asio allocates for one chain of
+/// asynchronous calls; falls back to operator new if all slots are taken.
+///
+/// The slots live in an arena shared with every alloc_handler made from
+/// it: an operation still queued in a stopped io_service holds on to its
+/// memory after the owner of the handler_memory is gone
+class handler_memory {
+
+public:
+
+    class arena {
+
+        enum {
+            slot_size   = 512,
+            slots       = 2
+        };
+
+        typedef std::aligned_storage<slot_size>::type storage_type;
+
+        storage_type        storage_[slots];
+        std::atomic<bool>   in_use_[slots];
+
+    public:
+
+        arena( )
+        {
+            for( auto &u: in_use_ ) {
+                u.store( false, std::memory_order_relaxed );
+            }
+        }
+
+        arena( const arena & ) = delete;
+        arena &operator = ( const arena & ) = delete;
+
+        void *allocate( std::size_t size )
+        {
+            if( size <= slot_size ) {
+                for( std::size_t i = 0; i < slots; ++i ) {
+                    if( !in_use_[i].exchange( true,
+                                              std::memory_order_acquire ) )
+                    {
+                        return &storage_[i];
+                    }
+                }
+            }
+            return ::operator new( size );
+        }
+
+        void deallocate( void *ptr )
+        {
+            for( std::size_t i = 0; i < slots; ++i ) {
+                if( ptr == &storage_[i] ) {
+                    in_use_[i].store( false, std::memory_order_release );
+                    return;
+                }
+            }
+            ::operator delete( ptr );
+        }
+    };
+
+    using arena_ptr = std::shared_ptr<arena>;
+
+private:
+
+    arena_ptr   arena_;
+
+public:
+
+    handler_memory( )
+        :arena_(std::make_shared<arena>( ))
+    { }
+
+    handler_memory( const handler_memory & ) = delete;
+    handler_memory &operator = ( const handler_memory & ) = delete;
+
+    void *allocate( std::size_t size )
+    {
+        return arena_->allocate( size );
+    }
+
+    void deallocate( void *ptr )
+    {
+        arena_->deallocate( ptr );
+    }
+
+    const arena_ptr &get_arena( ) const
+    {
+        return arena_;
+    }
+};
+
+/// wraps a handler so asio takes its memory from a handler_memory;
+/// asio moves the handler out of the operation before it frees the
+/// operation, so the arena outlives every block it hands out
+template <typename Handler>
+class alloc_handler {
+
+    handler_memory::arena_ptr   memory_;
+    Handler                     handler_;
+
+public:
+
+    alloc_handler( handler_memory &mem, Handler h )
+        :memory_(mem.get_arena( ))
+        ,handler_(std::move(h))
+    { }
+
+    template <typename ...Args>
+    void operator ( )( Args && ...args )
+    {
+        handler_( std::forward<Args>(args)... );
+    }
+
+    friend void *asio_handler_allocate( std::size_t size,
+                                        alloc_handler<Handler> *self )
+    {
+        return self->memory_->allocate( size );
+    }
+
+    friend void asio_handler_deallocate( void *ptr, std::size_t,
+                                         alloc_handler<Handler> *self )
+    {
+        self->memory_->deallocate( ptr );
+    }
+};
+
+template <typename Handler>
+inline alloc_handler<Handler> make_alloc_handler( handler_memory &mem,
+                                                  Handler h )
+{
+    return alloc_handler<Handler>( mem, std::move(h) );
+}
+
+#endif // UDP_HANDLER_MEMORY_HPP
@@ -0,0 +1,358 @@
+#ifndef UDP_HISTOGRAM_HPP
+#define UDP_HISTOGRAM_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include "udp-bits.hpp"
+
+/// HDR histogram: a value is kept with `digits` significant decimal
+/// digits over [lowest, highest], in log-linear buckets. Recording is
+/// an index computation and an increment, so a thread keeps its own
+/// histogram and they are add( )ed together when read. Not thread safe
+class hdr_histogram {
+
+    std::int64_t                lowest_;
+    std::int64_t                highest_;
+    int                         digits_;
+
+    int                         unit_magnitude_;
+    int                         sub_bucket_half_magnitude_;
+    std::int64_t                sub_bucket_count_;
+    std::int64_t                sub_bucket_half_;
+    std::int64_t                sub_bucket_mask_;
+    int                         bucket_count_;
+
+    std::vector<std::uint64_t>  counts_;
+    std::uint64_t               total_;
+    std::int64_t                min_;
+    std::int64_t                max_;
+    double                      sum_;
+
+    static int log2_floor( std::uint64_t value )
+    {
+        return 63 - udp_bits::clz64( value | 1 );
+    }
+
+    int bucket_index( std::int64_t value ) const
+    {
+        const int pow2ceiling = 64 - udp_bits::clz64(
+                        static_cast<std::uint64_t>(value | sub_bucket_mask_) );
+        return pow2ceiling - unit_magnitude_
+             - ( sub_bucket_half_magnitude_ + 1 );
+    }
+
+    std::int64_t sub_bucket_index( std::int64_t value, int bucket ) const
+    {
+        return value >> ( bucket + unit_magnitude_ );
+    }
+
+    std::size_t counts_index( std::int64_t value ) const
+    {
+        const int bucket = bucket_index( value );
+        const std::int64_t sub = sub_bucket_index( value, bucket );
+        return static_cast<std::size_t>(
+                    ( std::int64_t(bucket + 1) << sub_bucket_half_magnitude_ )
+                  + ( sub - sub_bucket_half_ ) );
+    }
+
+    std::int64_t value_at_index( std::size_t index ) const
+    {
+        int bucket = static_cast<int>(index >> sub_bucket_half_magnitude_)
+                   - 1;
+        std::int64_t sub = static_cast<std::int64_t>(index)
+                         & ( sub_bucket_half_ - 1 );
+        sub += sub_bucket_half_;
+        if( bucket < 0 ) {
+            sub -= sub_bucket_half_;
+            bucket = 0;
+        }
+        return sub << ( bucket + unit_magnitude_ );
+    }
+
+    std::int64_t equivalent_range( std::int64_t value ) const
+    {
+        const int bucket = bucket_index( value );
+        const std::int64_t sub = sub_bucket_index( value, bucket );
+        const int adjusted = ( sub >= sub_bucket_count_ ) ? bucket + 1
+                                                          : bucket;
+        return std::int64_t(1) << ( unit_magnitude_ + adjusted );
+    }
+
+    std::int64_t lowest_equivalent( std::int64_t value ) const
+    {
+        const int bucket = bucket_index( value );
+        return sub_bucket_index( value, bucket )
+            << ( bucket + unit_magnitude_ );
+    }
+
+public:
+
+    /// lowest >= 1, highest >= 2 * lowest, 1 <= digits <= 5
+    hdr_histogram( std::int64_t lowest, std::int64_t highest,
+                   int digits = 3 )
+        :lowest_(lowest)
+        ,highest_(highest)
+        ,digits_(digits)
+    {
+        if( ( lowest < 1 ) || ( highest < 2 * lowest )
+         || ( digits < 1 ) || ( digits > 5 ) )
+        {
+            throw std::invalid_argument( "hdr_histogram: bad range" );
+        }
+
+        const std::int64_t largest_single_unit =
+                    2 * static_cast<std::int64_t>(std::pow( 10, digits ));
+        const int sub_bucket_count_magnitude =
+                    log2_floor( largest_single_unit - 1 ) + 1;
+
+        unit_magnitude_            = log2_floor( lowest );
+        sub_bucket_half_magnitude_ = ( sub_bucket_count_magnitude > 1 )
+                                   ? sub_bucket_count_magnitude - 1 : 0;
+        sub_bucket_count_          = std::int64_t(1)
+                                  << ( sub_bucket_half_magnitude_ + 1 );
+        sub_bucket_half_           = sub_bucket_count_ / 2;
+        sub_bucket_mask_           = ( sub_bucket_count_ - 1 )
+                                  << unit_magnitude_;
+
+        std::int64_t smallest_untrackable =
+                    sub_bucket_count_ << unit_magnitude_;
+        bucket_count_ = 1;
+        while( smallest_untrackable <= highest ) {
+            if( smallest_untrackable
+              > std::numeric_limits<std::int64_t>::max( ) / 2 )
+            {
+                ++bucket_count_;
+                break;
+            }
+            smallest_untrackable <<= 1;
+            ++bucket_count_;
+        }
+
+        counts_.resize( static_cast<std::size_t>(
+                            ( bucket_count_ + 1 ) * sub_bucket_half_ ) );
+        reset( );
+    }
+
+    void reset( )
+    {
+        std::fill( counts_.begin( ), counts_.end( ), 0 );
+        total_ = 0;
+        min_   = std::numeric_limits<std::int64_t>::max( );
+        max_   = 0;
+        sum_   = 0;
+    }
+
+    /// values outside [lowest, highest] are clamped to it
+    void record( std::int64_t value, std::uint64_t count = 1 )
+    {
+        value = std::min( std::max( value, lowest_ ), highest_ );
+        counts_[counts_index( value )] += count;
+        total_ += count;
+        min_    = std::min( min_, value );
+        max_    = std::max( max_, value );
+        sum_   += static_cast<double>(value) * count;
+    }
+
+    /// the bucket value would be counted in; see atomic_hdr_histogram
+    std::size_t index_of( std::int64_t value ) const
+    {
+        return counts_index( std::min( std::max( value, lowest_ ),
+                                       highest_ ) );
+    }
+
+    std::size_t buckets( ) const
+    {
+        return counts_.size( );
+    }
+
+    /// count values of bucket index; min, max and the sum take the
+    /// bucket's bounds and middle
+    void record_index( std::size_t index, std::uint64_t count )
+    {
+        if( !count ) {
+            return;
+        }
+        const std::int64_t v    = value_at_index( index );
+        const std::int64_t low  = lowest_equivalent( v );
+        const std::int64_t size = equivalent_range( v );
+        counts_[index] += count;
+        total_ += count;
+        min_    = std::min( min_, low );
+        max_    = std::max( max_, low + size - 1 );
+        sum_   += ( low + size / 2 ) * static_cast<double>(count);
+    }
+
+    /// other must have the same lowest, highest and digits
+    void add( const hdr_histogram &other )
+    {
+        if( ( other.lowest_ != lowest_ ) || ( other.highest_ != highest_ )
+         || ( other.digits_ != digits_ ) )
+        {
+            throw std::invalid_argument( "hdr_histogram: other layout" );
+        }
+        for( std::size_t i = 0; i < counts_.size( ); ++i ) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        min_    = std::min( min_, other.min_ );
+        max_    = std::max( max_, other.max_ );
+        sum_   += other.sum_;
+    }
+
+    std::uint64_t count( ) const
+    {
+        return total_;
+    }
+
+    std::int64_t min( ) const
+    {
+        return total_ ? min_ : 0;
+    }
+
+    std::int64_t max( ) const
+    {
+        return max_;
+    }
+
+    double mean( ) const
+    {
+        return total_ ? sum_ / total_ : 0.0;
+    }
+
+    std::int64_t lowest( ) const
+    {
+        return lowest_;
+    }
+
+    std::int64_t highest( ) const
+    {
+        return highest_;
+    }
+
+    /// the largest value equivalent to the one at percentile (0..100)
+    std::int64_t value_at( double percentile ) const
+    {
+        if( !total_ ) {
+            return 0;
+        }
+        percentile = std::min( std::max( percentile, 0.0 ), 100.0 );
+        std::uint64_t want = static_cast<std::uint64_t>(
+                                percentile / 100.0 * total_ + 0.5 );
+        want = std::max<std::uint64_t>( want, 1 );
+        std::uint64_t seen = 0;
+        for( std::size_t i = 0; i < counts_.size( ); ++i ) {
+            seen += counts_[i];
+            if( seen >= want ) {
+                const std::int64_t v = value_at_index( i );
+                return std::min( max_, lowest_equivalent( v )
+                                     + equivalent_range( v ) - 1 );
+            }
+        }
+        return max_;
+    }
+
+    /// calls f( value, count, cumulative ) for every non-empty bucket,
+    /// lowest first; value is the bucket's highest equivalent value
+    /// (at most max( ))
+    template <typename Func>
+    void for_each( Func f ) const
+    {
+        std::uint64_t seen = 0;
+        for( std::size_t i = 0; i < counts_.size( ); ++i ) {
+            if( counts_[i] ) {
+                seen += counts_[i];
+                const std::int64_t v = value_at_index( i );
+                f( std::min( max_, lowest_equivalent( v )
+                                 + equivalent_range( v ) - 1 ),
+                   counts_[i], seen );
+            }
+        }
+    }
+
+    /// the HdrHistogram percentile distribution text (values / scale),
+    /// one line per recorded bucket; plots with the usual tools
+    void print( std::ostream &os, double scale = 1.0 ) const
+    {
+        char line[128];
+        os << "       Value     Percentile TotalCount 1/(1-Percentile)\n\n";
+        for_each( [&]( std::int64_t value, std::uint64_t,
+                       std::uint64_t seen )
+        {
+            const double p = static_cast<double>(seen) / total_;
+            if( seen < total_ ) {
+                std::snprintf( line, sizeof(line),
+                               "%12.3f %14.12f %10llu %14.2f\n",
+                               value / scale, p,
+                               static_cast<unsigned long long>(seen),
+                               1.0 / ( 1.0 - p ) );
+            } else {
+                std::snprintf( line, sizeof(line),
+                               "%12.3f %14.12f %10llu\n",
+                               value / scale, p,
+                               static_cast<unsigned long long>(seen) );
+            }
+            os << line;
+        } );
+        std::snprintf( line, sizeof(line),
+                       "#[Mean    = %12.3f, Max     = %12.3f]\n"
+                       "#[Total count    = %12llu]\n",
+                       mean( ) / scale, max( ) / scale,
+                       static_cast<unsigned long long>(total_) );
+        os << line;
+    }
+};
+
+/// hdr_histogram's layout with atomic buckets: any number of threads
+/// record( ) without a lock (one relaxed fetch_add) while another takes
+/// snapshot( )s. A snapshot is not atomic across buckets
+class atomic_hdr_histogram {
+
+    hdr_histogram                                 layout_;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> counts_;
+
+public:
+
+    atomic_hdr_histogram( std::int64_t lowest, std::int64_t highest,
+                          int digits = 3 )
+        :layout_(lowest, highest, digits)
+        ,counts_(new std::atomic<std::uint64_t>[layout_.buckets( )]( ))
+    { }
+
+    atomic_hdr_histogram( const atomic_hdr_histogram & ) = delete;
+    atomic_hdr_histogram &operator = ( const atomic_hdr_histogram & ) = delete;
+
+    void record( std::int64_t value )
+    {
+        counts_[layout_.index_of( value )].fetch_add( 1,
+                                            std::memory_order_relaxed );
+    }
+
+    hdr_histogram snapshot( ) const
+    {
+        hdr_histogram res( layout_ );
+        for( std::size_t i = 0; i < layout_.buckets( ); ++i ) {
+            res.record_index( i,
+                        counts_[i].load( std::memory_order_relaxed ) );
+        }
+        return res;
+    }
+
+    /// not atomic with concurrent record( )s
+    void reset( )
+    {
+        for( std::size_t i = 0; i < layout_.buckets( ); ++i ) {
+            counts_[i].store( 0, std::memory_order_relaxed );
+        }
+    }
+};
+
+#endif // UDP_HISTOGRAM_HPP
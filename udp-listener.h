@@ -1,23 +1,61 @@
 #ifndef UDP_LISTENER_H
 #define UDP_LISTENER_H
 
+#include <memory>
+#include <thread>
+#include <vector>
+#include <sstream>
+#include <functional>
+
 #include "boost/asio.hpp"
 
+#include "udp-wrapper.hpp"
+#include "udp-runtime.hpp"
+
 namespace test {
 
+    /// N shards bound to the same address with SO_REUSEPORT;
+    /// every shard has its own io_service, thread and endpoint
+    /// (see io_runtime). Shard endpoints are built on their own thread,
+    /// so their memory is local to its cpu when the shards are pinned
     class udp_listener {
 
+    public:
+
+        using endpoint_factory = std::function<
+            std::shared_ptr<udp_endpoint> ( boost::asio::io_service &,
+                                      const boost::asio::ip::udp::endpoint &,
+                                      std::uint32_t /*slaves*/ )
+        >;
+
+    private:
+
         boost::asio::ip::udp::endpoint ep_;
         std::uint32_t slaves_;
+        endpoint_factory factory_;
+
+        /// points_ go before the io_services they use
+        io_runtime runtime_;
+        std::vector<std::shared_ptr<udp_endpoint> > points_;
 
     public:
 
+        /// shard i runs on cpus[i % cpus.size( )]; no cpus, no pinning
         udp_listener( const std::string &addr, std::uint16_t port,
-                      std::uint32_t slaves )
+                      std::uint32_t slaves, std::uint32_t shards,
+                      endpoint_factory factory,
+                      const std::vector<int> &cpus = { } )
             :ep_(boost::asio::ip::address::from_string(addr), port)
             ,slaves_(slaves)
+            ,factory_(std::move(factory))
+            ,runtime_(shards ? shards : 1, cpus, "udp")
         { }
 
+        ~udp_listener( )
+        {
+            stop( );
+        }
+
         std::string name( ) const
         {
             std::ostringstream oss;
@@ -26,19 +64,66 @@ namespace test {
             return oss.str( );
         }
 
-        void start( )
+        std::uint32_t shards( ) const
         {
+            return static_cast<std::uint32_t>(runtime_.size( ));
+        }
 
+        io_runtime &runtime( )
+        {
+            return runtime_;
         }
 
-        void stop ( )
+        /// shard threads spin for spin_usec before they block (see
+        /// busy_poll_runner) and ask for SO_BUSY_POLL on the sockets.
+        /// 0 is the plain run( ). Call before start( )
+        void set_busy_poll( std::uint64_t spin_usec )
         {
+            runtime_.set_busy_poll( spin_usec );
+        }
 
+        void start( )
+        {
+            runtime_.start( );
+            const std::size_t count = runtime_.size( );
+            for( std::size_t i = 0; i < count; ++i ) {
+                points_.push_back( runtime_.run_on( i, [this, i, count]( ) {
+                    auto point = factory_( runtime_.ios( i ), ep_, slaves_ );
+                    point->set_reuse_port( count > 1 );
+                    point->start( );
+                    if( runtime_.cpu( i ) >= 0 ) {
+                        point->set_incoming_cpu( runtime_.cpu( i ) );
+                    }
+                    if( runtime_.busy_poll( ) ) {
+                        /// best effort: raising it may need CAP_NET_ADMIN
+                        point->set_busy_poll(
+                            static_cast<unsigned>(runtime_.busy_poll( )) );
+                    }
+                    return point;
+                } ) );
+            }
+        }
+
+        /// every shard is closed on its own thread first, so its
+        /// aborted operations run there before the io_services stop
+        void stop ( )
+        {
+            for( std::size_t i = 0; i < points_.size( ); ++i ) {
+                if( runtime_.ios( i ).stopped( ) ) {
+                    continue;
+                }
+                auto point = points_[i];
+                runtime_.run_on( i, [point]( ) { point->stop( ); } );
+                /// the aborted completions were queued by the close
+                runtime_.run_on( i, [ ]( ) { } );
+            }
+            runtime_.stop( );
+            points_.clear( );
         }
 
         bool is_active( ) const
         {
-            return false;
+            return !points_.empty( );
         }
 
         bool is_local( ) const
@@ -0,0 +1,476 @@
+#ifndef UDP_METRICS_HPP
+#define UDP_METRICS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "boost/asio.hpp"
+
+#include "udp-histogram.hpp"
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+#include <unistd.h>
+#endif
+
+/// Count counters, each kept in a slot per thread: a slot is padded to
+/// whole cache lines, so threads never write to the same line. add( )
+/// is a relaxed fetch_add on the caller's slot (threads past the slot
+/// count share slots, still correctly); value( ) sums the slots
+template <std::size_t Count>
+class sharded_counters {
+
+    enum { cache_line = 64 };
+
+    struct slot {
+        std::atomic<std::uint64_t> values[Count];
+    };
+
+    static const std::size_t slot_size =
+            ( sizeof(slot) + cache_line - 1 ) / cache_line * cache_line;
+
+    std::size_t                 slots_;
+    std::unique_ptr<char[]>     storage_;
+    char                       *first_;
+
+    slot &at( std::size_t id ) const
+    {
+        return *reinterpret_cast<slot *>(first_ + id * slot_size);
+    }
+
+    static std::size_t thread_id( )
+    {
+        static std::atomic<std::size_t> next(0);
+        static thread_local std::size_t id =
+                    next.fetch_add( 1, std::memory_order_relaxed );
+        return id;
+    }
+
+public:
+
+    explicit sharded_counters( std::size_t slots = 16 )
+        :slots_(slots ? slots : 1)
+        ,storage_(new char[slots_ * slot_size + cache_line])
+    {
+        /// C++11 new does not honour alignas past max_align_t
+        std::uintptr_t p = reinterpret_cast<std::uintptr_t>(storage_.get( ));
+        first_ = storage_.get( )
+               + ( cache_line - p % cache_line ) % cache_line;
+        for( std::size_t i = 0; i < slots_; ++i ) {
+            for( auto &v: ( new (&at( i )) slot )->values ) {
+                v.store( 0, std::memory_order_relaxed );
+            }
+        }
+    }
+
+    sharded_counters( const sharded_counters & ) = delete;
+    sharded_counters &operator = ( const sharded_counters & ) = delete;
+
+    void add( std::size_t counter, std::uint64_t value = 1 )
+    {
+        at( thread_id( ) % slots_ ).values[counter].fetch_add( value,
+                                            std::memory_order_relaxed );
+    }
+
+    std::uint64_t value( std::size_t counter ) const
+    {
+        std::uint64_t res = 0;
+        for( std::size_t i = 0; i < slots_; ++i ) {
+            res += at( i ).values[counter].load( std::memory_order_relaxed );
+        }
+        return res;
+    }
+};
+
+/// what an endpoint counts once set_metrics( ) gives it one of these;
+/// several endpoints may share one (a shard)
+struct endpoint_metrics {
+
+    enum counter {
+        PACKETS_IN = 0,
+        BYTES_IN,
+        PACKETS_OUT,
+        BYTES_OUT,
+        SEND_ERRORS,
+        RECEIVE_ERRORS,
+        TRUNCATED,
+        COUNTER_COUNT
+    };
+
+    struct snapshot_type {
+        std::uint64_t   values[COUNTER_COUNT];
+        hdr_histogram   handler_ns;
+    };
+
+    sharded_counters<COUNTER_COUNT> counters;
+
+    /// time spent in on_read / on_read_batch calls, nanoseconds; only
+    /// one call in timing_mask + 1 is timed (a power of two less one,
+    /// 0 times them all), so the clock is not read per packet
+    atomic_hdr_histogram            handler_ns;
+    std::uint32_t                   timing_mask;
+
+    explicit endpoint_metrics( std::uint32_t timing_mask = 63 )
+        :handler_ns(1, 10000000000LL, 2)
+        ,timing_mask(timing_mask)
+    { }
+
+    void add( counter id, std::uint64_t value = 1 )
+    {
+        counters.add( id, value );
+    }
+
+    std::uint64_t value( counter id ) const
+    {
+        return counters.value( id );
+    }
+
+    snapshot_type snapshot( ) const
+    {
+        snapshot_type res = { { }, handler_ns.snapshot( ) };
+        for( std::size_t i = 0; i < COUNTER_COUNT; ++i ) {
+            res.values[i] = counters.value( i );
+        }
+        return res;
+    }
+};
+
+/// named metrics read on demand; the readers run on the caller's
+/// thread, so whatever they read has to outlive the registry or be
+/// remove( )d first. Safe to add to and read from any thread
+class metrics_registry {
+
+public:
+
+    enum kind { COUNTER, GAUGE, SUMMARY };
+
+    using reader           = std::function<double ( )>;
+    using histogram_reader = std::function<hdr_histogram ( )>;
+
+    struct sample {
+        std::string     name;   /// with _sum / _count for summaries
+        std::string     labels; /// name="value",...
+        double          value;
+    };
+
+    struct family {
+        std::string         name;
+        std::string         help;
+        kind                type;
+        std::vector<sample> samples;
+    };
+
+private:
+
+    struct source {
+        std::string         owner;
+        std::string         labels;
+        reader              read;
+        histogram_reader    read_histogram;
+        double              scale;
+    };
+
+    struct family_info {
+        std::string         help;
+        kind                type;
+        std::vector<source> sources;
+    };
+
+    mutable std::mutex                  lock_;
+    std::vector<std::string>            order_;
+    std::map<std::string, family_info>  families_;
+
+    family_info &get_family( const std::string &name,
+                             const std::string &help, kind type )
+    {
+        auto f = families_.find( name );
+        if( f == families_.end( ) ) {
+            order_.push_back( name );
+            family_info &res( families_[name] );
+            res.help = help;
+            res.type = type;
+            return res;
+        }
+        return f->second;
+    }
+
+    static std::string join( const std::string &labels,
+                             const std::string &more )
+    {
+        return labels.empty( ) ? more
+             : more.empty( )   ? labels
+             : labels + "," + more;
+    }
+
+public:
+
+    /// owner groups the entries remove( ) takes away together
+    void add( kind type, const std::string &name, const std::string &help,
+              const std::string &labels, reader read,
+              const std::string &owner = std::string( ) )
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        get_family( name, help, type ).sources.push_back(
+                    source { owner, labels, std::move(read), nullptr, 1 } );
+    }
+
+    /// quantiles, _sum and _count of the histogram, values / scale
+    void add_summary( const std::string &name, const std::string &help,
+                      const std::string &labels, histogram_reader read,
+                      double scale = 1.0,
+                      const std::string &owner = std::string( ) )
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        get_family( name, help, SUMMARY ).sources.push_back(
+                    source { owner, labels, nullptr, std::move(read),
+                             scale } );
+    }
+
+    /// the counters and handler time of an endpoint_metrics
+    void add_endpoint( const std::string &labels,
+                       const endpoint_metrics &m,
+                       const std::string &owner = std::string( ) )
+    {
+        static const struct {
+            endpoint_metrics::counter   id;
+            const char                 *name;
+            const char                 *help;
+        } counters[ ] = {
+            { endpoint_metrics::PACKETS_IN, "udp_packets_in_total",
+              "Datagrams delivered to the handler." },
+            { endpoint_metrics::BYTES_IN, "udp_bytes_in_total",
+              "Payload bytes delivered to the handler." },
+            { endpoint_metrics::PACKETS_OUT, "udp_packets_out_total",
+              "Datagrams sent." },
+            { endpoint_metrics::BYTES_OUT, "udp_bytes_out_total",
+              "Payload bytes sent." },
+            { endpoint_metrics::SEND_ERRORS, "udp_send_errors_total",
+              "Sends that failed and were dropped." },
+            { endpoint_metrics::RECEIVE_ERRORS, "udp_receive_errors_total",
+              "Receive completions with an error." },
+            { endpoint_metrics::TRUNCATED, "udp_truncated_total",
+              "Datagrams dropped for not fitting the read buffer." },
+        };
+        const endpoint_metrics *mp = &m;
+        for( auto &c: counters ) {
+            const auto id = c.id;
+            add( COUNTER, c.name, c.help, labels,
+                 [mp, id]( ) { return double(mp->value( id )); }, owner );
+        }
+        add_summary( "udp_handler_seconds",
+                     "Time spent in read handlers (sampled).", labels,
+                     [mp]( ) { return mp->handler_ns.snapshot( ); },
+                     1e9, owner );
+    }
+
+    /// write_queue_depth( ) and write_queue_peak( ) of a point_iface
+    template <typename Point>
+    void add_write_queue( const std::string &labels, const Point &point,
+                          const std::string &owner = std::string( ) )
+    {
+        const Point *p = &point;
+        add( GAUGE, "point_write_queue_depth",
+             "Point writes queued and not completed.", labels,
+             [p]( ) { return double(p->write_queue_depth( )); }, owner );
+        add( GAUGE, "point_write_queue_peak",
+             "The deepest the point write queue has been.", labels,
+             [p]( ) { return double(p->write_queue_peak( )); }, owner );
+    }
+
+    /// drops every entry added with owner
+    void remove( const std::string &owner )
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        for( auto &f: families_ ) {
+            auto &src( f.second.sources );
+            src.erase( std::remove_if( src.begin( ), src.end( ),
+                            [&owner]( const source &s ) {
+                                return s.owner == owner;
+                            } ), src.end( ) );
+        }
+    }
+
+    /// every metric read now, in the order they were added
+    std::vector<family> snapshot( ) const
+    {
+        static const double quantiles[ ] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+
+        std::lock_guard<std::mutex> l(lock_);
+        std::vector<family> res;
+        res.reserve( order_.size( ) );
+        for( auto &name: order_ ) {
+            const family_info &fi( families_.find( name )->second );
+            if( fi.sources.empty( ) ) {
+                continue;
+            }
+            family f = { name, fi.help, fi.type, { } };
+            for( auto &s: fi.sources ) {
+                if( fi.type != SUMMARY ) {
+                    f.samples.push_back( sample { name, s.labels,
+                                                  s.read( ) } );
+                    continue;
+                }
+                const hdr_histogram h( s.read_histogram( ) );
+                char q[32];
+                for( double p: quantiles ) {
+                    std::snprintf( q, sizeof(q), "quantile=\"%g\"", p );
+                    f.samples.push_back( sample { name,
+                                join( s.labels, q ),
+                                h.value_at( p * 100 ) / s.scale } );
+                }
+                f.samples.push_back( sample { name + "_sum", s.labels,
+                                h.mean( ) * h.count( ) / s.scale } );
+                f.samples.push_back( sample { name + "_count", s.labels,
+                                double(h.count( )) } );
+            }
+            res.push_back( std::move(f) );
+        }
+        return res;
+    }
+
+    /// the Prometheus text exposition format (version 0.0.4)
+    std::string prometheus( ) const
+    {
+        static const char *types[ ] = { "counter", "gauge", "summary" };
+        std::string res;
+        char value[32];
+        for( auto &f: snapshot( ) ) {
+            res += "# HELP " + f.name + " " + f.help + "\n";
+            res += "# TYPE " + f.name + " " + types[f.type] + "\n";
+            for( auto &s: f.samples ) {
+                std::snprintf( value, sizeof(value), "%.15g", s.value );
+                res += s.name;
+                if( !s.labels.empty( ) ) {
+                    res += "{" + s.labels + "}";
+                }
+                res += " ";
+                res += value;
+                res += "\n";
+            }
+        }
+        return res;
+    }
+};
+
+/// answers any datagram with registry.prometheus( ), split at line ends
+/// into datagrams of at most max_datagram bytes and ended by an empty
+/// one. Bind it to loopback or a unix path; there is no access control:
+///     echo | nc -u -w1 127.0.0.1 <port>
+template <typename Protocol>
+class basic_metrics_exporter {
+
+    using socket_type   = typename Protocol::socket;
+    using endpoint_type = typename Protocol::endpoint;
+
+    enum { max_datagram = 60000 };
+
+    const metrics_registry &registry_;
+    socket_type             sock_;
+    endpoint_type           local_;
+    endpoint_type           from_;
+    char                    request_[512];
+
+    static void remove_path( const boost::asio::ip::udp::endpoint & )
+    { }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    static void remove_path(
+                const boost::asio::local::datagram_protocol::endpoint &ep )
+    {
+        ::unlink( ep.path( ).c_str( ) );
+    }
+#endif
+
+    void read( )
+    {
+        sock_.async_receive_from( boost::asio::buffer( request_ ), from_,
+            [this]( const boost::system::error_code &err, std::size_t ) {
+                if( err == boost::asio::error::operation_aborted ) {
+                    return;
+                }
+                if( !err ) {
+                    reply( );
+                }
+                read( );
+            } );
+    }
+
+    void reply( )
+    {
+        const std::string text = registry_.prometheus( );
+        boost::system::error_code ec;
+        std::size_t pos = 0;
+        while( pos < text.size( ) ) {
+            std::size_t len = std::min<std::size_t>( max_datagram,
+                                                     text.size( ) - pos );
+            if( pos + len < text.size( ) ) {
+                const std::size_t nl = text.rfind( '\n', pos + len - 1 );
+                if( ( nl != std::string::npos ) && ( nl >= pos ) ) {
+                    len = nl + 1 - pos;
+                }
+            }
+            sock_.send_to( boost::asio::buffer( text.data( ) + pos, len ),
+                           from_, 0, ec );
+            pos += len;
+        }
+        sock_.send_to( boost::asio::buffer( text.data( ), 0 ),
+                       from_, 0, ec );
+    }
+
+public:
+
+    basic_metrics_exporter( boost::asio::io_service &ios,
+                            const metrics_registry &registry,
+                            const endpoint_type &local )
+        :registry_(registry)
+        ,sock_(ios)
+        ,local_(local)
+    {
+        remove_path( local_ );
+        sock_.open( local_.protocol( ) );
+        sock_.bind( local_ );
+        read( );
+    }
+
+    ~basic_metrics_exporter( )
+    {
+        close( );
+    }
+
+    basic_metrics_exporter( const basic_metrics_exporter & ) = delete;
+    basic_metrics_exporter &operator = (
+                                const basic_metrics_exporter & ) = delete;
+
+    endpoint_type local_endpoint( ) const
+    {
+        return sock_.local_endpoint( );
+    }
+
+    /// from the io_service's thread
+    void close( )
+    {
+        if( sock_.is_open( ) ) {
+            boost::system::error_code ec;
+            sock_.close( ec );
+            remove_path( local_ );
+        }
+    }
+};
+
+using udp_metrics_exporter =
+            basic_metrics_exporter<boost::asio::ip::udp>;
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+using unix_metrics_exporter =
+            basic_metrics_exporter<boost::asio::local::datagram_protocol>;
+#endif
+
+#endif // UDP_METRICS_HPP
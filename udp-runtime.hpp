@@ -0,0 +1,205 @@
+#ifndef UDP_RUNTIME_HPP
+#define UDP_RUNTIME_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "boost/asio.hpp"
+
+#include "udp-busy-poll.hpp"
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/// N io_services, each run by its own thread. A thread can be pinned to
+/// a cpu and is named "<name>-<i>"; stop( ) (or the destructor) stops
+/// and joins them all.
+///
+/// Memory is placed by first touch, so whatever is built inside
+/// run_on( i, ... ) or by handlers of ios( i ) comes from the NUMA node
+/// of that thread's cpu: create endpoints, pools and client tables there.
+class io_runtime {
+
+    struct slot {
+        boost::asio::io_service                         ios;
+        std::unique_ptr<boost::asio::io_service::work>  work;
+        std::thread                                     thread;
+        int                                             cpu  = -1;
+        int                                             node = -1;
+    };
+
+    std::string                         name_;
+    std::vector<std::unique_ptr<slot> > slots_;
+    std::uint64_t                       spin_usec_ = 0;
+
+    void thread_main( std::size_t id )
+    {
+        slot &s( *slots_[id] );
+#if defined(__linux__)
+        /// 15 characters at most
+        std::string name = name_.substr( 0, 11 ) + "-"
+                         + std::to_string( id );
+        ::pthread_setname_np( ::pthread_self( ),
+                              name.substr( 0, 15 ).c_str( ) );
+#endif
+        if( spin_usec_ ) {
+            busy_poll_runner( s.ios, spin_usec_, s.cpu ).run( );
+        } else {
+            if( s.cpu >= 0 ) {
+                busy_poll_runner::pin_this_thread( s.cpu );
+            }
+            s.ios.run( );
+        }
+    }
+
+public:
+
+    /// thread i is pinned to cpus[i % cpus.size( )]; no cpus, no pinning
+    io_runtime( std::size_t threads, const std::vector<int> &cpus = { },
+                std::string name = "io" )
+        :name_(std::move(name))
+    {
+        threads = threads ? threads : 1;
+        for( std::size_t i = 0; i < threads; ++i ) {
+            std::unique_ptr<slot> s(new slot);
+            if( !cpus.empty( ) ) {
+                s->cpu  = cpus[i % cpus.size( )];
+                s->node = cpu_node( s->cpu );
+            }
+            slots_.push_back( std::move(s) );
+        }
+    }
+
+    ~io_runtime( )
+    {
+        stop( );
+    }
+
+    io_runtime( const io_runtime & ) = delete;
+    io_runtime &operator = ( const io_runtime & ) = delete;
+
+    /// the threads spin this long before they block; see
+    /// busy_poll_runner. Call before start( )
+    void set_busy_poll( std::uint64_t spin_usec )
+    {
+        spin_usec_ = spin_usec;
+    }
+
+    std::uint64_t busy_poll( ) const
+    {
+        return spin_usec_;
+    }
+
+    void start( )
+    {
+        for( std::size_t i = 0; i < slots_.size( ); ++i ) {
+            slot &s( *slots_[i] );
+            if( s.thread.joinable( ) ) {
+                continue;
+            }
+            s.ios.restart( );
+            s.work.reset( new boost::asio::io_service::work( s.ios ) );
+            s.thread = std::thread( [this, i]( ) { thread_main( i ); } );
+        }
+    }
+
+    /// pending handlers are dropped; safe to call twice
+    void stop( )
+    {
+        for( auto &s: slots_ ) {
+            s->work.reset( );
+            s->ios.stop( );
+        }
+        for( auto &s: slots_ ) {
+            if( s->thread.joinable( ) ) {
+                s->thread.join( );
+            }
+        }
+    }
+
+    std::size_t size( ) const
+    {
+        return slots_.size( );
+    }
+
+    boost::asio::io_service &ios( std::size_t id )
+    {
+        return slots_[id]->ios;
+    }
+
+    /// -1 if the thread is not pinned
+    int cpu( std::size_t id ) const
+    {
+        return slots_[id]->cpu;
+    }
+
+    /// NUMA node of cpu( id ); -1 if unknown
+    int node( std::size_t id ) const
+    {
+        return slots_[id]->node;
+    }
+
+    /// runs call on thread id and returns its result; exceptions are
+    /// rethrown here. The runtime has to be started
+    template <typename Func>
+    auto run_on( std::size_t id, Func call ) -> decltype( call( ) )
+    {
+        using result_type = decltype( call( ) );
+        auto task = std::make_shared<std::packaged_task<result_type ( )> >(
+                                                        std::move(call) );
+        auto res = task->get_future( );
+        slots_[id]->ios.post( [task]( ) { (*task)( ); } );
+        return res.get( );
+    }
+
+    /// the cpus this process may run on (taskset, cgroups)
+    static std::vector<int> allowed_cpus( )
+    {
+        std::vector<int> res;
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        if( 0 == ::sched_getaffinity( 0, sizeof(set), &set ) ) {
+            for( int i = 0; i < CPU_SETSIZE; ++i ) {
+                if( CPU_ISSET( i, &set ) ) {
+                    res.push_back( i );
+                }
+            }
+        }
+#endif
+        return res;
+    }
+
+    /// from /sys/devices/system/cpu/cpuN/nodeM; -1 if there is none
+    static int cpu_node( int cpu )
+    {
+        int res = -1;
+#if defined(__linux__)
+        std::string path = "/sys/devices/system/cpu/cpu"
+                         + std::to_string( cpu );
+        if( DIR *dir = ::opendir( path.c_str( ) ) ) {
+            while( dirent *ent = ::readdir( dir ) ) {
+                int node;
+                if( 1 == std::sscanf( ent->d_name, "node%d", &node ) ) {
+                    res = node;
+                    break;
+                }
+            }
+            ::closedir( dir );
+        }
+#else
+        (void)cpu;
+#endif
+        return res;
+    }
+};
+
+#endif // UDP_RUNTIME_HPP
@@ -0,0 +1,92 @@
+#ifndef UDP_THREADING_HPP
+#define UDP_THREADING_HPP
+
+#include <utility>
+
+#include "boost/asio.hpp"
+
+/// how an endpoint keeps its completions from running concurrently.
+/// Each policy has a dispatcher with the strand interface the endpoints
+/// use: wrap, post, dispatch and running_in_this_thread.
+
+/// through an io_service::strand; any number of threads may run the
+/// io_service
+struct strand_threading {
+
+    class dispatcher {
+
+        boost::asio::io_service::strand strand_;
+
+    public:
+
+        explicit dispatcher( boost::asio::io_service &ios )
+            :strand_(ios)
+        { }
+
+        template <typename Handler>
+        auto wrap( Handler handler )
+            -> decltype( std::declval<boost::asio::io_service::strand &>( )
+                            .wrap( std::move(handler) ) )
+        {
+            return strand_.wrap( std::move(handler) );
+        }
+
+        template <typename Handler>
+        void post( Handler &&handler )
+        {
+            strand_.post( std::forward<Handler>(handler) );
+        }
+
+        template <typename Handler>
+        void dispatch( Handler &&handler )
+        {
+            strand_.dispatch( std::forward<Handler>(handler) );
+        }
+
+        bool running_in_this_thread( ) const
+        {
+            return strand_.running_in_this_thread( );
+        }
+    };
+};
+
+/// handlers go to the io_service as they are: no strand lock or queue.
+/// Only for an io_service run by exactly one thread (thread per core)
+struct single_threading {
+
+    class dispatcher {
+
+        boost::asio::io_service &ios_;
+
+    public:
+
+        explicit dispatcher( boost::asio::io_service &ios )
+            :ios_(ios)
+        { }
+
+        template <typename Handler>
+        Handler wrap( Handler handler )
+        {
+            return handler;
+        }
+
+        template <typename Handler>
+        void post( Handler &&handler )
+        {
+            ios_.post( std::forward<Handler>(handler) );
+        }
+
+        template <typename Handler>
+        void dispatch( Handler &&handler )
+        {
+            ios_.dispatch( std::forward<Handler>(handler) );
+        }
+
+        bool running_in_this_thread( ) const
+        {
+            return ios_.get_executor( ).running_in_this_thread( );
+        }
+    };
+};
+
+#endif // UDP_THREADING_HPP
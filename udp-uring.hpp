@@ -0,0 +1,330 @@
+#ifndef UDP_URING_HPP
+#define UDP_URING_HPP
+
+/// io_uring through raw syscalls (no liburing).
+/// Built only with UDP_ENDPOINT_USE_IO_URING on linux; sets
+/// UDP_ENDPOINT_IO_URING to 1 when the backend is compiled in.
+
+#if defined(__linux__) && defined(UDP_ENDPOINT_USE_IO_URING)
+
+#define UDP_ENDPOINT_IO_URING 1
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+class uring {
+
+    int                 fd_;
+
+    void               *sq_ptr_;
+    std::size_t         sq_len_;
+    void               *cq_ptr_;
+    std::size_t         cq_len_;
+    io_uring_sqe       *sqes_;
+    std::size_t         sqes_len_;
+
+    unsigned           *sq_head_;
+    unsigned           *sq_tail_;
+    unsigned           *sq_array_;
+    unsigned            sq_mask_;
+    unsigned            sq_entries_;
+    unsigned            sq_local_;  /// tail not yet published
+    unsigned            to_submit_;
+
+    unsigned           *cq_head_;
+    unsigned           *cq_tail_;
+    unsigned            cq_mask_;
+    io_uring_cqe       *cqes_;
+
+    io_uring_buf       *br_;    /// ring entries; tail overlays br_[0].resv
+    std::size_t         br_len_;
+    unsigned            br_mask_;
+    unsigned short      br_tail_;
+
+    static int sys_setup( unsigned entries, io_uring_params *p )
+    {
+        return static_cast<int>(::syscall( __NR_io_uring_setup, entries, p ));
+    }
+
+    static int sys_enter( int fd, unsigned submit, unsigned wait,
+                          unsigned flags )
+    {
+        return static_cast<int>(::syscall( __NR_io_uring_enter, fd, submit,
+                                           wait, flags, nullptr, 0 ));
+    }
+
+    static int sys_register( int fd, unsigned op, void *arg, unsigned n )
+    {
+        return static_cast<int>(::syscall( __NR_io_uring_register,
+                                           fd, op, arg, n ));
+    }
+
+    template <typename T>
+    static T *at( void *base, unsigned offset )
+    {
+        return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+    }
+
+    static void *map( int fd, std::size_t len, off_t offset )
+    {
+        void *res = ::mmap( nullptr, len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, offset );
+        return res == MAP_FAILED ? nullptr : res;
+    }
+
+    bool op_supported( const io_uring_probe *probe, unsigned op ) const
+    {
+        return ( op <= probe->last_op )
+            && ( probe->ops[op].flags & IO_URING_OP_SUPPORTED );
+    }
+
+public:
+
+    uring( )
+        :fd_(-1)
+        ,sq_ptr_(nullptr), sq_len_(0)
+        ,cq_ptr_(nullptr), cq_len_(0)
+        ,sqes_(nullptr), sqes_len_(0)
+        ,sq_head_(nullptr), sq_tail_(nullptr), sq_array_(nullptr)
+        ,sq_mask_(0), sq_entries_(0), sq_local_(0), to_submit_(0)
+        ,cq_head_(nullptr), cq_tail_(nullptr), cq_mask_(0), cqes_(nullptr)
+        ,br_(nullptr), br_len_(0), br_mask_(0), br_tail_(0)
+    { }
+
+    uring( const uring & ) = delete;
+    uring &operator = ( const uring & ) = delete;
+
+    ~uring( )
+    {
+        close( );
+    }
+
+    int fd( ) const
+    {
+        return fd_;
+    }
+
+    bool is_open( ) const
+    {
+        return fd_ >= 0;
+    }
+
+    /// false if the kernel has no io_uring or lacks RECVMSG/SENDMSG
+    bool open( unsigned entries )
+    {
+        io_uring_params p;
+        std::memset( &p, 0, sizeof(p) );
+        p.flags      = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4; /// multishot receive posts a lot
+
+        fd_ = sys_setup( entries, &p );
+        if( fd_ < 0 ) {
+            return false;
+        }
+
+        sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len_ = p.cq_off.cqes  + p.cq_entries * sizeof(io_uring_cqe);
+        if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+            sq_len_ = cq_len_ = std::max( sq_len_, cq_len_ );
+        }
+
+        sq_ptr_ = map( fd_, sq_len_, IORING_OFF_SQ_RING );
+        cq_ptr_ = ( p.features & IORING_FEAT_SINGLE_MMAP )
+                ? sq_ptr_
+                : map( fd_, cq_len_, IORING_OFF_CQ_RING );
+        sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe *>(map( fd_, sqes_len_,
+                                                 IORING_OFF_SQES ));
+        if( !sq_ptr_ || !cq_ptr_ || !sqes_ ) {
+            close( );
+            return false;
+        }
+
+        sq_head_    = at<unsigned>( sq_ptr_, p.sq_off.head );
+        sq_tail_    = at<unsigned>( sq_ptr_, p.sq_off.tail );
+        sq_array_   = at<unsigned>( sq_ptr_, p.sq_off.array );
+        sq_mask_    = *at<unsigned>( sq_ptr_, p.sq_off.ring_mask );
+        sq_entries_ = p.sq_entries;
+        sq_local_   = *sq_tail_;
+
+        cq_head_    = at<unsigned>( cq_ptr_, p.cq_off.head );
+        cq_tail_    = at<unsigned>( cq_ptr_, p.cq_off.tail );
+        cq_mask_    = *at<unsigned>( cq_ptr_, p.cq_off.ring_mask );
+        cqes_       = at<io_uring_cqe>( cq_ptr_, p.cq_off.cqes );
+
+        std::vector<char> pbuf( sizeof(io_uring_probe)
+                              + 256 * sizeof(io_uring_probe_op) );
+        io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(&pbuf[0]);
+        if( sys_register( fd_, IORING_REGISTER_PROBE, probe, 256 ) < 0
+         || !op_supported( probe, IORING_OP_RECVMSG )
+         || !op_supported( probe, IORING_OP_SENDMSG ) )
+        {
+            close( );
+            return false;
+        }
+        return true;
+    }
+
+    void close( )
+    {
+        if( sqes_ ) {
+            ::munmap( sqes_, sqes_len_ );
+            sqes_ = nullptr;
+        }
+        if( cq_ptr_ && ( cq_ptr_ != sq_ptr_ ) ) {
+            ::munmap( cq_ptr_, cq_len_ );
+        }
+        if( sq_ptr_ ) {
+            ::munmap( sq_ptr_, sq_len_ );
+        }
+        sq_ptr_ = cq_ptr_ = nullptr;
+        if( fd_ >= 0 ) {
+            ::close( fd_ );
+            fd_ = -1;
+        }
+        std::free( br_ );
+        br_ = nullptr;
+    }
+
+    /// ================ submission ================ ///
+
+    /// nullptr if the queue is full; submit( ) makes room
+    io_uring_sqe *get_sqe( )
+    {
+        unsigned head = __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE );
+        if( sq_local_ - head >= sq_entries_ ) {
+            return nullptr;
+        }
+        unsigned idx = sq_local_ & sq_mask_;
+        io_uring_sqe *sqe = &sqes_[idx];
+        std::memset( sqe, 0, sizeof(*sqe) );
+        sq_array_[idx] = idx;
+        ++sq_local_;
+        ++to_submit_;
+        return sqe;
+    }
+
+    /// returns number of submitted entries or -errno
+    int submit( unsigned wait = 0 )
+    {
+        __atomic_store_n( sq_tail_, sq_local_, __ATOMIC_RELEASE );
+        int res = sys_enter( fd_, to_submit_, wait,
+                             wait ? IORING_ENTER_GETEVENTS : 0 );
+        if( res < 0 ) {
+            return -errno;
+        }
+        to_submit_ -= static_cast<unsigned>(res);
+        return res;
+    }
+
+    static void prep_recvmsg_multishot( io_uring_sqe *sqe, int fd,
+                                        msghdr *msg, std::uint16_t group,
+                                        std::uint64_t user_data )
+    {
+        sqe->opcode     = IORING_OP_RECVMSG;
+        sqe->fd         = fd;
+        sqe->addr       = reinterpret_cast<std::uint64_t>(msg);
+        sqe->len        = 1;
+        sqe->msg_flags  = MSG_TRUNC;
+        sqe->ioprio     = IORING_RECV_MULTISHOT;
+        sqe->flags      = IOSQE_BUFFER_SELECT;
+        sqe->buf_group  = group;
+        sqe->user_data  = user_data;
+    }
+
+    static void prep_sendmsg( io_uring_sqe *sqe, int fd, const msghdr *msg,
+                              std::uint64_t user_data )
+    {
+        sqe->opcode     = IORING_OP_SENDMSG;
+        sqe->fd         = fd;
+        sqe->addr       = reinterpret_cast<std::uint64_t>(msg);
+        sqe->len        = 1;
+        sqe->user_data  = user_data;
+    }
+
+    static void prep_cancel_fd( io_uring_sqe *sqe, int fd )
+    {
+        sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+        sqe->fd           = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data    = ~std::uint64_t(0);
+    }
+
+    /// ================ completion ================ ///
+
+    /// calls f( const io_uring_cqe & ) for every ready completion
+    template <typename F>
+    std::size_t reap( F f )
+    {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n( cq_tail_, __ATOMIC_ACQUIRE );
+        std::size_t count = 0;
+        for( ; head != tail; ++head, ++count ) {
+            f( cqes_[head & cq_mask_] );
+        }
+        __atomic_store_n( cq_head_, head, __ATOMIC_RELEASE );
+        return count;
+    }
+
+    /// ================ provided buffers ================ ///
+
+    /// registers a ring of entries (a power of two) buffers for group.
+    /// io_uring_buf_ring is not used: in C++ its flexible array member
+    /// starts 8 bytes late
+    bool setup_buffers( unsigned entries, std::uint16_t group )
+    {
+        /// the ring has to start on a page
+        void *mem = nullptr;
+        br_len_ = entries * sizeof(io_uring_buf);
+        if( ::posix_memalign( &mem, ::sysconf( _SC_PAGESIZE ), br_len_ ) ) {
+            return false;
+        }
+        std::memset( mem, 0, br_len_ );
+        br_ = static_cast<io_uring_buf *>(mem);
+        br_mask_ = entries - 1;
+        br_tail_ = 0;
+
+        io_uring_buf_reg reg;
+        std::memset( &reg, 0, sizeof(reg) );
+        reg.ring_addr    = reinterpret_cast<std::uint64_t>(mem);
+        reg.ring_entries = entries;
+        reg.bgid         = group;
+        if( sys_register( fd_, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 ) {
+            std::free( br_ );
+            br_ = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    /// the kernel sees it after commit_buffers( )
+    void add_buffer( void *addr, unsigned len, std::uint16_t bid )
+    {
+        io_uring_buf &b( br_[br_tail_ & br_mask_] );
+        b.addr = reinterpret_cast<std::uint64_t>(addr);
+        b.len  = len;
+        b.bid  = bid;
+        ++br_tail_;
+    }
+
+    void commit_buffers( )
+    {
+        __atomic_store_n( &br_[0].resv, br_tail_, __ATOMIC_RELEASE );
+    }
+};
+
+#endif
+
+#endif // UDP_URING_HPP
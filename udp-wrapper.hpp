@@ -5,60 +5,1306 @@
 #include <queue>
 #include <functional>
 #include <list>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 
 #include "boost/asio.hpp"
 
+#include "udp-buffer-pool.hpp"
+#include "udp-fec.hpp"
+#include "udp-handler-memory.hpp"
+#include "udp-metrics.hpp"
+#include "udp-threading.hpp"
+#include "udp-uring.hpp"
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <errno.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO     104
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU     49
+#endif
+#endif
+
 namespace ba = boost::asio;
 namespace bs = boost::system;
 namespace ph = std::placeholders;
 
-class udp_endpoint {
+/// the endpoint; events go to Derived (CRTP) without indirect calls:
+///     void on_read( err, from, data, len );
+///     void on_read_batch( err, dgrams, count );   /// optional
+///     void on_write( err, len );                   /// optional
+/// Derived has to make them public or befriend the base.
+/// Threading picks how completions are serialised (udp-threading.hpp):
+/// the default strand, or single_threading for an io_service run by one
+/// thread. udp_endpoint below is the strand one with virtual events
+template <typename Derived, typename Threading = strand_threading>
+class basic_udp_endpoint {
+
+public:
+
+    struct datagram {
+        ba::ip::udp::endpoint   from;
+        std::uint8_t           *data;
+        std::size_t             length;
+        buffer_handle           buffer; /// may be kept by on_read_batch
+    };
+
+private:
 
     ba::io_service             &ios_;
-    ba::io_service::strand      dispatcher_;
+    typename Threading::dispatcher dispatcher_;
     ba::ip::udp::socket         sock_;
-    std::vector<std::uint8_t>   data_;
+    buffer_pool                 pool_;
+    buffer_handle               rbuf_;
     ba::ip::udp::endpoint       remote_;
+    ba::ip::udp::endpoint       from_;
+
+    /// operation memory for the read chain, writes and the send queue
+    handler_memory              read_mem_;
+    handler_memory              write_mem_;
+    handler_memory              send_mem_;
+    bool                        reuse_port_;
+
+    /// batched receive; every slot holds a pooled buffer
+    std::size_t                 batch_size_;
+    std::vector<datagram>       batch_;
+#if defined(__linux__)
+    std::vector<mmsghdr>        batch_hdrs_;
+    std::vector<iovec>          batch_iovs_;
+    std::vector<char>           batch_ctrl_;
+#endif
+
+    /// datagrams longer than the batch buffers (dropped)
+    std::atomic<std::uint64_t>  truncated_;
+
+    /// counted into when set; see set_metrics( )
+    endpoint_metrics           *metrics_;
+    std::uint32_t               metrics_tick_;
+
+    /// UDP_GRO: coalesced datagrams are split into gro_split_
+    bool                        gro_;
+    std::vector<datagram>       gro_split_;
+
+    /// UDP_SEGMENT works; cleared on the first refusal
+    std::atomic<bool>           gso_ok_;
+
+    /// queued writes; payloads are copied to send_data_
+    /// unless they come as a buffer_handle
+    struct pending_write {
+        ba::ip::udp::endpoint   to;
+        std::size_t             offset;
+        std::size_t             length;
+        buffer_handle           buffer;
+    };
+
+    std::vector<char>           send_data_;
+    std::vector<pending_write>  send_queue_;
+    std::size_t                 send_head_;
+    std::size_t                 send_bytes_;
+    std::size_t                 send_max_count_;
+    std::size_t                 send_max_bytes_;
+    bool                        send_scheduled_;
+    bool                        send_blocked_;
+    bool                        send_flushing_;
+#if defined(__linux__)
+    std::vector<mmsghdr>        send_hdrs_;
+    std::vector<iovec>          send_iovs_;
+#endif
+
+#if defined(UDP_ENDPOINT_IO_URING)
+    /// io_uring backend; see use_io_uring( )
+    struct uring_state {
+
+        enum {
+            TAG_RECV    = 1,
+            TAG_SEND    = 2,
+            BUF_GROUP   = 1
+        };
+
+        uring                           ring;
+        ba::posix::stream_descriptor    watch;  /// ring fd readiness
+        handler_memory                  mem;
+
+        /// provided buffers by id; a slot is empty while its buffer
+        /// waits in ready or is handed to on_read_batch
+        std::vector<buffer_handle>      bufs;
+        std::vector<datagram>           ready;
+        std::vector<std::uint16_t>      ready_ids;
+        bs::error_code                  recv_error;
+        msghdr                          recv_msg;
+        bool                            recv_ok;    /// multishot works
+        bool                            primed;     /// bufs were given
+        bool                            received;   /// got a datagram
+        bool                            recv_armed;
+        bool                            read_wanted;
+        bool                            delivering;
+        bool                            waiting;
+        bool                            closing;
+
+        /// messages owned by the kernel until their completions arrive
+        std::vector<pending_write>      sent;
+        std::vector<char>               sent_data;
+        std::vector<msghdr>             sent_hdrs;
+        std::vector<iovec>              sent_iovs;
+        std::size_t                     sent_left;
+
+        explicit uring_state( ba::io_service &ios )
+            :watch(ios)
+            ,recv_msg( )
+            ,recv_ok(true)
+            ,primed(false)
+            ,received(false)
+            ,recv_armed(false)
+            ,read_wanted(false)
+            ,delivering(false)
+            ,waiting(false)
+            ,closing(false)
+            ,sent_left(0)
+        {
+            recv_msg.msg_namelen = sizeof(sockaddr_in6);
+        }
+
+        ~uring_state( )
+        {
+            watch.release( ); /// the ring owns the fd
+        }
+    };
+
+    std::unique_ptr<uring_state> uring_;
+#endif
+
+    /// completion functors; unlike std::bind results they are small
+    /// enough for handler_memory and cost no allocation
+    typedef void (basic_udp_endpoint::*handler_call)( const bs::error_code &,
+                                                std::size_t );
+
+    template <handler_call Call>
+    struct member_handler {
+        basic_udp_endpoint *self_;
+        void operator ( )( const bs::error_code &err, std::size_t len ) const
+        {
+            (self_->*Call)( err, len );
+        }
+    };
+
+    struct buffer_write_handler {
+        basic_udp_endpoint   *self_;
+        buffer_handle   buf_;
+        void operator ( )( const bs::error_code &err, std::size_t len ) const
+        {
+            self_->written( err, len );
+        }
+    };
+
+    struct flush_call {
+        basic_udp_endpoint *self_;
+        void operator ( )( ) const
+        {
+            self_->flush_handler( );
+        }
+    };
+
+    struct write_done {
+        basic_udp_endpoint    *self_;
+        bs::error_code   err_;
+        std::size_t      len_;
+        std::size_t      packets_;
+        void operator ( )( ) const
+        {
+            self_->written( err_, len_, packets_ );
+        }
+    };
+
+    /// one write_to_segmented call; kept while the socket is busy
+    struct segmented_write {
+        basic_udp_endpoint           *self_;
+        const std::uint8_t     *data_;
+        std::size_t             length_;
+        std::size_t             segment_;
+        std::size_t             sent_;
+        ba::ip::udp::endpoint   to_;
+        buffer_handle           buf_;
+        void operator ( )( const bs::error_code &err, std::size_t )
+        {
+            self_->segmented_handler( *this, err );
+        }
+    };
+
+    template <handler_call Call>
+    alloc_handler<member_handler<Call> > make_handler( handler_memory &mem )
+    {
+        member_handler<Call> h = { this };
+        return make_alloc_handler( mem, h );
+    }
+
+    /// every completion goes through these three, so metrics_ sees
+    /// them; a failed segmented send may still have sent some packets
+    void written( const bs::error_code &err, std::size_t len,
+                  std::size_t packets = 1 )
+    {
+        if( metrics_ ) {
+            if( !err || len ) {
+                metrics_->add( endpoint_metrics::PACKETS_OUT, packets );
+                metrics_->add( endpoint_metrics::BYTES_OUT, len );
+            }
+            if( err ) {
+                metrics_->add( endpoint_metrics::SEND_ERRORS );
+            }
+        }
+        derived( ).on_write( err, len );
+    }
+
+    void received( const bs::error_code &err,
+                   const ba::ip::udp::endpoint &from,
+                   std::uint8_t *data, std::size_t len )
+    {
+        if( !metrics_ ) {
+            derived( ).on_read( err, from, data, len );
+            return;
+        }
+        if( err ) {
+            metrics_->add( endpoint_metrics::RECEIVE_ERRORS );
+        } else {
+            metrics_->add( endpoint_metrics::PACKETS_IN );
+            metrics_->add( endpoint_metrics::BYTES_IN, len );
+        }
+        timed( [&]( ) { derived( ).on_read( err, from, data, len ); } );
+    }
+
+    void received_batch( const bs::error_code &err,
+                         datagram *dgrams, std::size_t count )
+    {
+        if( !metrics_ ) {
+            derived( ).on_read_batch( err, dgrams, count );
+            return;
+        }
+        if( err ) {
+            metrics_->add( endpoint_metrics::RECEIVE_ERRORS );
+        }
+        std::size_t bytes = 0;
+        for( std::size_t i = 0; i < count; ++i ) {
+            bytes += dgrams[i].length;
+        }
+        metrics_->add( endpoint_metrics::PACKETS_IN, count );
+        metrics_->add( endpoint_metrics::BYTES_IN, bytes );
+        timed( [&]( ) { derived( ).on_read_batch( err, dgrams, count ); } );
+    }
+
+    /// the clock is read for one call in metrics_->timing_mask + 1
+    template <typename Call>
+    void timed( Call call )
+    {
+        if( ( ++metrics_tick_ & metrics_->timing_mask ) != 0 ) {
+            call( );
+            return;
+        }
+        auto start = std::chrono::steady_clock::now( );
+        call( );
+        metrics_->handler_ns.record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now( ) - start ).count( ) );
+    }
 
     void write_handler( const bs::error_code &err, std::size_t len )
     {
-        on_write( err, len );
+        written( err, len );
     }
 
     void read_handler( const bs::error_code &err, std::size_t len )
     {
-        on_read( err, remote_, &data_[0], len );
+        rbuf_.resize( len );
+        received( err, remote_, rbuf_.data( ), len );
+    }
+
+    void read_handler2( const bs::error_code &err, std::size_t len )
+    {
+        rbuf_.resize( len );
+        received( err, from_, rbuf_.data( ), len );
+    }
+
+    /// the previous buffer is reused unless a handler kept it
+    void fresh_buffer( buffer_handle &buf )
+    {
+        if( !buf.unique( ) || ( buf.capacity( ) != pool_.slab_size( ) ) ) {
+            buf = pool_.get( );
+        }
+        buf.resize( buf.capacity( ) );
+    }
+
+    void batch_handler( const bs::error_code &err, std::size_t )
+    {
+        if( err ) {
+            received_batch( err, nullptr, 0 );
+            return;
+        }
+
+        bs::error_code ec;
+        std::size_t count = receive_batch( ec );
+        datagram *first = count ? &batch_[0] : nullptr;
+
+        if( gro_ && count ) {
+            count = split_gro( count );
+            first = &gro_split_[0];
+        }
+
+        if( !ec && ( 0 == count ) ) {
+            /// spurious wakeup; nothing to deliver
+            read_batch( );
+        } else {
+            received_batch( ec, first, count );
+        }
+    }
+
+    void prepare_batch( )
+    {
+        if( batch_.size( ) != batch_size_ ) {
+            batch_.resize( batch_size_ );
+#if defined(__linux__)
+            batch_iovs_.resize( batch_size_ );
+            batch_hdrs_.resize( batch_size_ );
+            batch_ctrl_.resize( batch_size_ * ctrl_space );
+            for( std::size_t i = 0; i < batch_size_; ++i ) {
+                msghdr &hdr( batch_hdrs_[i].msg_hdr );
+                hdr = msghdr( );
+                hdr.msg_name    = batch_[i].from.data( );
+                hdr.msg_iov     = &batch_iovs_[i];
+                hdr.msg_iovlen  = 1;
+            }
+#else
+            sock_.non_blocking( true );
+#endif
+        }
+
+        for( std::size_t i = 0; i < batch_size_; ++i ) {
+            datagram &d( batch_[i] );
+            fresh_buffer( d.buffer );
+            d.data   = d.buffer.data( );
+            d.length = 0;
+#if defined(__linux__)
+            batch_iovs_[i].iov_base = d.data;
+            batch_iovs_[i].iov_len  = d.buffer.capacity( );
+#endif
+        }
+    }
+
+#if defined(__linux__)
+    std::size_t receive_batch( bs::error_code &ec )
+    {
+        prepare_batch( );
+
+        for( std::size_t i = 0; i < batch_size_; ++i ) {
+            msghdr &hdr( batch_hdrs_[i].msg_hdr );
+            hdr.msg_namelen =
+                    static_cast<socklen_t>(batch_[i].from.capacity( ));
+            hdr.msg_flags = 0;
+            hdr.msg_control    = gro_ ? &batch_ctrl_[i * ctrl_space]
+                                      : nullptr;
+            hdr.msg_controllen = gro_ ? ctrl_space : 0;
+        }
+
+        int res = ::recvmmsg( sock_.native_handle( ), &batch_hdrs_[0],
+                              static_cast<unsigned>(batch_size_),
+                              MSG_DONTWAIT, nullptr );
+        if( res < 0 ) {
+            if( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) ) {
+                ec.assign( errno, bs::system_category( ) );
+            }
+            return 0;
+        }
+
+        /// a cut datagram is dropped; with GRO on the headers are still
+        /// needed by index and the buffers are 64K anyway
+        std::size_t count = 0;
+        for( int i = 0; i < res; ++i ) {
+            if( !gro_ && ( batch_hdrs_[i].msg_hdr.msg_flags & MSG_TRUNC ) ) {
+                ++truncated_;
+                if( metrics_ ) {
+                    metrics_->add( endpoint_metrics::TRUNCATED );
+                }
+                continue;
+            }
+            if( count != std::size_t(i) ) {
+                std::swap( batch_[count], batch_[i] );
+            }
+            datagram &d( batch_[count++] );
+            d.from.resize( batch_hdrs_[i].msg_hdr.msg_namelen );
+            d.length = batch_hdrs_[i].msg_len;
+            d.buffer.resize( d.length );
+        }
+        return count;
+    }
+
+    /// segment size of a coalesced datagram or 0
+    std::size_t gro_segment( std::size_t id )
+    {
+        msghdr &hdr( batch_hdrs_[id].msg_hdr );
+        for( cmsghdr *c = CMSG_FIRSTHDR( &hdr ); c;
+                      c = CMSG_NXTHDR( &hdr, c ) )
+        {
+            if( ( c->cmsg_level == SOL_UDP ) && ( c->cmsg_type == UDP_GRO ) ) {
+                int size;
+                std::memcpy( &size, CMSG_DATA( c ), sizeof(size) );
+                return size > 0 ? static_cast<std::size_t>(size) : 0;
+            }
+        }
+        return 0;
+    }
+#else
+    std::size_t receive_batch( bs::error_code &ec )
+    {
+        prepare_batch( );
+
+        std::size_t count = 0;
+        for( ; count < batch_size_; ++count ) {
+            datagram &d( batch_[count] );
+            d.length = sock_.receive_from(
+                            ba::buffer( d.data, d.buffer.capacity( ) ),
+                            d.from, 0, ec );
+            d.buffer.resize( d.length );
+            if( ec ) {
+                if( ec == ba::error::would_block ) {
+                    ec.clear( );
+                }
+                break;
+            }
+        }
+        return count;
+    }
+#endif
+
+#if defined(__linux__)
+    enum { ctrl_space = CMSG_SPACE(sizeof(int)) };
+#else
+    std::size_t gro_segment( std::size_t )
+    {
+        return 0;
+    }
+#endif
+
+    /// every segment becomes a datagram sharing the received buffer
+    std::size_t split_gro( std::size_t count )
+    {
+        gro_split_.clear( );
+        for( std::size_t i = 0; i < count; ++i ) {
+            datagram &d( batch_[i] );
+            std::size_t seg = gro_segment( i );
+            if( 0 == seg || d.length <= seg ) {
+                gro_split_.push_back( d );
+                continue;
+            }
+            for( std::size_t off = 0; off < d.length; off += seg ) {
+                datagram part = { d.from, d.data + off,
+                                  std::min( seg, d.length - off ),
+                                  d.buffer };
+                gro_split_.push_back( std::move(part) );
+            }
+        }
+        return gro_split_.size( );
+    }
+
+    /// ================ segmented send ================ ///
+
+    enum { gso_max_segments = 64, gso_max_bytes = 65000 };
+
+#if defined(__linux__)
+    /// one sendmsg with UDP_SEGMENT or one sendmmsg of the segments;
+    /// returns bytes sent
+    std::size_t send_segments( const std::uint8_t *data, std::size_t len,
+                               std::size_t seg,
+                               const ba::ip::udp::endpoint &to,
+                               bs::error_code &ec )
+    {
+        std::size_t segs = std::max<std::size_t>( 1, std::min<std::size_t>(
+                                gso_max_segments, gso_max_bytes / seg ) );
+        std::size_t chunk = std::min( len, seg * segs );
+
+        if( ( chunk > seg ) && gso_ok_.load( std::memory_order_relaxed ) ) {
+
+            char ctrl[CMSG_SPACE(sizeof(std::uint16_t))] = { 0 };
+            iovec iov = { const_cast<std::uint8_t *>(data), chunk };
+
+            msghdr hdr = msghdr( );
+            hdr.msg_name       = const_cast<sockaddr *>(to.data( ));
+            hdr.msg_namelen    = static_cast<socklen_t>(to.size( ));
+            hdr.msg_iov        = &iov;
+            hdr.msg_iovlen     = 1;
+            hdr.msg_control    = ctrl;
+            hdr.msg_controllen = sizeof(ctrl);
+
+            cmsghdr *c = CMSG_FIRSTHDR( &hdr );
+            c->cmsg_level = SOL_UDP;
+            c->cmsg_type  = UDP_SEGMENT;
+            c->cmsg_len   = CMSG_LEN(sizeof(std::uint16_t));
+            std::uint16_t size = static_cast<std::uint16_t>(seg);
+            std::memcpy( CMSG_DATA( c ), &size, sizeof(size) );
+
+            ssize_t res = ::sendmsg( sock_.native_handle( ), &hdr,
+                                     MSG_DONTWAIT );
+            if( res >= 0 ) {
+                return static_cast<std::size_t>(res);
+            }
+            if( ( errno != EIO ) && ( errno != EINVAL ) &&
+                ( errno != ENOPROTOOPT ) && ( errno != EOPNOTSUPP ) )
+            {
+                ec.assign( errno, bs::system_category( ) );
+                return 0;
+            }
+            /// no GSO here (old kernel or no checksum offload)
+            gso_ok_.store( false, std::memory_order_relaxed );
+        }
+
+        mmsghdr hdrs[gso_max_segments];
+        iovec   iovs[gso_max_segments];
+        std::size_t count = 0;
+        for( std::size_t off = 0; off < chunk; off += seg, ++count ) {
+            iovs[count].iov_base = const_cast<std::uint8_t *>(data + off);
+            iovs[count].iov_len  = std::min( seg, chunk - off );
+            msghdr &hdr( hdrs[count].msg_hdr );
+            hdr = msghdr( );
+            hdr.msg_name    = const_cast<sockaddr *>(to.data( ));
+            hdr.msg_namelen = static_cast<socklen_t>(to.size( ));
+            hdr.msg_iov     = &iovs[count];
+            hdr.msg_iovlen  = 1;
+        }
+
+        int res = ::sendmmsg( sock_.native_handle( ), hdrs,
+                              static_cast<unsigned>(count), MSG_DONTWAIT );
+        if( res < 0 ) {
+            ec.assign( errno, bs::system_category( ) );
+            return 0;
+        }
+        return std::min( len, static_cast<std::size_t>(res) * seg );
+    }
+#else
+    std::size_t send_segments( const std::uint8_t *data, std::size_t len,
+                               std::size_t seg,
+                               const ba::ip::udp::endpoint &to,
+                               bs::error_code &ec )
+    {
+        sock_.non_blocking( true );
+        std::size_t sent = 0;
+        while( ( sent < len ) && !ec ) {
+            sent += sock_.send_to( ba::buffer( data + sent,
+                                          std::min( seg, len - sent ) ),
+                                   to, 0, ec );
+        }
+        return sent;
+    }
+#endif
+
+    static std::size_t segments( const segmented_write &sw )
+    {
+        return sw.segment_ ? ( sw.sent_ + sw.segment_ - 1 ) / sw.segment_
+                           : 1;
+    }
+
+    /// sends what the socket takes and waits for it to become
+    /// writable for the rest
+    void segmented_send( segmented_write &sw, bool direct )
+    {
+        bs::error_code ec;
+        while( ( sw.sent_ < sw.length_ ) && !ec ) {
+            sw.sent_ += send_segments( sw.data_ + sw.sent_,
+                                       sw.length_ - sw.sent_,
+                                       sw.segment_, sw.to_, ec );
+        }
+
+        if( ( ec == ba::error::would_block ) ||
+            ( ec == ba::error::try_again ) )
+        {
+            sock_.async_send( ba::null_buffers( ), 0,
+                dispatcher_.wrap( make_alloc_handler( write_mem_, sw ) ) );
+        } else if( direct ) {
+            written( ec, sw.sent_, segments( sw ) );
+        } else {
+            write_done done = { this, ec, sw.sent_, segments( sw ) };
+            dispatcher_.post( make_alloc_handler( write_mem_, done ) );
+        }
+    }
+
+    void segmented_handler( segmented_write &sw, const bs::error_code &err )
+    {
+        if( err ) {
+            written( err, sw.sent_, segments( sw ) );
+        } else {
+            segmented_send( sw, true );
+        }
+    }
+
+    void push_write( const char *data, size_t len,
+                     const ba::ip::udp::endpoint &to )
+    {
+        pending_write pw = { to, send_data_.size( ), len, buffer_handle( ) };
+        send_data_.insert( send_data_.end( ), data, data + len );
+        send_queue_.push_back( std::move(pw) );
+        pushed( len );
+    }
+
+    void push_write( const buffer_handle &buf,
+                     const ba::ip::udp::endpoint &to )
+    {
+        pending_write pw = { to, 0, buf.size( ), buf };
+        send_queue_.push_back( std::move(pw) );
+        pushed( buf.size( ) );
+    }
+
+    static const char *pending_data( pending_write &pw,
+                                     std::vector<char> &arena )
+    {
+        return pw.buffer
+             ? reinterpret_cast<const char *>(pw.buffer.data( ))
+             : &arena[pw.offset];
+    }
+
+    void pushed( size_t len )
+    {
+        send_bytes_ += len;
+
+        if( send_blocked_ || send_flushing_ ) {
+            return;
+        }
+
+        if( ( send_queue_.size( ) - send_head_ >= send_max_count_ ) ||
+            ( send_bytes_ >= send_max_bytes_ ) )
+        {
+            flush_impl( );
+        } else if( !send_scheduled_ ) {
+            /// one flush per reactor turn
+            send_scheduled_ = true;
+            flush_call call = { this };
+            dispatcher_.post( make_alloc_handler( send_mem_, call ) );
+        }
+    }
+
+    void flush_handler( )
+    {
+        send_scheduled_ = false;
+        if( !send_blocked_ ) {
+            flush_impl( );
+        }
+    }
+
+    void writable_handler( const bs::error_code &err, std::size_t )
+    {
+        send_blocked_ = false;
+        if( err ) {
+            send_flushing_ = true;
+            while( send_head_ < send_queue_.size( ) ) {
+                written( err, 0 );
+                ++send_head_;
+            }
+            send_flushing_ = false;
+            reset_writes( );
+        } else {
+            flush_impl( );
+        }
+    }
+
+    void wait_writable( )
+    {
+        send_blocked_ = true;
+        sock_.async_send( ba::null_buffers( ), 0,
+            dispatcher_.wrap(
+                make_handler<&basic_udp_endpoint::writable_handler>( send_mem_ )
+            ) );
+    }
+
+    void reset_writes( )
+    {
+        send_queue_.clear( );
+        send_data_.clear( );
+        send_head_  = 0;
+        send_bytes_ = 0;
+    }
+
+#if defined(__linux__)
+    /// returns number of sent messages or -1 and sets ec
+    int send_batch( std::size_t first, std::size_t count,
+                    bs::error_code &ec )
+    {
+        if( send_hdrs_.size( ) < count ) {
+            send_hdrs_.resize( count );
+            send_iovs_.resize( count );
+        }
+
+        for( std::size_t i = 0; i < count; ++i ) {
+            pending_write &pw( send_queue_[first + i] );
+
+            send_iovs_[i].iov_base =
+                    const_cast<char *>(pending_data( pw, send_data_ ));
+            send_iovs_[i].iov_len  = pw.length;
+
+            msghdr &hdr( send_hdrs_[i].msg_hdr );
+            hdr = msghdr( );
+            hdr.msg_name    = pw.to.data( );
+            hdr.msg_namelen = static_cast<socklen_t>(pw.to.size( ));
+            hdr.msg_iov     = &send_iovs_[i];
+            hdr.msg_iovlen  = 1;
+        }
+
+        int res = ::sendmmsg( sock_.native_handle( ), &send_hdrs_[0],
+                              static_cast<unsigned>(count), MSG_DONTWAIT );
+        if( res < 0 ) {
+            ec.assign( errno, bs::system_category( ) );
+        }
+        return res;
+    }
+#else
+    int send_batch( std::size_t first, std::size_t count,
+                    bs::error_code &ec )
+    {
+        sock_.non_blocking( true );
+        std::size_t sent = 0;
+        for( ; sent < count; ++sent ) {
+            pending_write &pw( send_queue_[first + sent] );
+            sock_.send_to( ba::buffer( pending_data( pw, send_data_ ),
+                                       pw.length ),
+                           pw.to, 0, ec );
+            if( ec ) {
+                break;
+            }
+        }
+        return ( sent || !ec ) ? static_cast<int>(sent) : -1;
+    }
+#endif
+
+    void flush_impl( )
+    {
+#if defined(UDP_ENDPOINT_IO_URING)
+        if( uring_ ) {
+            uring_flush( );
+            return;
+        }
+#endif
+        send_flushing_ = true;
+
+        while( send_head_ < send_queue_.size( ) ) {
+
+            std::size_t count = std::min( send_queue_.size( ) - send_head_,
+                                          send_max_count_ );
+            bs::error_code ec;
+            int res = send_batch( send_head_, count, ec );
+
+            if( res < 0 ) {
+                if( ( ec == ba::error::would_block ) ||
+                    ( ec == ba::error::try_again ) )
+                {
+                    send_flushing_ = false;
+                    wait_writable( );
+                    return;
+                }
+                /// the first message failed; report and drop it
+                ++send_head_;
+                written( ec, 0 );
+                continue;
+            }
+
+            std::size_t first = send_head_;
+            send_head_ += static_cast<std::size_t>(res);
+            for( std::size_t i = first; i < send_head_; ++i ) {
+                written( ec, send_queue_[i].length );
+            }
+        }
+
+        send_flushing_ = false;
+        reset_writes( );
+    }
+
+#if defined(UDP_ENDPOINT_IO_URING)
+
+    struct uring_deliver_call {
+        basic_udp_endpoint *self_;
+        void operator ( )( ) const
+        {
+            self_->uring_deliver( );
+        }
+    };
+
+    io_uring_sqe *uring_sqe( )
+    {
+        io_uring_sqe *sqe = uring_->ring.get_sqe( );
+        if( !sqe ) {
+            uring_->ring.submit( );
+            sqe = uring_->ring.get_sqe( );
+        }
+        return sqe;
+    }
+
+    void uring_submit( )
+    {
+        while( uring_->ring.submit( ) == -EINTR ) { }
+    }
+
+    /// the previous buffer goes back to the kernel unless it was kept
+    void uring_give_buffer( std::uint16_t bid, buffer_handle buf )
+    {
+        fresh_buffer( buf );
+        uring_->ring.add_buffer( buf.data( ),
+                                 static_cast<unsigned>(buf.capacity( )), bid );
+        uring_->bufs[bid] = std::move(buf);
+    }
+
+    void uring_arm_recv( )
+    {
+        uring_state &st( *uring_ );
+        if( !st.primed ) {
+            st.primed = true;
+            for( std::size_t i = 0; i < st.bufs.size( ); ++i ) {
+                uring_give_buffer( static_cast<std::uint16_t>(i),
+                                   buffer_handle( ) );
+            }
+            st.ring.commit_buffers( );
+        }
+        uring::prep_recvmsg_multishot( uring_sqe( ), sock_.native_handle( ),
+                                       &st.recv_msg, uring_state::BUF_GROUP,
+                                       uring_state::TAG_RECV );
+        st.recv_armed = true;
+        uring_submit( );
+    }
+
+    void uring_wait( )
+    {
+        if( uring_->waiting ) {
+            return;
+        }
+        uring_->waiting = true;
+        uring_->watch.async_read_some( ba::null_buffers( ),
+            dispatcher_.wrap(
+                make_handler<&basic_udp_endpoint::uring_handler>( uring_->mem )
+            ) );
+    }
+
+    void uring_read( )
+    {
+        uring_state &st( *uring_ );
+        st.read_wanted = true;
+        if( st.delivering ) {
+            return; /// uring_deliver continues when it is done
+        }
+        if( !st.ready.empty( ) || st.recv_error ) {
+            uring_deliver_call call = { this };
+            dispatcher_.post( make_alloc_handler( st.mem, call ) );
+            return;
+        }
+        if( !st.recv_armed ) {
+            uring_arm_recv( );
+        }
+        uring_wait( );
+    }
+
+    void uring_recv_complete( const io_uring_cqe &cqe )
+    {
+        uring_state &st( *uring_ );
+        if( !( cqe.flags & IORING_CQE_F_MORE ) ) {
+            st.recv_armed = false;
+        }
+
+        if( cqe.res < 0 ) {
+            if( ( cqe.res == -EINVAL ) && !st.received ) {
+                st.recv_ok = false; /// no multishot recvmsg; use the reactor
+            } else if( cqe.res != -ENOBUFS && cqe.res != -ECANCELED ) {
+                st.recv_error.assign( -cqe.res, bs::system_category( ) );
+            }
+            return;
+        }
+
+        std::uint16_t bid = static_cast<std::uint16_t>(
+                                    cqe.flags >> IORING_CQE_BUFFER_SHIFT );
+
+        st.received = true;
+
+        /// layout: io_uring_recvmsg_out, name, payload
+        datagram d;
+        d.buffer = std::move(st.bufs[bid]);
+        std::uint8_t *base = d.buffer.data( );
+        io_uring_recvmsg_out out;
+        std::memcpy( &out, base, sizeof(out) );
+
+        std::size_t head = sizeof(out) + st.recv_msg.msg_namelen;
+
+        /// a cut datagram is dropped as on the reactor path
+        if( ( out.flags & MSG_TRUNC )
+         || ( out.payloadlen > d.buffer.capacity( ) - head ) )
+        {
+            ++truncated_;
+            if( metrics_ ) {
+                metrics_->add( endpoint_metrics::TRUNCATED );
+            }
+            uring_give_buffer( bid, std::move(d.buffer) );
+            st.ring.commit_buffers( );
+            return;
+        }
+
+        std::size_t namelen = std::min<std::size_t>( out.namelen,
+                                                     d.from.capacity( ) );
+        std::memcpy( d.from.data( ), base + sizeof(out), namelen );
+        d.from.resize( namelen );
+
+        d.data   = base + head;
+        d.length = out.payloadlen;
+        d.buffer.resize( head + d.length );
+
+        st.ready.push_back( std::move(d) );
+        st.ready_ids.push_back( bid );
+    }
+
+    void uring_send_complete( const io_uring_cqe &cqe )
+    {
+        uring_state &st( *uring_ );
+        --st.sent_left;
+        if( !st.closing ) {
+            bs::error_code ec;
+            if( cqe.res < 0 ) {
+                ec.assign( -cqe.res, bs::system_category( ) );
+            }
+            written( ec, cqe.res < 0 ? 0 : std::size_t(cqe.res) );
+        }
+        if( 0 == st.sent_left ) {
+            st.sent.clear( );
+            st.sent_data.clear( );
+            send_blocked_ = false;
+        }
+    }
+
+    void uring_reap( )
+    {
+        uring_->ring.reap( [this]( const io_uring_cqe &cqe ) {
+            switch( cqe.user_data ) {
+            case uring_state::TAG_RECV:
+                uring_recv_complete( cqe );
+                break;
+            case uring_state::TAG_SEND:
+                uring_send_complete( cqe );
+                break;
+            default:
+                break;
+            }
+        } );
+    }
+
+    void uring_handler( const bs::error_code &err, std::size_t )
+    {
+        uring_state &st( *uring_ );
+        st.waiting = false;
+        if( err == ba::error::operation_aborted ) {
+            return;
+        }
+
+        uring_reap( );
+
+        if( !send_blocked_ && ( send_head_ < send_queue_.size( ) ) ) {
+            flush_impl( );
+        }
+
+        if( !st.recv_ok && st.read_wanted ) {
+            st.read_wanted = false;
+            read_batch( );
+        }
+
+        if( st.recv_ok && !st.recv_armed && st.read_wanted
+                       && st.ready.empty( ) )
+        {
+            uring_arm_recv( );
+        }
+
+        uring_deliver( );
+
+        if( st.recv_armed || st.sent_left ) {
+            uring_wait( );
+        }
+    }
+
+    void uring_deliver( )
+    {
+        uring_state &st( *uring_ );
+        if( !st.read_wanted || st.delivering ) {
+            return;
+        }
+
+        if( st.recv_error && st.ready.empty( ) ) {
+            bs::error_code ec( st.recv_error );
+            st.recv_error.clear( );
+            st.read_wanted = false;
+            received_batch( ec, nullptr, 0 );
+            return;
+        }
+
+        if( st.ready.empty( ) ) {
+            return;
+        }
+
+        std::size_t count = st.ready.size( );
+        if( batch_size_ && ( batch_size_ < count ) ) {
+            count = batch_size_;
+        }
+
+        st.read_wanted = false;
+        st.delivering  = true;
+        received_batch( bs::error_code( ), &st.ready[0], count );
+        st.delivering  = false;
+
+        for( std::size_t i = 0; i < count; ++i ) {
+            uring_give_buffer( st.ready_ids[i],
+                               std::move(st.ready[i].buffer) );
+        }
+        st.ring.commit_buffers( );
+        st.ready.erase( st.ready.begin( ), st.ready.begin( ) + count );
+        st.ready_ids.erase( st.ready_ids.begin( ),
+                            st.ready_ids.begin( ) + count );
+
+        if( st.read_wanted ) {
+            st.read_wanted = false;
+            uring_read( );
+        }
+    }
+
+    /// hands the whole queue to the kernel; the next flush waits for
+    /// all of its completions
+    void uring_flush( )
+    {
+        uring_state &st( *uring_ );
+        std::size_t count = send_queue_.size( ) - send_head_;
+        if( 0 == count ) {
+            reset_writes( );
+            return;
+        }
+
+        st.sent.assign( std::make_move_iterator( send_queue_.begin( )
+                                                + send_head_ ),
+                        std::make_move_iterator( send_queue_.end( ) ) );
+        st.sent_data.swap( send_data_ );
+        reset_writes( );
+
+        st.sent_hdrs.resize( count );
+        st.sent_iovs.resize( count );
+        for( std::size_t i = 0; i < count; ++i ) {
+            pending_write &pw( st.sent[i] );
+
+            st.sent_iovs[i].iov_base =
+                    const_cast<char *>(pending_data( pw, st.sent_data ));
+            st.sent_iovs[i].iov_len  = pw.length;
+
+            msghdr &hdr( st.sent_hdrs[i] );
+            hdr = msghdr( );
+            hdr.msg_name    = pw.to.data( );
+            hdr.msg_namelen = static_cast<socklen_t>(pw.to.size( ));
+            hdr.msg_iov     = &st.sent_iovs[i];
+            hdr.msg_iovlen  = 1;
+
+            uring::prep_sendmsg( uring_sqe( ), sock_.native_handle( ),
+                                 &hdr, uring_state::TAG_SEND );
+        }
+
+        st.sent_left  = count;
+        send_blocked_ = true;
+        uring_submit( );
+        uring_wait( );
+    }
+
+    /// cancels the receive and waits for the kernel to let go of
+    /// every buffer; no callbacks are made
+    void uring_close( )
+    {
+        uring_state &st( *uring_ );
+        st.closing = true;
+        if( st.recv_armed ) {
+            uring::prep_cancel_fd( uring_sqe( ), sock_.native_handle( ) );
+        }
+        while( st.recv_armed || st.sent_left ) {
+            if( st.ring.submit( 1 ) < 0 && errno != EINTR ) {
+                break;
+            }
+            uring_reap( );
+        }
     }
 
-    void read_handler2( const bs::error_code &err,
-                        std::size_t len,
-                        std::shared_ptr<ba::ip::udp::endpoint> from )
+#endif
+
+    void set_write_batch_impl( size_t count, size_t bytes )
     {
-        on_read( err, *from, &data_[0], len );
+        send_max_count_ = count ? count : 1;
+        send_max_bytes_ = bytes;
     }
 
     void set_buf_size( size_t len )
     {
-        data_.resize( len );
+        pool_.set_slab_size( len );
+    }
+
+    void set_batch( size_t count )
+    {
+        batch_size_ = count;
+    }
+
+    void set_gro_impl( bool value )
+    {
+        gro_ = value;
     }
 
 public:
 
-    udp_endpoint( ba::io_service &ios )
+    basic_udp_endpoint( ba::io_service &ios )
         :ios_(ios)
         ,dispatcher_(ios_)
         ,sock_(ios_)
-        ,data_(4096)
+        ,pool_(4096)
+        ,reuse_port_(false)
+        ,batch_size_(0)
+        ,truncated_(0)
+        ,metrics_(nullptr)
+        ,metrics_tick_(0)
+        ,gro_(false)
+        ,gso_ok_(true)
+        ,send_head_(0)
+        ,send_bytes_(0)
+        ,send_max_count_(64)
+        ,send_max_bytes_(64 * 1024)
+        ,send_scheduled_(false)
+        ,send_blocked_(false)
+        ,send_flushing_(false)
     { }
 
+protected:
+
+    ~basic_udp_endpoint( )
+    {
+#if defined(UDP_ENDPOINT_IO_URING)
+        if( uring_ ) {
+            uring_close( );
+        }
+#endif
+    }
+
+    Derived &derived( )
+    {
+        return static_cast<Derived &>(*this);
+    }
+
+public:
+
+
+    /// moves read_batch( ) and the send queue to io_uring: one multishot
+    /// recvmsg over provided pool buffers and batched sendmsg entries.
+    /// Call before start( ); false if the backend is not built in or the
+    /// kernel lacks it, and the reactor path stays in use. The payload
+    /// room of a pooled buffer shrinks by 44 bytes of recvmsg header
+    bool use_io_uring( unsigned entries = 256 )
+    {
+#if defined(UDP_ENDPOINT_IO_URING)
+        unsigned size = 1;
+        while( size < entries ) {
+            size <<= 1;
+        }
+        std::unique_ptr<uring_state> st(new uring_state(ios_));
+        if( st->ring.open( size )
+         && st->ring.setup_buffers( size, uring_state::BUF_GROUP ) )
+        {
+            st->watch.assign( st->ring.fd( ) );
+            st->bufs.resize( size );
+            st->ready.reserve( size );
+            st->ready_ids.reserve( size );
+            uring_ = std::move(st);
+            return true;
+        }
+#else
+        (void)entries;
+#endif
+        return false;
+    }
+
+    bool io_uring_active( ) const
+    {
+#if defined(UDP_ENDPOINT_IO_URING)
+        return uring_ != nullptr;
+#else
+        return false;
+#endif
+    }
+
     const std::uint8_t *get_data( ) const
     {
-        return &data_[0];
+        return rbuf_ ? rbuf_.data( ) : nullptr;
+    }
+
+    /// buffer of the current on_read; copy the handle to keep the data
+    const buffer_handle &read_buffer( ) const
+    {
+        return rbuf_;
+    }
+
+    /// the socket's own pool; use it from the endpoint's strand
+    buffer_pool &get_pool( )
+    {
+        return pool_;
     }
 
     void set_buffer_size( size_t len )
     {
-        dispatch( std::bind( &udp_endpoint::set_buf_size, this, len ) );
+        dispatch( std::bind( &basic_udp_endpoint::set_buf_size, this, len ) );
+    }
+
+    /// number of datagrams read_batch drains per wakeup; 0 disables.
+    /// Applied at once, so start( ) sees it: call it before start( )
+    /// or from the endpoint's thread
+    void set_batch_size( size_t count )
+    {
+        set_batch( count );
+    }
+
+    size_t batch_size( ) const
+    {
+        return batch_size_;
+    }
+
+    /// batched datagrams dropped for not fitting the read buffer,
+    /// on either backend
+    std::uint64_t truncated( ) const
+    {
+        return truncated_.load( std::memory_order_relaxed );
+    }
+
+    /// datagrams the kernel dropped for this socket (full receive
+    /// buffer); 0 where SO_MEMINFO is missing
+    std::uint64_t receive_drops( )
+    {
+#if defined(__linux__) && defined(SO_MEMINFO)
+        std::uint32_t info[16] = { };
+        socklen_t len = sizeof(info);
+        if( 0 == ::getsockopt( sock_.native_handle( ), SOL_SOCKET,
+                               SO_MEMINFO, info, &len ) )
+        {
+            /// SK_MEMINFO_DROPS
+            return ( len > 8 * sizeof(info[0]) ) ? info[8] : 0;
+        }
+#endif
+        return 0;
+    }
+
+    /// counts packets, bytes, errors and handler time into metrics
+    /// (nullptr: stop); it has to outlive the endpoint or be unset.
+    /// Call from the endpoint's thread
+    void set_metrics( endpoint_metrics *metrics )
+    {
+        metrics_ = metrics;
+    }
+
+    endpoint_metrics *metrics( ) const
+    {
+        return metrics_;
     }
 
     ba::ip::udp::endpoint &get_endpoint( )
@@ -76,6 +1322,34 @@ public:
         sock_.open( ba::ip::udp::v6( ) );
     }
 
+    /// lets several sockets bind the same address; must be set before bind
+    void set_reuse_port( bool value )
+    {
+        reuse_port_ = value;
+    }
+
+    bool reuse_port( ) const
+    {
+        return reuse_port_;
+    }
+
+    /// opens the socket for the endpoint's family and binds it
+    void bind( const ba::ip::udp::endpoint &ep )
+    {
+        ep.address( ).is_v4( ) ? open_v4( ) : open_v6( );
+        if( reuse_port_ ) {
+#if defined(SO_REUSEPORT)
+            typedef ba::detail::socket_option::boolean<SOL_SOCKET,
+                                                       SO_REUSEPORT> option;
+            sock_.set_option( option( true ) );
+#else
+            throw bs::system_error( ba::error::operation_not_supported,
+                                    "SO_REUSEPORT" );
+#endif
+        }
+        sock_.bind( ep );
+    }
+
     ba::io_service &get_io_service( )
     {
         return ios_;
@@ -91,11 +1365,26 @@ public:
         return sock_;
     }
 
+    /// stops reading and writing: pending operations complete with
+    /// operation_aborted (io_uring ones are dropped without a call).
+    /// From the endpoint's thread; the endpoint is not reopened
+    void close( )
+    {
+        bs::error_code ec;
+#if defined(UDP_ENDPOINT_IO_URING)
+        if( uring_ ) {
+            uring_close( );
+            uring_->watch.cancel( ec );
+        }
+#endif
+        sock_.close( ec );
+    }
+
     void write( const char *data, size_t len )
     {
         sock_.async_send( ba::buffer(data, len), 0,
             dispatcher_.wrap(
-                std::bind( &udp_endpoint::write_handler, this, ph::_1, ph::_2 )
+                make_handler<&basic_udp_endpoint::write_handler>( write_mem_ )
             ) );
     }
 
@@ -104,41 +1393,265 @@ public:
     {
         sock_.async_send_to( ba::buffer(data, len), to, 0,
             dispatcher_.wrap(
-                std::bind( &udp_endpoint::write_handler, this, ph::_1, ph::_2 )
+                make_handler<&basic_udp_endpoint::write_handler>( write_mem_ )
             ) );
     }
 
+    /// copies the message to the socket's send queue; the queue is
+    /// flushed with sendmmsg once per reactor turn or when it reaches
+    /// the count or byte limit. on_write is called for every message
+    void queue_write_to( const char *data, size_t len,
+                         const ba::ip::udp::endpoint &to )
+    {
+        if( dispatcher_.running_in_this_thread( ) ) {
+            push_write( data, len, to );
+        } else {
+            auto msg = std::make_shared<std::string>( data, len );
+            dispatch( [this, msg, to]( ) {
+                push_write( msg->data( ), msg->size( ), to );
+            } );
+        }
+    }
+
+    /// queues the buffer itself; no copy is made
+    void queue_write_to( const buffer_handle &buf,
+                         const ba::ip::udp::endpoint &to )
+    {
+        if( dispatcher_.running_in_this_thread( ) ) {
+            push_write( buf, to );
+        } else {
+            dispatch( [this, buf, to]( ) {
+                push_write( buf, to );
+            } );
+        }
+    }
+
+    /// sends queued messages now instead of at the end of the turn
+    void flush_writes( )
+    {
+        dispatch( [this]( ) {
+            if( !send_blocked_ && !send_flushing_ ) {
+                flush_impl( );
+            }
+        } );
+    }
+
+    void set_write_batch( size_t count, size_t bytes )
+    {
+        dispatch( std::bind( &basic_udp_endpoint::set_write_batch_impl, this,
+                             count, bytes ) );
+    }
+
+    void write( const buffer_handle &buf )
+    {
+        buffer_write_handler h = { this, buf };
+        sock_.async_send( buf.buffer( ), 0,
+            dispatcher_.wrap( make_alloc_handler( write_mem_, h ) ) );
+    }
+
+    void write_to( const buffer_handle &buf,
+                   const ba::ip::udp::endpoint &to )
+    {
+        buffer_write_handler h = { this, buf };
+        sock_.async_send_to( buf.buffer( ), to, 0,
+            dispatcher_.wrap( make_alloc_handler( write_mem_, h ) ) );
+    }
+
+    /// sends len bytes as datagrams of segment bytes each (the last may
+    /// be shorter). With UDP_SEGMENT the kernel does the split, up to 64
+    /// segments per syscall; without it every segment is one message
+    /// of a sendmmsg. on_write is called once with the bytes sent.
+    /// The data must stay valid until then
+    void write_to_segmented( const char *data, size_t len, size_t segment,
+                             const ba::ip::udp::endpoint &to )
+    {
+        segmented_write sw = { this,
+                               reinterpret_cast<const std::uint8_t *>(data),
+                               len, segment ? segment : len, 0, to,
+                               buffer_handle( ) };
+        segmented_send( sw, false );
+    }
+
+    void write_to_segmented( const buffer_handle &buf, size_t segment,
+                             const ba::ip::udp::endpoint &to )
+    {
+        segmented_write sw = { this, buf.data( ), buf.size( ),
+                               segment ? segment : buf.size( ), 0, to, buf };
+        segmented_send( sw, false );
+    }
+
+    /// lets the kernel coalesce datagrams of one flow (UDP_GRO, linux
+    /// 5.0); read_batch( ) splits them before on_read_batch and the
+    /// segments share one buffer. Other reads and the io_uring backend
+    /// do not split, so enable it only with read_batch( ). Call after
+    /// bind( ); raises the buffer size to 64K. false if unsupported
+    bool set_gro( bool value )
+    {
+#if defined(__linux__)
+        if( io_uring_active( ) ) {
+            return false;
+        }
+        int opt = value ? 1 : 0;
+        if( ::setsockopt( sock_.native_handle( ), SOL_UDP, UDP_GRO,
+                          &opt, sizeof(opt) ) < 0 )
+        {
+            return false;
+        }
+        if( value ) {
+            set_buffer_size( 65536 );
+        }
+        dispatch( std::bind( &basic_udp_endpoint::set_gro_impl, this, value ) );
+        return true;
+#else
+        (void)value;
+        return false;
+#endif
+    }
+
+    /// SO_BUSY_POLL: blocking receives and epoll poll the device queue
+    /// for up to usec before sleeping; prefer adds SO_PREFER_BUSY_POLL
+    /// (linux 5.11). Call after bind( ); false if refused (more than
+    /// net.core.busy_read needs CAP_NET_ADMIN) or unsupported
+    bool set_busy_poll( unsigned usec, bool prefer = false )
+    {
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+        int opt = static_cast<int>(usec);
+        if( ::setsockopt( sock_.native_handle( ), SOL_SOCKET, SO_BUSY_POLL,
+                          &opt, sizeof(opt) ) < 0 )
+        {
+            return false;
+        }
+        if( prefer ) {
+            opt = 1;
+            return ::setsockopt( sock_.native_handle( ), SOL_SOCKET,
+                                 SO_PREFER_BUSY_POLL, &opt, sizeof(opt) ) == 0;
+        }
+        return true;
+#else
+        (void)usec;
+        (void)prefer;
+        return false;
+#endif
+    }
+
+    /// SO_INCOMING_CPU: in a SO_REUSEPORT group the kernel prefers the
+    /// socket of the cpu that handles the packet's RX queue, so a
+    /// datagram stays on the core (and NUMA node) its IRQ hit
+    bool set_incoming_cpu( int cpu )
+    {
+#if defined(__linux__)
+        return ::setsockopt( sock_.native_handle( ), SOL_SOCKET,
+                             SO_INCOMING_CPU, &cpu, sizeof(cpu) ) == 0;
+#else
+        (void)cpu;
+        return false;
+#endif
+    }
+
     void read(  )
     {
-        sock_.async_receive( ba::buffer(&data_[0], data_.size( )),
+        fresh_buffer( rbuf_ );
+        sock_.async_receive( ba::buffer(rbuf_.data( ), rbuf_.capacity( )),
+                dispatcher_.wrap(
+                    make_handler<&basic_udp_endpoint::read_handler>( read_mem_ )
+                ) );
+    }
+
+    /// the sender's endpoint is stored in a member and passed to on_read;
+    /// the argument is kept for compatibility
+    void read_from( const ba::ip::udp::endpoint & /*from*/ )
+    {
+        fresh_buffer( rbuf_ );
+        sock_.async_receive_from( ba::buffer(rbuf_.data( ), rbuf_.capacity( )),
+                                  from_, 0,
+                dispatcher_.wrap(
+                    make_handler<&basic_udp_endpoint::read_handler2>(
+                                                            read_mem_ )
+                ) );
+    }
+
+    /// waits for the socket to become readable and then drains
+    /// up to batch_size( ) datagrams at once (recvmmsg on linux)
+    void read_batch( )
+    {
+        if( !batch_size_ ) {
+            batch_size_ = 1; /// asked for batches without a size
+        }
+#if defined(UDP_ENDPOINT_IO_URING)
+        if( uring_ && uring_->recv_ok ) {
+            uring_read( );
+            return;
+        }
+#endif
+        sock_.async_receive( ba::null_buffers( ), 0,
                 dispatcher_.wrap(
-                    std::bind( &udp_endpoint::read_handler, this,
-                               ph::_1, ph::_2 )
+                    make_handler<&basic_udp_endpoint::batch_handler>(
+                                                            read_mem_ )
                 ) );
     }
 
-    void read_from( ba::ip::udp::endpoint from )
+    /// defaults for Derived; hide them to handle the events
+    void on_write( const bs::error_code &, std::size_t ) { }
+
+    /// forwards every datagram to Derived::on_read;
+    /// hide it to re-arm with read_batch( ) once per batch
+    void on_read_batch( const bs::error_code &err,
+                        datagram *dgrams, std::size_t count )
     {
-        auto ep = std::make_shared<ba::ip::udp::endpoint>(std::move(from));
-        sock_.async_receive_from( ba::buffer(&data_[0], data_.size( )), *ep, 0,
-                            dispatcher_.wrap(
-                                std::bind( &udp_endpoint::read_handler2, this,
-                                            ph::_1, ph::_2, ep )
-                            ) );
+        if( err ) {
+            derived( ).on_read( err, remote_, nullptr, 0 );
+            return;
+        }
+        for( std::size_t i = 0; i < count; ++i ) {
+            derived( ).on_read( err, dgrams[i].from,
+                                dgrams[i].data, dgrams[i].length );
+        }
     }
 
+};
+
+/// the virtual interface over basic_udp_endpoint: one indirect call
+/// per completion
+class udp_endpoint: public basic_udp_endpoint<udp_endpoint> {
+
+public:
+
+    udp_endpoint( ba::io_service &ios )
+        :basic_udp_endpoint(ios)
+    { }
+
+    virtual ~udp_endpoint( ) { }
+
     virtual void on_write( const bs::error_code &, std::size_t ) { }
     virtual void start( ) = 0;
+
+    /// closes the socket; override to stop whatever else start( ) began
+    virtual void stop( )
+    {
+        close( );
+    }
+
     virtual void on_read( const bs::error_code &,
                           const ba::ip::udp::endpoint &from,
                           std::uint8_t *, std::size_t ) = 0;
 
+    /// default forwards every datagram to on_read;
+    /// override it to re-arm with read_batch( ) once per batch
+    virtual void on_read_batch( const bs::error_code &err,
+                                datagram *dgrams, std::size_t count )
+    {
+        basic_udp_endpoint::on_read_batch( err, dgrams, count );
+    }
 };
 
 class udp_connector: public udp_endpoint {
 
     ba::ip::udp::endpoint ep_;
 
+    std::unique_ptr<fec_encoder> fec_tx_;
+    std::unique_ptr<fec_decoder> fec_rx_;
+    ba::ip::udp::endpoint        fec_from_;
+
 public:
 
     using read_signal = std::function<void (const ba::ip::udp::endpoint &,
@@ -165,6 +1678,49 @@ public:
         ep_.address( ).is_v4( ) ? open_v4( ) : open_v6( );
     }
 
+    /// m parity datagrams per k in both directions; the peer has to use
+    /// it too. Datagrams without the FEC header still pass. k = 0 is off
+    void set_fec( unsigned k, unsigned m, std::size_t max_payload = 1400 )
+    {
+        if( !k ) {
+            fec_tx_.reset( );
+            fec_rx_.reset( );
+            return;
+        }
+        fec_tx_.reset( new fec_encoder(
+            [this]( const std::uint8_t *data, std::size_t len ) {
+                queue_write_to( reinterpret_cast<const char *>(data),
+                                len, ep_ );
+            }, k, m, max_payload ) );
+        fec_rx_.reset( new fec_decoder(
+            [this]( std::uint8_t *data, std::size_t len, bool ) {
+                on_read_sig( fec_from_, data, len );
+            }, max_payload ) );
+    }
+
+    /// queues to endpoint( ), through FEC when it is on
+    void send( const char *data, size_t len )
+    {
+        if( fec_tx_ ) {
+            fec_tx_->send( reinterpret_cast<const std::uint8_t *>(data), len );
+        } else {
+            queue_write_to( data, len, ep_ );
+        }
+    }
+
+    /// parity for what was sent since the last full group
+    void flush_fec( )
+    {
+        if( fec_tx_ ) {
+            fec_tx_->flush( );
+        }
+    }
+
+    const fec_decoder *fec( ) const
+    {
+        return fec_rx_.get( );
+    }
+
     void on_write( const bs::error_code &, std::size_t )
     {
 
@@ -174,9 +1730,16 @@ public:
                   const ba::ip::udp::endpoint &from,
                   std::uint8_t *data, std::size_t len )
     {
-        if( !err ) {
-            on_read_sig( from, data, len );
+        if( err ) {
+            return;
+        }
+        if( fec_rx_ ) {
+            fec_from_ = from;
+            if( fec_rx_->on_packet( data, len ) ) {
+                return;
+            }
         }
+        on_read_sig( from, data, len );
     }
 };
 
@@ -202,8 +1765,7 @@ public:
 
     void start( ) override
     {
-        ep_.address( ).is_v4( ) ? open_v4( ) : open_v6( );
-        get_socket( ).bind( ep_ );
+        bind( ep_ );
         read_from( ep_ );
     }
 
@@ -225,4 +1787,54 @@ public:
 
 };
 
+/// udp_acceptor with the handler type known at compile time;
+/// handler( from, data, len ) is called inline for every datagram
+template <typename Handler, typename Threading = strand_threading>
+class basic_udp_acceptor:
+        public basic_udp_endpoint<basic_udp_acceptor<Handler, Threading>,
+                                  Threading> {
+
+    using base_type = basic_udp_endpoint<basic_udp_acceptor<Handler,
+                                                            Threading>,
+                                         Threading>;
+
+    ba::ip::udp::endpoint ep_;
+    Handler               handler_;
+
+public:
+
+    basic_udp_acceptor( ba::io_service &ios,
+                        const std::string &addr, std::uint16_t port,
+                        Handler handler )
+        :base_type(ios)
+        ,ep_(ba::ip::address::from_string( addr ), port)
+        ,handler_(std::move(handler))
+    { }
+
+    void start( )
+    {
+        this->bind( ep_ );
+        this->read_from( ep_ );
+    }
+
+    void on_read( const bs::error_code &err,
+                  const ba::ip::udp::endpoint &from,
+                  std::uint8_t *data, std::size_t len )
+    {
+        if( !err ) {
+            handler_( from, data, len );
+            this->read_from( ep_ );
+        }
+    }
+};
+
+template <typename Threading = strand_threading, typename Handler>
+std::shared_ptr<basic_udp_acceptor<Handler, Threading> >
+make_udp_acceptor( ba::io_service &ios, const std::string &addr,
+                   std::uint16_t port, Handler handler )
+{
+    return std::make_shared<basic_udp_acceptor<Handler, Threading> >(
+                        std::ref(ios), addr, port, std::move(handler) );
+}
+
 #endif // UDPWRAPPER_HPP
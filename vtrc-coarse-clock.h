@@ -0,0 +1,127 @@
+#ifndef VTRC_COARSE_CLOCK_H
+#define VTRC_COARSE_CLOCK_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#if defined(__linux__)
+#include <time.h>
+#endif
+
+#include "vtrc-delayed-call.h"
+
+namespace vtrc { namespace common { namespace timer {
+
+    /// monotonic microseconds cached in a relaxed atomic.
+    /// The owner calls update( ) once per loop iteration (or from a
+    /// coarse_clock_ticker); hot paths only call now( ).
+    class coarse_clock {
+
+    public:
+
+        enum source_type {
+            SOURCE_STEADY           = 0,  /// std::chrono::steady_clock
+            SOURCE_MONOTONIC_COARSE = 1   /// CLOCK_MONOTONIC_COARSE if any
+        };
+
+    private:
+
+        std::atomic<std::uint64_t>  now_;
+        source_type                 source_;
+
+    public:
+
+        explicit coarse_clock( source_type src = SOURCE_STEADY )
+            :source_(src)
+        {
+            now_.store( read( source_ ), std::memory_order_relaxed );
+        }
+
+        coarse_clock( const coarse_clock & ) = delete;
+        coarse_clock &operator = ( const coarse_clock & ) = delete;
+
+        static std::uint64_t read( source_type src )
+        {
+#if defined(CLOCK_MONOTONIC_COARSE)
+            if( src == SOURCE_MONOTONIC_COARSE ) {
+                timespec ts;
+                ::clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+                return std::uint64_t(ts.tv_sec) * 1000000
+                     + std::uint64_t(ts.tv_nsec) / 1000;
+            }
+#else
+            (void)src;
+#endif
+            using std::chrono::duration_cast;
+            using microsec = std::chrono::microseconds;
+            auto n = std::chrono::steady_clock::now( );
+            return duration_cast<microsec>(n.time_since_epoch( )).count( );
+        }
+
+        source_type source( ) const
+        {
+            return source_;
+        }
+
+        std::uint64_t update( )
+        {
+            std::uint64_t val = read( source_ );
+            now_.store( val, std::memory_order_relaxed );
+            return val;
+        }
+
+        std::uint64_t now( ) const
+        {
+            return now_.load( std::memory_order_relaxed );
+        }
+    };
+
+    /// refreshes a coarse_clock from the io_service every period
+    class coarse_clock_ticker {
+
+        coarse_clock                    &clock_;
+        delayed_call                     dcall_;
+        monotonic_traits::duration_type  period_;
+        bool                             running_;
+
+        void arm( )
+        {
+            dcall_.call_from_now( [this]( const boost::system::error_code &e )
+            {
+                if( !e && running_ ) {
+                    clock_.update( );
+                    arm( );
+                }
+            }, period_ );
+        }
+
+    public:
+
+        coarse_clock_ticker( boost::asio::io_service &ios,
+                             coarse_clock &clock,
+                     const monotonic_traits::duration_type &period =
+                                        monotonic_traits::milliseconds( 1 ) )
+            :clock_(clock)
+            ,dcall_(ios)
+            ,period_(period)
+            ,running_(false)
+        { }
+
+        void start( )
+        {
+            running_ = true;
+            clock_.update( );
+            arm( );
+        }
+
+        void stop( )
+        {
+            running_ = false;
+            dcall_.cancel( );
+        }
+    };
+
+}}}
+
+#endif // VTRCCOARSECLOCK_H
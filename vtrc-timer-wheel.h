@@ -0,0 +1,319 @@
+#ifndef VTRC_TIMER_WHEEL_H
+#define VTRC_TIMER_WHEEL_H
+
+#include <cstdint>
+#include <functional>
+
+#include "vtrc-delayed-call.h"
+
+namespace vtrc { namespace common {
+
+    /// hierarchical timer wheel (256 root slots + 3 levels of 64 slots).
+    /// schedule, refresh and cancel are O(1); expired hooks are fired in
+    /// one batch per tick. Not thread safe: use it from the thread that
+    /// runs the io_service.
+    class timer_wheel {
+
+        struct link {
+            link *prev_;
+            link *next_;
+        };
+
+    public:
+
+        class hook: private link {
+
+            friend class timer_wheel;
+
+            std::uint64_t           expires_;
+            std::function<void ()>  call_;
+
+            void link_before( link *head )
+            {
+                prev_ = head->prev_;
+                next_ = head;
+                head->prev_->next_ = this;
+                head->prev_ = this;
+            }
+
+        public:
+
+            hook( )
+                :expires_(0)
+            {
+                prev_ = next_ = nullptr;
+            }
+
+            explicit hook( std::function<void ()> call )
+                :expires_(0)
+                ,call_(std::move(call))
+            {
+                prev_ = next_ = nullptr;
+            }
+
+            hook( const hook & ) = delete;
+            hook &operator = ( const hook & ) = delete;
+
+            ~hook( )
+            {
+                unlink( );
+            }
+
+            void set_callback( std::function<void ()> call )
+            {
+                call_ = std::move(call);
+            }
+
+            bool linked( ) const
+            {
+                return next_ != nullptr;
+            }
+
+            std::uint64_t expires( ) const
+            {
+                return expires_;
+            }
+
+            void unlink( )
+            {
+                if( next_ ) {
+                    prev_->next_ = next_;
+                    next_->prev_ = prev_;
+                    prev_ = next_ = nullptr;
+                }
+            }
+        };
+
+        typedef delayed_call::milliseconds          milliseconds;
+        typedef delayed_call::microseconds          microseconds;
+        typedef delayed_call::seconds               seconds;
+        typedef timer::monotonic_traits::duration_type duration_type;
+
+    private:
+
+        enum {
+            ROOT_BITS   = 8,
+            LEVEL_BITS  = 6,
+            LEVELS      = 3,
+            ROOT_SIZE   = 1 << ROOT_BITS,
+            LEVEL_SIZE  = 1 << LEVEL_BITS,
+            ROOT_MASK   = ROOT_SIZE - 1,
+            LEVEL_MASK  = LEVEL_SIZE - 1
+        };
+
+        static const std::uint64_t max_ticks =
+                ( 1ull << ( ROOT_BITS + LEVELS * LEVEL_BITS ) ) - 1;
+
+        link                                    slots_[ROOT_SIZE
+                                                     + LEVELS * LEVEL_SIZE];
+        std::uint64_t                           current_;
+
+        delayed_call                            dcall_;
+        duration_type                           tick_;
+        timer::monotonic_traits::time_type      start_;
+        bool                                    running_;
+
+        static void init_head( link &head )
+        {
+            head.prev_ = head.next_ = &head;
+        }
+
+        static bool head_empty( const link &head )
+        {
+            return head.next_ == &head;
+        }
+
+        /// moves all the hooks from 'from' to the empty 'to'
+        static void splice( link &from, link &to )
+        {
+            if( head_empty( from ) ) {
+                init_head( to );
+            } else {
+                to.next_ = from.next_;
+                to.prev_ = from.prev_;
+                to.next_->prev_ = &to;
+                to.prev_->next_ = &to;
+                init_head( from );
+            }
+        }
+
+        link *level_slots( unsigned level )
+        {
+            return &slots_[ROOT_SIZE + ( level - 1 ) * LEVEL_SIZE];
+        }
+
+        static unsigned level_shift( unsigned level )
+        {
+            return ROOT_BITS + ( level - 1 ) * LEVEL_BITS;
+        }
+
+        void add( hook &h )
+        {
+            link *head = nullptr;
+            if( h.expires_ < current_ ) {
+                head = &slots_[current_ & ROOT_MASK];
+            } else {
+                std::uint64_t idx = h.expires_ - current_;
+                if( idx < ROOT_SIZE ) {
+                    head = &slots_[h.expires_ & ROOT_MASK];
+                } else {
+                    if( idx > max_ticks ) {
+                        h.expires_ = current_ + max_ticks;
+                    }
+                    unsigned level = 1;
+                    while( ( level < LEVELS ) &&
+                           ( idx >= ( 1ull << level_shift( level + 1 ) ) ) )
+                    {
+                        ++level;
+                    }
+                    std::uint64_t pos = h.expires_ >> level_shift( level );
+                    head = &level_slots( level )[pos & LEVEL_MASK];
+                }
+            }
+            h.link_before( head );
+        }
+
+        /// re-adds the slot that comes due; returns its index
+        std::size_t cascade( unsigned level )
+        {
+            std::size_t index = ( current_ >> level_shift( level ) )
+                              & LEVEL_MASK;
+            link tmp;
+            splice( level_slots( level )[index], tmp );
+            while( !head_empty( tmp ) ) {
+                hook *h = static_cast<hook *>(tmp.next_);
+                h->unlink( );
+                add( *h );
+            }
+            return index;
+        }
+
+        std::size_t tick_once( )
+        {
+            std::size_t index = current_ & ROOT_MASK;
+            if( !index && !cascade( 1 ) && !cascade( 2 ) ) {
+                cascade( 3 );
+            }
+            ++current_;
+
+            std::size_t fired = 0;
+            link work;
+            splice( slots_[index], work );
+            while( !head_empty( work ) ) {
+                hook *h = static_cast<hook *>(work.next_);
+                h->unlink( );
+                ++fired;
+                if( h->call_ ) {
+                    h->call_( );
+                }
+            }
+            return fired;
+        }
+
+        std::uint64_t elapsed_ticks( ) const
+        {
+            auto passed = timer::monotonic_traits::subtract(
+                        timer::monotonic_traits::now( ), start_ );
+            return static_cast<std::uint64_t>(
+                        passed.total_microseconds( ) /
+                        tick_.total_microseconds( ) );
+        }
+
+        void arm( )
+        {
+            dcall_.call_from_now( [this]( const boost::system::error_code &e )
+            {
+                if( !e && running_ ) {
+                    advance_to( elapsed_ticks( ) );
+                    arm( );
+                }
+            }, tick_ );
+        }
+
+    public:
+
+        timer_wheel( boost::asio::io_service &ios,
+                     const duration_type &tick )
+            :current_(0)
+            ,dcall_(ios)
+            ,tick_(tick)
+            ,start_(timer::monotonic_traits::now( ))
+            ,running_(false)
+        {
+            for( auto &s: slots_ ) {
+                init_head( s );
+            }
+        }
+
+        timer_wheel( const timer_wheel & ) = delete;
+        timer_wheel &operator = ( const timer_wheel & ) = delete;
+
+        ~timer_wheel( )
+        {
+            stop( );
+            for( auto &s: slots_ ) {
+                while( !head_empty( s ) ) {
+                    static_cast<hook *>(s.next_)->unlink( );
+                }
+            }
+        }
+
+        /// drives the wheel from the io_service, one tick per period
+        void start( )
+        {
+            running_ = true;
+            arm( );
+        }
+
+        void stop( )
+        {
+            running_ = false;
+            dcall_.cancel( );
+        }
+
+        std::uint64_t now( ) const
+        {
+            return current_;
+        }
+
+        const duration_type &tick( ) const
+        {
+            return tick_;
+        }
+
+        std::uint64_t to_ticks( const duration_type &d ) const
+        {
+            const std::int64_t tick = tick_.total_microseconds( );
+            std::uint64_t res = static_cast<std::uint64_t>(
+                    ( d.total_microseconds( ) + tick - 1 ) / tick );
+            return res ? res : 1;
+        }
+
+        /// (re)schedules the hook 'ticks' ticks from now
+        void schedule( hook &h, std::uint64_t ticks )
+        {
+            h.unlink( );
+            h.expires_ = current_ + ( ticks ? ticks : 1 );
+            add( h );
+        }
+
+        void cancel( hook &h )
+        {
+            h.unlink( );
+        }
+
+        /// runs all ticks up to 'tick'; returns number of fired hooks
+        std::size_t advance_to( std::uint64_t tick )
+        {
+            std::size_t fired = 0;
+            while( current_ < tick ) {
+                fired += tick_once( );
+            }
+            return fired;
+        }
+
+    };
+
+}}
+
+#endif // VTRCTIMERWHEEL_H